@@ -73,6 +73,22 @@ static const Multiplier UNIVERSAL[] = {{'n', 1}, {'u', 1000}, {'m', 1000000}, {'
 //     flat[=N]         - dump top N methods (aka flat profile)
 //     samples          - count the number of samples (default)
 //     total            - count the total value (time, bytes, etc.) instead of samples
+//     kdformat=FORMAT  - encoding of the kd-* event stream: text (default) or binary
+//     stackids         - define each CPU stack once and emit samples as stack IDs
+//     framedict        - define each frame name once and emit stack frames as name IDs
+//     kdworkers=N      - number of threads symbolizing CPU samples (default: 1)
+//     kdflush=TIME     - buffer kd-* records and write them from a background thread every TIME
+//                        (with lock events records are always buffered, every 100ms by default)
+//     kdbuffer=N       - size of each kd-* append buffer in bytes (default: 256 KB)
+//     kdshm=PATH       - stream kd-* records through shared memory to the consumer listening at PATH
+//     kdshmsize=N      - size of the kd-* shared memory ring in bytes (default: 4 MB)
+//     lockstack=MODE   - when to symbolize lock wait stacks: lazy (default, only reported waits), eager or none
+//     lockhist=TIME    - count every lock wait in per lock class histograms, emitted every TIME
+//     lockgraph=TIME   - every TIME, report the threads blocking others the most and deadlocks among lock waiters
+//     lockttl=TIME     - forget the last holder of an uncontended lock after TIME (default: 30s)
+//     locksamples=BOOL - also record contended locks as profiler samples for flame graphs and JFR (default: true)
+//     tracemem=N       - keep call traces within N bytes (at least 32 MB), evicting the least sampled ones
+//     tracetree        - store call traces as a tree of frames shared by traces with a common bottom
 //     chunksize=N      - approximate size of JFR chunk in bytes (default: 100 MB)
 //     chunktime=N      - duration of JFR chunk in seconds (default: 1 hour)
 //     timeout=TIME     - automatically stop profiler at TIME (absolute or relative)
@@ -191,6 +207,84 @@ Error Arguments::parse(const char* args) {
             CASE("total")
                 _counter = COUNTER_TOTAL;
 
+            CASE("kdformat")
+                if (value == NULL || strcmp(value, "text") == 0) {
+                    _kd_format = KD_FORMAT_TEXT;
+                } else if (strcmp(value, "binary") == 0) {
+                    _kd_format = KD_FORMAT_BINARY;
+                } else {
+                    msg = "kdformat must be text or binary";
+                }
+
+            CASE("stackids")
+                _stack_ids = true;
+
+            CASE("framedict")
+                _frame_dict = true;
+
+            CASE("kdworkers")
+                if (value == NULL || (_kd_workers = atoi(value)) <= 0) {
+                    msg = "Invalid kdworkers";
+                }
+
+            CASE("kdflush")
+                if (value == NULL || (_kd_flush = parseUnits(value, NANOS)) <= 0) {
+                    msg = "Invalid kdflush";
+                }
+
+            CASE("kdbuffer")
+                if (value == NULL || (_kd_buffer = parseUnits(value, BYTES)) <= 0) {
+                    msg = "Invalid kdbuffer";
+                }
+
+            CASE("kdshm")
+                if (value == NULL || value[0] == 0) {
+                    msg = "kdshm must specify the consumer socket path";
+                }
+                _kd_shm = value;
+
+            CASE("kdshmsize")
+                if (value == NULL || (_kd_shm_size = parseUnits(value, BYTES)) <= 0) {
+                    msg = "Invalid kdshmsize";
+                }
+
+            CASE("lockstack")
+                if (value == NULL || strcmp(value, "lazy") == 0) {
+                    _lock_stack = LOCK_STACK_LAZY;
+                } else if (strcmp(value, "eager") == 0) {
+                    _lock_stack = LOCK_STACK_EAGER;
+                } else if (strcmp(value, "none") == 0) {
+                    _lock_stack = LOCK_STACK_NONE;
+                } else {
+                    msg = "lockstack must be lazy, eager or none";
+                }
+
+            CASE("lockhist")
+                if (value == NULL || (_lock_hist = parseUnits(value, NANOS)) <= 0) {
+                    msg = "Invalid lockhist";
+                }
+
+            CASE("lockgraph")
+                if (value == NULL || (_lock_graph = parseUnits(value, NANOS)) <= 0) {
+                    msg = "Invalid lockgraph";
+                }
+
+            CASE("lockttl")
+                if (value == NULL || (_lock_ttl = parseUnits(value, NANOS)) <= 0) {
+                    msg = "Invalid lockttl";
+                }
+
+            CASE("locksamples")
+                _lock_samples = value == NULL || strcmp(value, "true") == 0;
+
+            CASE("tracemem")
+                if (value == NULL || (_trace_mem = parseUnits(value, BYTES)) <= 0) {
+                    msg = "Invalid tracemem";
+                }
+
+            CASE("tracetree")
+                _trace_tree = true;
+
             CASE("chunksize")
                 if (value == NULL || (_chunk_size = parseUnits(value, BYTES)) < 0) {
                     msg = "Invalid chunksize";
@@ -81,6 +81,17 @@ enum Output {
     OUTPUT_JFR
 };
 
+enum KdFormat {
+    KD_FORMAT_TEXT,
+    KD_FORMAT_BINARY
+};
+
+enum LockStack {
+    LOCK_STACK_LAZY,
+    LOCK_STACK_EAGER,
+    LOCK_STACK_NONE
+};
+
 enum JfrOption {
     NO_SYSTEM_INFO  = 0x1,
     NO_SYSTEM_PROPS = 0x2,
@@ -159,6 +170,21 @@ class Arguments {
     int _style;
     CStack _cstack;
     Output _output;
+    KdFormat _kd_format;
+    bool _stack_ids;
+    bool _frame_dict;
+    int _kd_workers;
+    long _kd_flush;
+    long _kd_buffer;
+    const char* _kd_shm;
+    long _kd_shm_size;
+    LockStack _lock_stack;
+    long _lock_hist;
+    long _lock_graph;
+    long _lock_ttl;
+    bool _lock_samples;
+    long _trace_mem;
+    bool _trace_tree;
     long _chunk_size;
     long _chunk_time;
     const char* _jfr_sync;
@@ -204,6 +230,21 @@ class Arguments {
         _style(0),
         _cstack(CSTACK_DEFAULT),
         _output(OUTPUT_NONE),
+        _kd_format(KD_FORMAT_TEXT),
+        _stack_ids(false),
+        _frame_dict(false),
+        _kd_workers(1),
+        _kd_flush(0),
+        _kd_buffer(256 * 1024),
+        _kd_shm(NULL),
+        _kd_shm_size(4 * 1024 * 1024),
+        _lock_stack(LOCK_STACK_LAZY),
+        _lock_hist(0),
+        _lock_graph(0),
+        _lock_ttl(30000000000L),
+        _lock_samples(true),
+        _trace_mem(0),
+        _trace_tree(false),
         _chunk_size(100 * 1024 * 1024),
         _chunk_time(3600),
         _jfr_sync(NULL),
@@ -0,0 +1,127 @@
+/*
+ * Copyright 2022 The Kindling Authors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include <string.h>
+#include "callTraceBuffer.h"
+#include "os.h"
+
+
+CallTraceBufferTable::CallTraceBufferTable() : _buffer_size(0), _retired(NULL) {
+    _pages = (ThreadTraceBuffer** volatile*)OS::safeAlloc(MAX_TRACE_BUFFER_PAGES * sizeof(ThreadTraceBuffer**));
+}
+
+CallTraceBufferTable::~CallTraceBufferTable() {
+    retireBuffers();
+    releaseRetired();
+    OS::safeFree((void*)_pages, MAX_TRACE_BUFFER_PAGES * sizeof(ThreadTraceBuffer**));
+}
+
+void CallTraceBufferTable::retireBuffers() {
+    for (u32 i = 0; i < MAX_TRACE_BUFFER_PAGES; i++) {
+        ThreadTraceBuffer** page = _pages[i];
+        if (page == NULL) {
+            continue;
+        }
+        for (u32 j = 0; j < TRACE_BUFFER_PAGE_CAPACITY; j++) {
+            ThreadTraceBuffer* buffer = page[j];
+            if (buffer != NULL) {
+                __atomic_store_n(&page[j], (ThreadTraceBuffer*)NULL, __ATOMIC_RELEASE);
+                // A handler never writes these fields, even if it still uses the buffer
+                buffer->_next_retired = _retired;
+                buffer->_retired_size = _buffer_size;
+                _retired = buffer;
+            }
+        }
+    }
+}
+
+void CallTraceBufferTable::reset(int max_frames) {
+    size_t buffer_size = sizeof(ThreadTraceBuffer) + max_frames * sizeof(CallTraceBuffer);
+    if (buffer_size != _buffer_size) {
+        retireBuffers();
+        _buffer_size = buffer_size;
+    }
+}
+
+void CallTraceBufferTable::releaseRetired() {
+    while (_retired != NULL) {
+        ThreadTraceBuffer* buffer = _retired;
+        _retired = buffer->_next_retired;
+        OS::safeFree(buffer, buffer->_retired_size);
+    }
+}
+
+ThreadTraceBuffer** CallTraceBufferTable::slot(int tid, bool create) {
+    if (tid < 0 || _pages == NULL) {
+        return NULL;
+    }
+
+    u32 page_index = (u32)tid / TRACE_BUFFER_PAGE_CAPACITY;
+    ThreadTraceBuffer** page = __atomic_load_n(&_pages[page_index], __ATOMIC_ACQUIRE);
+    if (page == NULL) {
+        if (!create) {
+            return NULL;
+        }
+        page = (ThreadTraceBuffer**)OS::safeAlloc(TRACE_BUFFER_PAGE_CAPACITY * sizeof(ThreadTraceBuffer*));
+        if (page == NULL) {
+            return NULL;
+        }
+        ThreadTraceBuffer** old_page = __sync_val_compare_and_swap(&_pages[page_index], NULL, page);
+        if (old_page != NULL) {
+            OS::safeFree(page, TRACE_BUFFER_PAGE_CAPACITY * sizeof(ThreadTraceBuffer*));
+            page = old_page;
+        }
+    }
+    return &page[(u32)tid % TRACE_BUFFER_PAGE_CAPACITY];
+}
+
+ThreadTraceBuffer* CallTraceBufferTable::acquire(int tid) {
+    ThreadTraceBuffer** s = slot(tid, true);
+    if (s == NULL) {
+        return NULL;
+    }
+
+    ThreadTraceBuffer* buffer = __atomic_load_n(s, __ATOMIC_ACQUIRE);
+    if (buffer == NULL) {
+        // Fresh anonymous memory is zeroed, so the buffer starts out free
+        buffer = (ThreadTraceBuffer*)OS::safeAlloc(_buffer_size);
+        if (buffer == NULL) {
+            return NULL;
+        }
+        ThreadTraceBuffer* old_buffer = __sync_val_compare_and_swap(s, NULL, buffer);
+        if (old_buffer != NULL) {
+            OS::safeFree(buffer, _buffer_size);
+            buffer = old_buffer;
+        }
+    }
+
+    return __sync_bool_compare_and_swap(&buffer->_busy, 0, 1) ? buffer : NULL;
+}
+
+void CallTraceBufferTable::forget(int tid) {
+    ThreadTraceBuffer** s = slot(tid, false);
+    if (s == NULL) {
+        return;
+    }
+
+    // A signal arriving meanwhile finds the buffer busy or gone
+    ThreadTraceBuffer* buffer = __atomic_load_n(s, __ATOMIC_ACQUIRE);
+    if (buffer != NULL && __sync_bool_compare_and_swap(&buffer->_busy, 0, 1)) {
+        __atomic_store_n(s, (ThreadTraceBuffer*)NULL, __ATOMIC_RELEASE);
+        OS::safeFree(buffer, _buffer_size);
+    }
+}
@@ -0,0 +1,82 @@
+/*
+ * Copyright 2022 The Kindling Authors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#ifndef _CALLTRACEBUFFER_H
+#define _CALLTRACEBUFFER_H
+
+#include <jvmti.h>
+#include "arch.h"
+#include "vmEntry.h"
+
+
+// Thread IDs covered by one page of buffer pointers
+const u32 TRACE_BUFFER_PAGE_CAPACITY = 16384;
+const u32 MAX_TRACE_BUFFER_PAGES = (1U << 31) / TRACE_BUFFER_PAGE_CAPACITY;
+
+
+union CallTraceBuffer {
+    ASGCT_CallFrame _asgct_frames[1];
+    jvmtiFrameInfo _jvmti_frames[1];
+};
+
+struct ThreadTraceBuffer {
+    volatile int _busy;
+    // Links the buffers retired by reset() and their sizes until releaseRetired()
+    ThreadTraceBuffer* _next_retired;
+    size_t _retired_size;
+    CallTraceBuffer _trace;
+};
+
+// Stack walking scratch space owned by a single thread, so that concurrent signals
+// on different threads never compete for a buffer. Buffers are mmapped on the first sample
+// of a thread and are reused by later threads with the same ID.
+// acquire() and release() are lock-free and signal-safe.
+class CallTraceBufferTable {
+  private:
+    ThreadTraceBuffer** volatile* _pages;
+    size_t _buffer_size;
+    ThreadTraceBuffer* _retired;
+
+    ThreadTraceBuffer** slot(int tid, bool create);
+    void retireBuffers();
+
+  public:
+    CallTraceBufferTable();
+    ~CallTraceBufferTable();
+
+    // Makes buffers hold max_frames frames; buffers of the right size are kept for the next session.
+    // Buffers of a different size are unlinked from their threads but stay mapped until
+    // releaseRetired(), since a late signal handler may have loaded one just before.
+    void reset(int max_frames);
+
+    // Frees the buffers retired by reset(). Called when profiling stops: by then no signal handler
+    // can still hold a buffer that was unlinked when profiling started
+    void releaseRetired();
+
+    // Returns NULL if the buffer cannot be allocated or is already in use by the same thread,
+    // i.e. a signal interrupted another sample
+    ThreadTraceBuffer* acquire(int tid);
+
+    void release(ThreadTraceBuffer* buffer) {
+        __atomic_store_n(&buffer->_busy, 0, __ATOMIC_RELEASE);
+    }
+
+    // Called by an exiting thread to unmap its own buffer
+    void forget(int tid);
+};
+
+#endif // _CALLTRACEBUFFER_H
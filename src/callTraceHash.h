@@ -0,0 +1,49 @@
+/*
+ * Copyright 2022 The Kindling Authors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#ifndef _CALLTRACEHASH_H
+#define _CALLTRACEHASH_H
+
+#include "arch.h"
+#include "vmEntry.h"
+
+
+// Hash functions of a call trace. CallTraceStorage picks best() once; all of them are
+// exposed so that test/calltracehash can compare their quality and speed.
+//
+//   wide   - 64x64->128 bit multiplications in 4 independent lanes (64-bit targets)
+//   crc32c - two hardware CRC32C lanes (SSE4.2, checked at runtime) for i386, which has no wide multiply
+//   murmur - portable MurmurHash64A, the fallback
+class CallTraceHash {
+  public:
+    typedef u64 (*Func)(int num_frames, ASGCT_CallFrame* frames);
+
+    static u64 murmur(int num_frames, ASGCT_CallFrame* frames);
+
+#ifdef __SIZEOF_INT128__
+    static u64 wide(int num_frames, ASGCT_CallFrame* frames);
+#endif
+
+#ifdef __i386__
+    static bool hasCrc32c();
+    static u64 crc32c(int num_frames, ASGCT_CallFrame* frames);
+#endif
+
+    static Func best();
+};
+
+#endif // _CALLTRACEHASH_H
@@ -15,14 +15,40 @@
  */
 
 #include <string.h>
+#include <algorithm>
 #include "callTraceStorage.h"
 #include "os.h"
 
 
-static const u32 INITIAL_CAPACITY = 65536;
-static const u32 CALL_TRACE_CHUNK = 8 * 1024 * 1024;
+// Per shard: 16 shards together start with the 64K slots of the former single table
+static const u32 INITIAL_CAPACITY = 4096;
+static const u32 MAX_CAPACITY = 1 << 25;
+static const u32 CALL_TRACE_CHUNK = 1024 * 1024;
 static const u32 OVERFLOW_TRACE_ID = 0x7fffffff;
 
+// With a memory budget, generations take turns in this many ID ranges, so that IDs stay
+// bounded. An ID is reused only two compactions after its generation has been freed.
+static const u32 ID_GENERATIONS = 4;
+static const u32 MAX_BOUNDED_CAPACITY = MAX_CAPACITY / ID_GENERATIONS;
+static const u32 MIN_CALL_TRACE_CHUNK = 64 * 1024;
+// A table that cannot grow fills up; bound the probing a signal handler does in a full table
+static const u32 BOUNDED_MAX_PROBES = 64;
+// Below 1 MB per shard generation the initial table would leave little room for traces
+static const size_t MIN_BUDGET = CALL_TRACE_SHARDS * 2 * 1024 * 1024;
+
+// collectSamples() keys of the samples that belonged to evicted traces or found no free slot
+static const u64 EVICTED_KEY = 0;
+static const u64 OVERFLOW_KEY = OVERFLOW_TRACE_ID;
+
+// Frame tree (tracetree): nodes of all traces of a shard generation
+static const u32 INITIAL_NODE_CAPACITY = 16384;
+static const u32 MAX_NODE_CAPACITY = 1 << 26;
+
+
+static inline size_t callTraceSize(int num_frames) {
+    return sizeof(CallTrace) - sizeof(ASGCT_CallFrame) + num_frames * sizeof(ASGCT_CallFrame);
+}
+
 
 class LongHashTable {
   private:
@@ -33,12 +59,12 @@ class LongHashTable {
     volatile u32 _size;
     u32 _padding2[15];
 
+  public:
     static size_t getSize(u32 capacity) {
         size_t size = sizeof(LongHashTable) + (sizeof(u64) + sizeof(CallTraceSample)) * capacity;
         return (size + OS::page_mask) & ~OS::page_mask;
     }
 
-  public:
     static LongHashTable* allocate(LongHashTable* prev, u32 capacity) {
         LongHashTable* table = (LongHashTable*)OS::safeAlloc(getSize(capacity));
         if (table != NULL) {
@@ -85,31 +111,435 @@ class LongHashTable {
     }
 };
 
+// A frame of the tree that traces of a generation share their bottom frames in.
+// A stored trace is the node of its topmost frame; the root node has no frame
+struct FrameNode {
+    FrameNode* parent;
+    jmethodID method_id;
+    jint bci;
+    int depth;
 
-CallTrace CallTraceStorage::_overflow_trace = {1, {BCI_ERROR, (jmethodID)"storage_overflow"}};
+    bool matches(FrameNode* p, const ASGCT_CallFrame& frame) {
+        return parent == p && method_id == frame.method_id && bci == frame.bci;
+    }
+};
 
-CallTraceStorage::CallTraceStorage() : _allocator(CALL_TRACE_CHUNK) {
-    _current_table = LongHashTable::allocate(NULL, INITIAL_CAPACITY);
-    _overflow = 0;
+static inline u64 frameNodeHash(FrameNode* parent, const ASGCT_CallFrame& frame) {
+    // Finalizer of MurmurHash3: pointers differ in a few middle bits only
+    u64 h = (u64)parent * 0x9e3779b97f4a7c15ULL ^ (u64)frame.method_id ^ (u32)frame.bci;
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    return h ^ (h >> 33);
 }
 
-CallTraceStorage::~CallTraceStorage() {
-    while (_current_table != NULL) {
-        _current_table = _current_table->destroy();
+// Set of FrameNodes keyed by (parent, frame), grown by chaining just like LongHashTable
+class FrameNodeTable {
+  private:
+    FrameNodeTable* _prev;
+    u32 _capacity;
+    volatile u32 _size;
+
+  public:
+    static size_t getSize(u32 capacity) {
+        size_t size = sizeof(FrameNodeTable) + sizeof(FrameNode*) * capacity;
+        return (size + OS::page_mask) & ~OS::page_mask;
+    }
+
+    static FrameNodeTable* allocate(FrameNodeTable* prev, u32 capacity) {
+        FrameNodeTable* table = (FrameNodeTable*)OS::safeAlloc(getSize(capacity));
+        if (table != NULL) {
+            table->_prev = prev;
+            table->_capacity = capacity;
+            table->_size = 0;
+        }
+        return table;
+    }
+
+    FrameNodeTable* destroy() {
+        FrameNodeTable* prev = _prev;
+        OS::safeFree(this, getSize(_capacity));
+        return prev;
+    }
+
+    FrameNodeTable* prev() {
+        return _prev;
     }
+
+    u32 capacity() {
+        return _capacity;
+    }
+
+    u32 incSize() {
+        return __sync_add_and_fetch(&_size, 1);
+    }
+
+    FrameNode** nodes() {
+        return (FrameNode**)(this + 1);
+    }
+
+    FrameNode* find(FrameNode* parent, const ASGCT_CallFrame& frame) {
+        FrameNode** nodes = this->nodes();
+        u32 slot = frameNodeHash(parent, frame) & (_capacity - 1);
+        for (u32 step = 0; step < _capacity; slot = (slot + ++step) & (_capacity - 1)) {
+            FrameNode* node = __atomic_load_n(&nodes[slot], __ATOMIC_ACQUIRE);
+            if (node == NULL || node->matches(parent, frame)) {
+                return node;
+            }
+        }
+        return NULL;
+    }
+};
+
+// Fills dst with the frames from the leaf down to the root, i.e. topmost frame first
+static CallTrace* copyFrames(FrameNode* leaf, CallTrace* dst) {
+    if (dst != NULL) {
+        dst->num_frames = leaf->depth;
+        int i = 0;
+        for (FrameNode* node = leaf; node->depth > 0; node = node->parent) {
+            dst->frames[i].bci = node->bci;
+            dst->frames[i].method_id = node->method_id;
+            i++;
+        }
+    }
+    return dst;
 }
 
-void CallTraceStorage::clear() {
-    while (_current_table->prev() != NULL) {
-        _current_table = _current_table->destroy();
+static CallTrace* copyTrace(CallTrace* src, CallTrace* dst) {
+    if (dst != NULL) {
+        memcpy(dst, src, callTraceSize(src->num_frames));
     }
-    _current_table->clear();
-    _allocator.clear();
+    return dst;
+}
+
+CallTrace* CallTraceHolder::reserve(int num_frames) {
+    if (num_frames > _capacity) {
+        CallTrace* trace = (CallTrace*)realloc(_trace, callTraceSize(num_frames));
+        if (trace == NULL) {
+            return NULL;
+        }
+        _trace = trace;
+        _capacity = num_frames;
+    }
+    return _trace;
+}
+
+
+
+// A hash table chain with the allocator of its traces. Slot IDs of a generation start at _id_base.
+// Without a memory budget a shard has one generation for the whole profiling session.
+// In a tree generation, the trace of a table value points to a FrameNode rather than a CallTrace.
+class CallTraceGeneration {
+  public:
+    LinearAllocator _allocator;
+    LongHashTable* volatile _table;
+    LongHashTable* _first;
+    u32 _id_base;
+    bool _tree;
+    FrameNodeTable* volatile _nodes;
+    FrameNode* _root;
+    // Counter each survivor brought from the previous generation; only used for ranking
+    std::map<u64, u64> _carried;
+
+    CallTraceGeneration(size_t chunk_size, u32 capacity, u32 id_base, bool tree) :
+        _allocator(chunk_size), _id_base(id_base), _tree(tree), _nodes(NULL), _root(NULL) {
+        _first = _table = LongHashTable::allocate(NULL, capacity);
+        if (tree) {
+            _nodes = FrameNodeTable::allocate(NULL, INITIAL_NODE_CAPACITY);
+            _root = (FrameNode*)_allocator.alloc(sizeof(FrameNode));
+            if (_root != NULL) {
+                memset(_root, 0, sizeof(FrameNode));
+            }
+        }
+    }
+
+    ~CallTraceGeneration() {
+        while (_table != NULL) {
+            _table = _table->destroy();
+        }
+        while (_nodes != NULL) {
+            _nodes = _nodes->destroy();
+        }
+    }
+
+    size_t memory() {
+        size_t size = _allocator.size();
+        for (LongHashTable* table = _table; table != NULL; table = table->prev()) {
+            size += LongHashTable::getSize(table->capacity());
+        }
+        for (FrameNodeTable* nodes = _nodes; nodes != NULL; nodes = nodes->prev()) {
+            size += FrameNodeTable::getSize(nodes->capacity());
+        }
+        return size;
+    }
+
+    bool isNode(CallTrace* trace) {
+        return _tree && trace != &CallTraceStorage::_overflow_trace;
+    }
+
+    // Sums up the samples of every stack; after growth a stack may occupy a slot in several tables
+    void totals(std::map<u64, CallTraceSample>& map) {
+        for (LongHashTable* table = _table; table != NULL; table = table->prev()) {
+            u64* keys = table->keys();
+            CallTraceSample* values = table->values();
+            u32 capacity = table->capacity();
+
+            for (u32 slot = 0; slot < capacity; slot++) {
+                if (keys[slot] != 0 && values[slot].acquireTrace() != NULL) {
+                    map[keys[slot]] += values[slot];
+                }
+            }
+        }
+    }
+};
+
+// One independent hash table chain with its own allocator.
+// Slot IDs are local to the shard; CallTraceStorage adds the shard index to the low bits.
+//
+// With a memory budget, compact() replaces a generation that has grown too large with a new one
+// holding only the traces sampled most since the previous compaction. Samples of the other
+// traces are kept in a single evicted_traces entry. put() and getCallTrace() run inside an epoch,
+// so the replaced generation is retired only when no signal handler can still be using it.
+// It stays readable by ID until the next compaction for the benefit of pending events.
+// JFR writes the traces of a chunk only when the chunk ends, so with JFR output compaction
+// runs right after that, once per chunk, and the IDs of a chunk are never renumbered or reused.
+//
+// With tracetree, a trace is stored as a path of the generation's frame tree: put() only adds
+// the frames that no earlier trace of the shard had below the same bottom. Collected traces are
+// rebuilt into an arena of the caller.
+class CallTraceShard {
+  private:
+    static CallTrace _evicted_trace;
+
+    CallTraceGeneration* volatile _current;
+    CallTraceGeneration* volatile _retired;
+    u32 _generations;
+    u32 _max_capacity;
+    size_t _budget;
+    size_t _chunk_size;
+    bool _tree;
+    volatile u64 _overflow;
+    u64 _compacted_overflow;
+    CallTraceSample _evicted;
+    CallTraceSample _overflowed;
+    // Keep hot fields of adjacent shards on different cache lines
+    char _padding0[64];
+    volatile u32 _epoch;
+    volatile int _active[2];
+    char _padding1[64];
+
+    u32 enter();
+    void leave(u32 epoch);
+
+    u32 range() {
+        return _max_capacity * 2;
+    }
+
+    CallTraceGeneration* newGeneration(u32 capacity);
+    CallTrace* storeCallTrace(CallTraceGeneration* gen, int num_frames, ASGCT_CallFrame* frames);
+    FrameNodeTable* growNodes(CallTraceGeneration* gen, FrameNodeTable* table);
+    FrameNode* addNode(CallTraceGeneration* gen, FrameNode* parent, const ASGCT_CallFrame& frame, bool& fresh);
+    bool retryStore(CallTraceGeneration* gen, CallTraceSample& s, int num_frames, ASGCT_CallFrame* frames);
+    CallTrace* expand(CallTraceGeneration* gen, CallTrace* trace, LinearAllocator* arena);
+    CallTrace* findCallTrace(LongHashTable* table, u64 hash);
+    CallTraceSample* findSample(LongHashTable* table, u64 hash);
+    void collectTraces(CallTraceGeneration* gen, std::map<u32, CallTrace*>& map, u32 shard_index, LinearAllocator* arena);
+
+  public:
+    CallTraceShard() : _current(NULL), _retired(NULL), _epoch(0) {
+        _active[0] = _active[1] = 0;
+        configure(0, false);
+        clear();
+    }
+
+    ~CallTraceShard() {
+        delete _retired;
+        delete _current;
+    }
+
+    u64 overflow() {
+        return _overflow;
+    }
+
+    size_t memory() {
+        return _current->memory() + (_retired != NULL ? _retired->memory() : 0);
+    }
+
+    // Budget of one generation in bytes, 0 for unbounded; takes effect with clear()
+    void configure(size_t budget, bool tree);
+    void clear();
+    void compact();
+
+    // Tree traces are rebuilt into arena
+    void collectTraces(std::map<u32, CallTrace*>& map, u32 shard_index, LinearAllocator* arena);
+    void collectSamples(std::vector<CallTraceSample*>& samples, LinearAllocator* arena);
+    void collectSamples(std::map<u64, CallTraceSample>& map, LinearAllocator* arena);
+
+    // Returns 0 on overflow
+    u32 put(u64 hash, int num_frames, ASGCT_CallFrame* frames, u64 counter);
+    CallTrace* getCallTrace(u32 slot_id, CallTraceHolder& holder, u64* key);
+};
+
+CallTrace CallTraceShard::_evicted_trace = {1, {BCI_ERROR, (jmethodID)"evicted_traces"}};
+
+static inline u32 callTraceId(u32 slot_id, u32 shard_index) {
+    return slot_id << CALL_TRACE_SHARD_BITS | shard_index;
+}
+
+// Signal-safe: only atomic counters, no waiting
+u32 CallTraceShard::enter() {
+    while (true) {
+        u32 epoch = __atomic_load_n(&_epoch, __ATOMIC_SEQ_CST);
+        __sync_fetch_and_add(&_active[epoch & 1], 1);
+        if (__atomic_load_n(&_epoch, __ATOMIC_SEQ_CST) == epoch) {
+            return epoch;
+        }
+        __sync_fetch_and_sub(&_active[epoch & 1], 1);
+    }
+}
+
+void CallTraceShard::leave(u32 epoch) {
+    __sync_fetch_and_sub(&_active[epoch & 1], 1);
+}
+
+void CallTraceShard::configure(size_t budget, bool tree) {
+    _budget = budget;
+    _tree = tree;
+    _chunk_size = CALL_TRACE_CHUNK;
+    _max_capacity = MAX_CAPACITY;
+
+    if (budget != 0) {
+        // Tables may take up to a half of the budget, counting the chain, chunks much less
+        while (_chunk_size > MIN_CALL_TRACE_CHUNK && _chunk_size * 16 > budget) {
+            _chunk_size /= 2;
+        }
+        _max_capacity = INITIAL_CAPACITY;
+        while (_max_capacity < MAX_BOUNDED_CAPACITY && LongHashTable::getSize(_max_capacity * 2) <= budget / 4) {
+            _max_capacity *= 2;
+        }
+    }
+}
+
+void CallTraceShard::clear() {
+    delete _retired;
+    delete _current;
+    _retired = NULL;
+    _generations = 0;
+    _current = newGeneration(INITIAL_CAPACITY);
     _overflow = 0;
+    _compacted_overflow = 0;
+    _evicted.trace = &_evicted_trace;
+    _evicted.samples = 0;
+    _evicted.counter = 0;
+    _overflowed.trace = &CallTraceStorage::_overflow_trace;
+    _overflowed.samples = 0;
+    _overflowed.counter = 0;
 }
 
-void CallTraceStorage::collectTraces(std::map<u32, CallTrace*>& map) {
-    for (LongHashTable* table = _current_table; table != NULL; table = table->prev()) {
+CallTraceGeneration* CallTraceShard::newGeneration(u32 capacity) {
+    u32 id_base = (_generations++ % ID_GENERATIONS) * range();
+    return new CallTraceGeneration(_chunk_size, capacity, id_base, _tree);
+}
+
+void CallTraceShard::compact() {
+    CallTraceGeneration* gen = _current;
+    if (_budget == 0 || (gen->memory() < _budget / 4 * 3 && _overflow == _compacted_overflow)) {
+        return;
+    }
+
+    // Rank traces by the counter gained since they were carried over last time
+    std::map<u64, CallTraceSample> totals;
+    gen->totals(totals);
+
+    std::vector<std::pair<u64, u64> > ranking;
+    for (std::map<u64, CallTraceSample>::const_iterator it = totals.begin(); it != totals.end(); ++it) {
+        if (it->second.trace == &CallTraceStorage::_overflow_trace) {
+            continue;
+        }
+        std::map<u64, u64>::const_iterator carried = gen->_carried.find(it->first);
+        u64 gained = it->second.counter - (carried == gen->_carried.end() ? 0 : carried->second);
+        if (gained > 0) {
+            ranking.push_back(std::make_pair(gained, it->first));
+        }
+    }
+    std::sort(ranking.rbegin(), ranking.rend());
+
+    // Survivors may fill a quarter of the budget, leaving the rest for new traces.
+    // Tree traces are counted as if they shared no nodes
+    size_t survivor_bytes = 0;
+    size_t survivors = 0;
+    while (survivors < ranking.size() && survivors < _max_capacity / 2) {
+        CallTrace* trace = totals[ranking[survivors].second].trace;
+        size_t bytes = gen->_tree ? ((FrameNode*)trace)->depth * sizeof(FrameNode) : callTraceSize(trace->num_frames);
+        if (survivor_bytes + bytes > _budget / 4) {
+            break;
+        }
+        survivor_bytes += bytes;
+        survivors++;
+    }
+
+    u32 capacity = INITIAL_CAPACITY;
+    while (capacity < survivors * 2 && capacity < _max_capacity) {
+        capacity *= 2;
+    }
+
+    CallTraceGeneration* new_gen = newGeneration(capacity);
+    LongHashTable* table = new_gen->_first;
+    CallTraceHolder holder;
+    for (size_t i = 0; i < survivors; i++) {
+        u64 hash = ranking[i].second;
+        CallTrace* src = totals[hash].trace;
+        if (gen->_tree && (src = copyFrames((FrameNode*)src, holder.reserve(((FrameNode*)src)->depth))) == NULL) {
+            break;
+        }
+        CallTrace* trace = storeCallTrace(new_gen, src->num_frames, src->frames);
+        if (trace == NULL) {
+            break;
+        }
+
+        u64* keys = table->keys();
+        u32 slot = hash & (capacity - 1);
+        for (u32 step = 0; keys[slot] != 0; ) {
+            slot = (slot + ++step) & (capacity - 1);
+        }
+        keys[slot] = hash;
+        table->incSize();
+        table->values()[slot].setTrace(trace);
+    }
+
+    // New samples go to the new generation; the old one is retired once its users are gone
+    CallTraceGeneration* old_retired = _retired;
+    _retired = gen;
+    __atomic_store_n(&_current, new_gen, __ATOMIC_SEQ_CST);
+
+    u32 epoch = _epoch;
+    __atomic_store_n(&_epoch, epoch + 1, __ATOMIC_SEQ_CST);
+    while (__atomic_load_n(&_active[epoch & 1], __ATOMIC_SEQ_CST) > 0) {
+        OS::sleep(100000);
+    }
+    delete old_retired;
+
+    // The retired generation is immutable now: hand its samples over
+    totals.clear();
+    gen->totals(totals);
+    for (std::map<u64, CallTraceSample>::const_iterator it = totals.begin(); it != totals.end(); ++it) {
+        CallTraceSample* s = findSample(table, it->first);
+        if (s != NULL) {
+            atomicInc(s->samples, it->second.samples);
+            atomicInc(s->counter, it->second.counter);
+            new_gen->_carried[it->first] = it->second.counter;
+        } else {
+            _evicted.samples += it->second.samples;
+            _evicted.counter += it->second.counter;
+        }
+    }
+
+    _compacted_overflow = _overflow;
+}
+
+void CallTraceShard::collectTraces(CallTraceGeneration* gen, std::map<u32, CallTrace*>& map, u32 shard_index, LinearAllocator* arena) {
+    for (LongHashTable* table = gen->_table; table != NULL; table = table->prev()) {
         u64* keys = table->keys();
         CallTraceSample* values = table->values();
         u32 capacity = table->capacity();
@@ -120,80 +550,94 @@ void CallTraceStorage::collectTraces(std::map<u32, CallTrace*>& map) {
                 values[slot].samples = 0;
                 CallTrace* trace = values[slot].acquireTrace();
                 if (trace != NULL) {
-                    map[capacity - (INITIAL_CAPACITY - 1) + slot] = trace;
+                    map[callTraceId(gen->_id_base + capacity - (INITIAL_CAPACITY - 1) + slot, shard_index)] = expand(gen, trace, arena);
                 }
             }
         }
     }
+}
 
-    if (_overflow > 0) {
-        map[OVERFLOW_TRACE_ID] = &_overflow_trace;
+// Events recorded shortly before a compaction may still refer to the retired generation
+void CallTraceShard::collectTraces(std::map<u32, CallTrace*>& map, u32 shard_index, LinearAllocator* arena) {
+    collectTraces(_current, map, shard_index, arena);
+    if (_retired != NULL) {
+        collectTraces(_retired, map, shard_index, arena);
     }
 }
 
-void CallTraceStorage::collectSamples(std::vector<CallTraceSample*>& samples) {
-    for (LongHashTable* table = _current_table; table != NULL; table = table->prev()) {
+// Samples of the retired generation have been handed over to the current one and _evicted
+// Tree traces are handed out as rebuilt copies of the samples
+void CallTraceShard::collectSamples(std::vector<CallTraceSample*>& samples, LinearAllocator* arena) {
+    CallTraceGeneration* gen = _current;
+    for (LongHashTable* table = gen->_table; table != NULL; table = table->prev()) {
         u64* keys = table->keys();
         CallTraceSample* values = table->values();
         u32 capacity = table->capacity();
 
         for (u32 slot = 0; slot < capacity; slot++) {
-            if (keys[slot] != 0) {
+            if (keys[slot] == 0) {
+                continue;
+            }
+            if (!gen->_tree) {
                 samples.push_back(&values[slot]);
+            } else {
+                CallTraceSample* copy = (CallTraceSample*)arena->alloc(sizeof(CallTraceSample));
+                if (copy != NULL) {
+                    CallTrace* trace = values[slot].acquireTrace();
+                    *copy = values[slot];
+                    copy->trace = trace != NULL ? expand(gen, trace, arena) : NULL;
+                    samples.push_back(copy);
+                }
             }
         }
     }
-}
 
-void CallTraceStorage::collectSamples(std::map<u64, CallTraceSample>& map) {
-    for (LongHashTable* table = _current_table; table != NULL; table = table->prev()) {
-        u64* keys = table->keys();
-        CallTraceSample* values = table->values();
-        u32 capacity = table->capacity();
-
-        for (u32 slot = 0; slot < capacity; slot++) {
-            if (keys[slot] != 0 && values[slot].acquireTrace() != NULL) {
-                map[keys[slot]] += values[slot];
-            }
-        }
+    if (_evicted.samples != 0) {
+        samples.push_back(&_evicted);
+    }
+    if (_overflowed.samples != 0) {
+        samples.push_back(&_overflowed);
     }
 }
 
-// Adaptation of MurmurHash64A by Austin Appleby
-u64 CallTraceStorage::calcHash(int num_frames, ASGCT_CallFrame* frames) {
-    const u64 M = 0xc6a4a7935bd1e995ULL;
-    const int R = 47;
-
-    int len = num_frames * sizeof(ASGCT_CallFrame);
-    u64 h = len * M;
-
-    const u64* data = (const u64*)frames;
-    const u64* end = data + len / 8;
-
-    while (data != end) {
-        u64 k = *data++;
-        k *= M;
-        k ^= k >> R;
-        k *= M;
-        h ^= k;
-        h *= M;
+void CallTraceShard::collectSamples(std::map<u64, CallTraceSample>& map, LinearAllocator* arena) {
+    CallTraceGeneration* gen = _current;
+    if (!gen->_tree) {
+        gen->totals(map);
+    } else {
+        // Shards hold disjoint stacks, so totals of this shard are complete before expansion
+        std::map<u64, CallTraceSample> totals;
+        gen->totals(totals);
+        for (std::map<u64, CallTraceSample>::iterator it = totals.begin(); it != totals.end(); ++it) {
+            it->second.trace = expand(gen, it->second.trace, arena);
+            map[it->first] += it->second;
+        }
     }
 
-    if (len & 4) {
-        h ^= *(u32*)data;
-        h *= M;
+    if (_evicted.samples != 0) {
+        map[EVICTED_KEY] += _evicted;
     }
+    if (_overflowed.samples != 0) {
+        map[OVERFLOW_KEY] += _overflowed;
+    }
+}
 
-    h ^= h >> R;
-    h *= M;
-    h ^= h >> R;
+CallTrace* CallTraceShard::storeCallTrace(CallTraceGeneration* gen, int num_frames, ASGCT_CallFrame* frames) {
+    if (_budget != 0 && gen->memory() >= _budget) {
+        return NULL;
+    }
 
-    return h;
-}
+    if (gen->_tree) {
+        // Walk the tree from the bottom frame up, adding the nodes that are missing
+        FrameNode* node = gen->_root;
+        bool fresh = false;
+        for (int i = num_frames - 1; i >= 0 && node != NULL; i--) {
+            node = addNode(gen, node, frames[i], fresh);
+        }
+        return (CallTrace*)node;
+    }
 
-CallTrace* CallTraceStorage::storeCallTrace(int num_frames, ASGCT_CallFrame* frames) {
-    const size_t header_size = sizeof(CallTrace) - sizeof(ASGCT_CallFrame);
-    CallTrace* buf = (CallTrace*)_allocator.alloc(header_size + num_frames * sizeof(ASGCT_CallFrame));
+    CallTrace* buf = (CallTrace*)gen->_allocator.alloc(callTraceSize(num_frames));
     if (buf != NULL) {
         buf->num_frames = num_frames;
         // Do not use memcpy inside signal handler
@@ -204,7 +648,103 @@ CallTrace* CallTraceStorage::storeCallTrace(int num_frames, ASGCT_CallFrame* fra
     return buf;
 }
 
-CallTrace* CallTraceStorage::findCallTrace(LongHashTable* table, u64 hash) {
+// Installs a node table of twice the capacity, unless a newer table is there already or
+// the limits do not allow it. Any thread that finds the table loaded may try, so that
+// a preempted thread cannot hold up growth. Returns the newest table
+FrameNodeTable* CallTraceShard::growNodes(CallTraceGeneration* gen, FrameNodeTable* table) {
+    u32 capacity = table->capacity();
+    if (gen->_nodes == table && capacity < MAX_NODE_CAPACITY &&
+        (_budget == 0 || gen->memory() + FrameNodeTable::getSize(capacity * 2) <= _budget)) {
+        FrameNodeTable* new_table = FrameNodeTable::allocate(table, capacity * 2);
+        if (new_table != NULL && !__sync_bool_compare_and_swap(&gen->_nodes, table, new_table)) {
+            new_table->destroy();
+        }
+    }
+    return gen->_nodes;
+}
+
+// Once a node had to be added, its children cannot exist yet (fresh), so there is nothing to look up.
+// A concurrent put may extend the same new node: the worst case is a duplicate child
+FrameNode* CallTraceShard::addNode(CallTraceGeneration* gen, FrameNode* parent, const ASGCT_CallFrame& frame, bool& fresh) {
+    FrameNode* spare = NULL;
+    bool allocated = false;
+
+    for (FrameNodeTable* table = gen->_nodes; table != NULL; ) {
+        FrameNode** nodes = table->nodes();
+        u32 capacity = table->capacity();
+        u32 max_steps = _budget != 0 && capacity > BOUNDED_MAX_PROBES ? BOUNDED_MAX_PROBES : capacity;
+        u32 slot = frameNodeHash(parent, frame) & (capacity - 1);
+        u32 step = 0;
+
+        while (true) {
+            FrameNode* node = __atomic_load_n(&nodes[slot], __ATOMIC_ACQUIRE);
+            if (node == NULL) {
+                if (spare == NULL) {
+                    // Share the node of a previous table to save space
+                    for (FrameNodeTable* prev = fresh ? NULL : table->prev(); prev != NULL && spare == NULL; prev = prev->prev()) {
+                        spare = prev->find(parent, frame);
+                    }
+                    if (spare == NULL) {
+                        if ((spare = (FrameNode*)gen->_allocator.alloc(sizeof(FrameNode))) == NULL) {
+                            return NULL;
+                        }
+                        spare->parent = parent;
+                        spare->method_id = frame.method_id;
+                        spare->bci = frame.bci;
+                        spare->depth = parent->depth + 1;
+                        allocated = true;
+                    }
+                }
+
+                if (!__sync_bool_compare_and_swap(&nodes[slot], NULL, spare)) {
+                    // Somebody else took the slot, possibly with the very same frame: look again
+                    continue;
+                }
+
+                fresh = fresh || allocated;
+                if (table->incSize() >= capacity * 3 / 4) {
+                    growNodes(gen, table);
+                }
+                return spare;
+            }
+
+            if (!fresh && node->matches(parent, frame)) {
+                // A spare node lost in a race stays unused until the generation is freed
+                return node;
+            }
+
+            if (++step >= max_steps) {
+                break;
+            }
+            slot = (slot + step) & (capacity - 1);
+        }
+
+        // The table is full: go on in its successor, if it has got one by now or can get one
+        FrameNodeTable* next = growNodes(gen, table);
+        if (next == table) {
+            return NULL;
+        }
+        table = next;
+    }
+    return NULL;
+}
+
+CallTrace* CallTraceShard::expand(CallTraceGeneration* gen, CallTrace* trace, LinearAllocator* arena) {
+    if (!gen->isNode(trace)) {
+        return trace;
+    }
+
+    FrameNode* leaf = (FrameNode*)trace;
+    CallTrace* copy = copyFrames(leaf, (CallTrace*)arena->alloc(callTraceSize(leaf->depth)));
+    return copy != NULL ? copy : &CallTraceStorage::_overflow_trace;
+}
+
+CallTrace* CallTraceShard::findCallTrace(LongHashTable* table, u64 hash) {
+    CallTraceSample* s = findSample(table, hash);
+    return s != NULL ? s->trace : NULL;
+}
+
+CallTraceSample* CallTraceShard::findSample(LongHashTable* table, u64 hash) {
     u64* keys = table->keys();
     u32 capacity = table->capacity();
     u32 slot = hash & (capacity - 1);
@@ -220,17 +760,20 @@ CallTrace* CallTraceStorage::findCallTrace(LongHashTable* table, u64 hash) {
         slot = (slot + step) & (capacity - 1);
     }
 
-    return table->values()[slot].trace;
+    return &table->values()[slot];
 }
 
-u32 CallTraceStorage::put(int num_frames, ASGCT_CallFrame* frames, u64 counter) {
-    u64 hash = calcHash(num_frames, frames);
+u32 CallTraceShard::put(u64 hash, int num_frames, ASGCT_CallFrame* frames, u64 counter) {
+    u32 epoch = enter();
 
-    LongHashTable* table = _current_table;
+    CallTraceGeneration* gen = _current;
+    LongHashTable* table = gen->_table;
     u64* keys = table->keys();
     u32 capacity = table->capacity();
+    u32 max_steps = _budget != 0 && capacity > BOUNDED_MAX_PROBES ? BOUNDED_MAX_PROBES : capacity;
     u32 slot = hash & (capacity - 1);
     u32 step = 0;
+    bool overflowed = false;
 
     while (keys[slot] != hash) {
         if (keys[slot] == 0) {
@@ -238,35 +781,218 @@ u32 CallTraceStorage::put(int num_frames, ASGCT_CallFrame* frames, u64 counter)
                 continue;
             }
 
-            // Increment the table size, and if the load factor exceeds 0.75, reserve a new table
-            if (table->incSize() == capacity * 3 / 4) {
+            // Increment the table size, and if the load factor exceeds 0.75, reserve a new table.
+            // The capacity is bounded to keep slot IDs clear of the shard bits and OVERFLOW_TRACE_ID
+            if (table->incSize() == capacity * 3 / 4 && capacity < _max_capacity &&
+                (_budget == 0 || gen->memory() + LongHashTable::getSize(capacity * 2) <= _budget)) {
                 LongHashTable* new_table = LongHashTable::allocate(table, capacity * 2);
                 if (new_table != NULL) {
-                    __sync_bool_compare_and_swap(&_current_table, table, new_table);
+                    __sync_bool_compare_and_swap(&gen->_table, table, new_table);
                 }
             }
 
             // Migrate from a previous table to save space
             CallTrace* trace = table->prev() == NULL ? NULL : findCallTrace(table->prev(), hash);
             if (trace == NULL) {
-                trace = storeCallTrace(num_frames, frames);
+                trace = storeCallTrace(gen, num_frames, frames);
+                if (trace == NULL) {
+                    // Out of budget: count the samples anyway until the next compaction
+                    atomicInc(_overflow);
+                    trace = &CallTraceStorage::_overflow_trace;
+                }
             }
             table->values()[slot].setTrace(trace);
+            if (trace == &CallTraceStorage::_overflow_trace && _budget == 0) {
+                overflowed = true;
+            }
             break;
         }
 
-        if (++step >= capacity) {
-            // Very unlikely case of a table overflow
+        if (++step >= max_steps) {
+            // Table overflow: unlikely, unless a memory budget stops the table from growing
             atomicInc(_overflow);
-            return OVERFLOW_TRACE_ID;
+            atomicInc(_overflowed.samples);
+            atomicInc(_overflowed.counter, counter);
+            leave(epoch);
+            return 0;
         }
         // Improved version of linear probing
         slot = (slot + step) & (capacity - 1);
     }
 
+    // Without a budget nothing evicts traces, so a trace that could not be stored is tried
+    // again by the next put of the stack. Until then its samples are counted as overflow
     CallTraceSample& s = table->values()[slot];
+    if (overflowed || (_budget == 0 && s.acquireTrace() == &CallTraceStorage::_overflow_trace &&
+                       !retryStore(gen, s, num_frames, frames))) {
+        atomicInc(_overflowed.samples);
+        atomicInc(_overflowed.counter, counter);
+        leave(epoch);
+        return 0;
+    }
+
     atomicInc(s.samples);
     atomicInc(s.counter, counter);
 
-    return capacity - (INITIAL_CAPACITY - 1) + slot;
+    u32 slot_id = gen->_id_base + capacity - (INITIAL_CAPACITY - 1) + slot;
+    leave(epoch);
+    return slot_id;
+}
+
+// Stores the trace of a slot where storing has failed before. Returns false if it fails again;
+// true also if a concurrent put has taken over, which leaves the trace in flight for a moment
+bool CallTraceShard::retryStore(CallTraceGeneration* gen, CallTraceSample& s, int num_frames, ASGCT_CallFrame* frames) {
+    if (!__sync_bool_compare_and_swap(&s.trace, &CallTraceStorage::_overflow_trace, (CallTrace*)NULL)) {
+        return s.acquireTrace() != &CallTraceStorage::_overflow_trace;
+    }
+
+    CallTrace* trace = storeCallTrace(gen, num_frames, frames);
+    s.setTrace(trace != NULL ? trace : &CallTraceStorage::_overflow_trace);
+    return trace != NULL;
+}
+
+CallTrace* CallTraceShard::getCallTrace(u32 slot_id, CallTraceHolder& holder, u64* key) {
+    u32 epoch = enter();
+    CallTrace* result = NULL;
+
+    CallTraceGeneration* gens[2] = {_current, _retired};
+    for (int i = 0; i < 2; i++) {
+        CallTraceGeneration* gen = gens[i];
+        if (gen == NULL || slot_id - gen->_id_base >= range()) {
+            continue;
+        }
+
+        // Each table owns the ID range starting right after the IDs of its predecessor
+        u32 local_id = slot_id - gen->_id_base;
+        for (LongHashTable* table = gen->_table; table != NULL; table = table->prev()) {
+            u32 capacity = table->capacity();
+            u32 base = capacity - (INITIAL_CAPACITY - 1);
+            if (local_id >= base) {
+                u32 slot = local_id - base;
+                if (slot < capacity) {
+                    result = table->values()[slot].acquireTrace();
+                    if (key != NULL) {
+                        *key = table->keys()[slot];
+                    }
+                    if (result != NULL && result != &CallTraceStorage::_overflow_trace) {
+                        // The generation may be freed as soon as the epoch is left
+                        result = gen->isNode(result) ? copyFrames((FrameNode*)result, holder.reserve(((FrameNode*)result)->depth))
+                                                     : copyTrace(result, holder.reserve(result->num_frames));
+                    }
+                }
+                break;
+            }
+        }
+        break;
+    }
+
+    leave(epoch);
+    return result;
+}
+
+
+CallTrace CallTraceStorage::_overflow_trace = {1, {BCI_ERROR, (jmethodID)"storage_overflow"}};
+
+CallTraceStorage::CallTraceStorage(int shards) : _shard_count(shards), _hash(CallTraceHash::best()), _budget(0), _tree(false),
+    _expanded_traces(CALL_TRACE_CHUNK), _expanded_samples(CALL_TRACE_CHUNK) {
+    for (int i = 0; i < _shard_count; i++) {
+        _shards[i] = new CallTraceShard();
+    }
+}
+
+CallTraceStorage::~CallTraceStorage() {
+    for (int i = 0; i < _shard_count; i++) {
+        delete _shards[i];
+    }
+}
+
+void CallTraceStorage::setBudget(size_t budget) {
+    _budget = budget == 0 || budget >= MIN_BUDGET ? budget : MIN_BUDGET;
+    configureShards();
+}
+
+void CallTraceStorage::setTree(bool tree) {
+    _tree = tree;
+    configureShards();
+}
+
+void CallTraceStorage::configureShards() {
+    // Every shard may hold a current and a retired generation
+    for (int i = 0; i < _shard_count; i++) {
+        _shards[i]->configure(_budget / _shard_count / 2, _tree);
+    }
+}
+
+void CallTraceStorage::clear() {
+    for (int i = 0; i < _shard_count; i++) {
+        _shards[i]->clear();
+    }
+    _expanded_traces.clear();
+    _expanded_samples.clear();
+}
+
+size_t CallTraceStorage::memory() {
+    size_t size = 0;
+    for (int i = 0; i < _shard_count; i++) {
+        size += _shards[i]->memory();
+    }
+    return size;
+}
+
+void CallTraceStorage::evict() {
+    for (int i = 0; i < _shard_count; i++) {
+        _shards[i]->compact();
+    }
+}
+
+void CallTraceStorage::collectTraces(std::map<u32, CallTrace*>& map) {
+    _expanded_traces.clear();
+
+    u64 overflow = 0;
+    for (int i = 0; i < _shard_count; i++) {
+        _shards[i]->collectTraces(map, i, &_expanded_traces);
+        overflow += _shards[i]->overflow();
+    }
+
+    if (overflow > 0) {
+        map[OVERFLOW_TRACE_ID] = &_overflow_trace;
+    }
+}
+
+void CallTraceStorage::collectSamples(std::vector<CallTraceSample*>& samples) {
+    _expanded_samples.clear();
+    for (int i = 0; i < _shard_count; i++) {
+        _shards[i]->collectSamples(samples, &_expanded_samples);
+    }
+}
+
+void CallTraceStorage::collectSamples(std::map<u64, CallTraceSample>& map) {
+    _expanded_samples.clear();
+    for (int i = 0; i < _shard_count; i++) {
+        _shards[i]->collectSamples(map, &_expanded_samples);
+    }
+}
+
+u32 CallTraceStorage::put(int num_frames, ASGCT_CallFrame* frames, u64 counter) {
+    u64 hash = _hash(num_frames, frames);
+
+    // Slots are picked by the low bits of the hash, shards by the high ones
+    u32 shard_index = (u32)(hash >> (64 - CALL_TRACE_SHARD_BITS)) & (_shard_count - 1);
+    u32 slot_id = _shards[shard_index]->put(hash, num_frames, frames, counter);
+    return slot_id != 0 ? callTraceId(slot_id, shard_index) : OVERFLOW_TRACE_ID;
+}
+
+CallTrace* CallTraceStorage::getCallTrace(u32 call_trace_id, CallTraceHolder& holder, u64* key) {
+    if (call_trace_id == OVERFLOW_TRACE_ID) {
+        if (key != NULL) {
+            *key = OVERFLOW_TRACE_ID;
+        }
+        return &_overflow_trace;
+    }
+
+    u32 shard_index = call_trace_id & (CALL_TRACE_SHARDS - 1);
+    if (shard_index >= (u32)_shard_count) {
+        return NULL;
+    }
+    return _shards[shard_index]->getCallTrace(call_trace_id >> CALL_TRACE_SHARD_BITS, holder, key);
 }
@@ -19,12 +19,19 @@
 
 #include <map>
 #include <vector>
+#include <stdlib.h>
 #include "arch.h"
+#include "callTraceHash.h"
 #include "linearAllocator.h"
 #include "vmEntry.h"
 
 
-class LongHashTable;
+// Call traces are spread over shards by hash, so that concurrent put() calls of different
+// stacks neither compete for the same hash table slots and size counter nor for one allocator
+const int CALL_TRACE_SHARD_BITS = 4;
+const int CALL_TRACE_SHARDS = 1 << CALL_TRACE_SHARD_BITS;
+
+class CallTraceShard;
 
 struct CallTrace {
     int num_frames;
@@ -56,28 +63,78 @@ struct CallTraceSample {
     }
 };
 
+// Receives the copy of a call trace that getCallTrace() makes while the trace cannot be evicted.
+// Reused by one thread at a time; the returned trace stays valid until the next call
+class CallTraceHolder {
+  private:
+    CallTrace* _trace;
+    int _capacity;
+
+  public:
+    CallTraceHolder() : _trace(NULL), _capacity(-1) {
+    }
+
+    ~CallTraceHolder() {
+        free(_trace);
+    }
+
+    CallTrace* reserve(int num_frames);
+};
+
 class CallTraceStorage {
   private:
     static CallTrace _overflow_trace;
 
-    LinearAllocator _allocator;
-    LongHashTable* _current_table;
-    u64 _overflow;
+    CallTraceShard* _shards[CALL_TRACE_SHARDS];
+    int _shard_count;
+    CallTraceHash::Func _hash;
+    size_t _budget;
+    bool _tree;
+    // Full copies of tree traces handed out by the last collectTraces() and collectSamples()
+    LinearAllocator _expanded_traces;
+    LinearAllocator _expanded_samples;
+
+    void configureShards();
 
-    u64 calcHash(int num_frames, ASGCT_CallFrame* frames);
-    CallTrace* storeCallTrace(int num_frames, ASGCT_CallFrame* frames);
-    CallTrace* findCallTrace(LongHashTable* table, u64 hash);
+    friend class CallTraceShard;
+    friend class CallTraceGeneration;
 
   public:
-    CallTraceStorage();
+    // shards must be a power of 2 not greater than CALL_TRACE_SHARDS
+    CallTraceStorage(int shards = CALL_TRACE_SHARDS);
     ~CallTraceStorage();
 
+    // Bounds the memory of tables and traces (tracemem=SIZE); 0 means unbounded.
+    // Small budgets are rounded up to 32 MB. Takes effect with the next clear()
+    void setBudget(size_t budget);
+
+    size_t budget() {
+        return _budget;
+    }
+
+    // Stores traces as nodes of a per-shard frame tree, so that traces with a common bottom
+    // (thread entry, executor, framework) keep those frames once. Takes effect with the next clear().
+    // Traces are rebuilt in full when collected; the copies live until the next collect of the same kind
+    void setTree(bool tree);
+
     void clear();
+
+    // Bytes of tables and trace chunks, not counting the fixed per-shard overhead
+    size_t memory();
+
+    // With a budget, replaces shards that have grown too large, keeping the traces sampled most
+    // since the previous eviction. Must not run concurrently with itself, clear() or collect*()
+    void evict();
+
     void collectTraces(std::map<u32, CallTrace*>& map);
     void collectSamples(std::vector<CallTraceSample*>& samples);
     void collectSamples(std::map<u64, CallTraceSample>& map);
 
     u32 put(int num_frames, ASGCT_CallFrame* frames, u64 counter);
+    // Copies the trace into holder, since with tracemem=N the stored one may be freed as soon as
+    // the lookup is over. key receives the stack hash, which tells a reused ID apart from the one
+    // it replaced. Returns NULL if there is no such trace or it is still being published
+    CallTrace* getCallTrace(u32 call_trace_id, CallTraceHolder& holder, u64* key = NULL);
 };
 
 #endif // _CALLTRACESTORAGE
@@ -28,5 +28,6 @@ public class Main {
         System.out.println("  jfr2flame   input.jfr       output.html");
         System.out.println("  jfr2nflx    input.jfr       output.nflx");
         System.out.println("  jfr2pprof   input.jfr       output.pprof");
+        System.out.println("  kd2text     input.kd        output.txt");
     }
 }
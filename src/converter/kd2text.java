@@ -0,0 +1,52 @@
+/*
+ * Copyright 2022 The Kindling Authors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+import one.kd.KdReader;
+import one.kd.KdRecord;
+
+import java.io.FileOutputStream;
+import java.io.IOException;
+import java.io.OutputStreamWriter;
+import java.io.PrintWriter;
+import java.nio.charset.StandardCharsets;
+
+/**
+ * Decodes the binary kd-* event stream back into kd-* text lines.
+ */
+public class kd2text {
+
+    public static void main(String[] args) throws IOException {
+        if (args.length < 1) {
+            System.out.println("Usage: java -cp converter.jar kd2text input.kd [output.txt]");
+            System.exit(1);
+        }
+
+        PrintWriter out = args.length > 1
+                ? new PrintWriter(new OutputStreamWriter(new FileOutputStream(args[1]), StandardCharsets.UTF_8))
+                : new PrintWriter(new OutputStreamWriter(System.out, StandardCharsets.UTF_8));
+
+        try (KdReader kd = new KdReader(args[0])) {
+            for (KdRecord record; (record = kd.readRecord()) != null; ) {
+                out.println(record.toText());
+            }
+        } finally {
+            out.flush();
+            if (args.length > 1) {
+                out.close();
+            }
+        }
+    }
+}
@@ -0,0 +1,49 @@
+/*
+ * Copyright 2022 The Kindling Authors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+package one.kd;
+
+/**
+ * Threads waiting for each other in a cycle; each one waits for the lock held by the next one.
+ */
+public class KdDeadlock extends KdRecord {
+    public final long timestamp;
+    public final int[] tids;
+    public final long[] lockAddresses;
+    public final String[] lockClasses;
+
+    public KdDeadlock(long timestamp, int[] tids, long[] lockAddresses, String[] lockClasses) {
+        super(DEADLOCK);
+        this.timestamp = timestamp;
+        this.tids = tids;
+        this.lockAddresses = lockAddresses;
+        this.lockClasses = lockClasses;
+    }
+
+    @Override
+    public String toText() {
+        StringBuilder sb = new StringBuilder("kd-ldl@");
+        sb.append(timestamp).append('!');
+        for (int i = 0; i < tids.length; i++) {
+            if (i > 0) {
+                sb.append(',');
+            }
+            sb.append(tids[i]).append(':').append(Long.toHexString(lockAddresses[i])).append(':').append(lockClasses[i]);
+        }
+        return sb.append('!').toString();
+    }
+}
@@ -0,0 +1,38 @@
+/*
+ * Copyright 2022 The Kindling Authors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+package one.kd;
+
+/**
+ * Dictionary entry of a frame name (framedict=true).
+ * Stacks that follow refer to the name by its ID.
+ */
+public class KdFrameName extends KdRecord {
+    public final int id;
+    public final String name;
+
+    public KdFrameName(int id, String name) {
+        super(FRAME_NAME);
+        this.id = id;
+        this.name = name;
+    }
+
+    @Override
+    public String toText() {
+        // kd-fn@name_id!name!
+        return "kd-fn@" + id + '!' + name + '!';
+    }
+}
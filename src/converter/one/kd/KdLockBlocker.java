@@ -0,0 +1,51 @@
+/*
+ * Copyright 2022 The Kindling Authors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+package one.kd;
+
+/**
+ * Thread at the end of blocking chains in a lockgraph snapshot, or a deadlock cycle.
+ */
+public class KdLockBlocker extends KdRecord {
+    public final long timestamp;
+    public final int tid;
+    public final long lockAddress;
+    public final String lockClass;
+    public final int blockedThreads;
+    public final long blockedNanos;
+    public final int maxDepth;
+    public final boolean deadlock;
+
+    public KdLockBlocker(long timestamp, int tid, long lockAddress, String lockClass,
+                         int blockedThreads, long blockedNanos, int maxDepth, boolean deadlock) {
+        super(LOCK_BLOCKER);
+        this.timestamp = timestamp;
+        this.tid = tid;
+        this.lockAddress = lockAddress;
+        this.lockClass = lockClass;
+        this.blockedThreads = blockedThreads;
+        this.blockedNanos = blockedNanos;
+        this.maxDepth = maxDepth;
+        this.deadlock = deadlock;
+    }
+
+    @Override
+    public String toText() {
+        return "kd-lbr@" + timestamp + '!' + tid + '!' + Long.toHexString(lockAddress) + '!' + lockClass + '!'
+                + blockedThreads + '!' + blockedNanos + '!' + maxDepth + '!' + (deadlock ? 1 : 0) + '!';
+    }
+}
@@ -0,0 +1,80 @@
+/*
+ * Copyright 2022 The Kindling Authors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+package one.kd;
+
+/**
+ * Wait durations of one (lock class, address bucket, stack) over one lockhist interval.
+ * Only non-empty buckets are present; see {@link #bucketLowerBound(int)} for their ranges.
+ */
+public class KdLockHistogram extends KdRecord {
+    private static final int SUB_BITS = 3;
+
+    public final long startTime;
+    public final long endTime;
+    public final String lockClass;
+    public final int addressBucket;
+    public final int stackId;
+    public final long count;
+    public final long totalDuration;
+    public final long maxDuration;
+    public final int[] buckets;
+    public final long[] counts;
+
+    public KdLockHistogram(long startTime, long endTime, String lockClass, int addressBucket, int stackId,
+                           long count, long totalDuration, long maxDuration, int[] buckets, long[] counts) {
+        super(LOCK_HISTOGRAM);
+        this.startTime = startTime;
+        this.endTime = endTime;
+        this.lockClass = lockClass;
+        this.addressBucket = addressBucket;
+        this.stackId = stackId;
+        this.count = count;
+        this.totalDuration = totalDuration;
+        this.maxDuration = maxDuration;
+        this.buckets = buckets;
+        this.counts = counts;
+    }
+
+    /**
+     * Smallest wait duration in ns counted in the bucket, same as LockHistograms::bucketLowerBound.
+     */
+    public static long bucketLowerBound(int bucket) {
+        if (bucket < (1 << SUB_BITS)) {
+            return (long) bucket << 10;
+        }
+        int magnitude = (bucket >> SUB_BITS) + SUB_BITS - 1;
+        long units = (long) ((1 << SUB_BITS) + (bucket & ((1 << SUB_BITS) - 1))) << (magnitude - SUB_BITS);
+        return units << 10;
+    }
+
+    @Override
+    public String toText() {
+        // kd-lh@start!end!class!address_bucket!stack_id!count!total!max!bucket:count,...!
+        StringBuilder sb = new StringBuilder("kd-lh@");
+        sb.append(startTime).append('!').append(endTime).append('!').append(lockClass).append('!')
+                .append(addressBucket).append('!').append(stackId).append('!').append(count).append('!')
+                .append(totalDuration).append('!').append(maxDuration).append('!');
+        for (int i = 0; i < buckets.length; i++) {
+            if (i > 0) {
+                sb.append(',');
+            }
+            sb.append(buckets[i]).append(':').append(counts[i]);
+        }
+        return sb.append('!').toString();
+    }
+}
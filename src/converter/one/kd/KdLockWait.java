@@ -0,0 +1,49 @@
+/*
+ * Copyright 2022 The Kindling Authors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+package one.kd;
+
+public class KdLockWait extends KdRecord {
+    public final long waitTimestamp;
+    public final long wakeTimestamp;
+    public final int tid;
+    public final long lockAddress;
+    public final String lockType;
+    public final String threadName;
+    public final long duration;
+    public final int waitThreadId;
+    public final String stack;
+
+    public KdLockWait(long waitTimestamp, long wakeTimestamp, int tid, long lockAddress, String lockType,
+                      String threadName, long duration, int waitThreadId, String stack) {
+        super(LOCK_WAIT);
+        this.waitTimestamp = waitTimestamp;
+        this.wakeTimestamp = wakeTimestamp;
+        this.tid = tid;
+        this.lockAddress = lockAddress;
+        this.lockType = lockType;
+        this.threadName = threadName;
+        this.duration = duration;
+        this.waitThreadId = waitThreadId;
+        this.stack = stack;
+    }
+
+    @Override
+    public String toText() {
+        return "kd-jf@" + waitTimestamp + '!' + wakeTimestamp + '!' + tid + '!' + Long.toHexString(lockAddress) + '!'
+                + lockType + '!' + threadName + '!' + duration + '!' + waitThreadId + '!' + stack + '!';
+    }
+}
@@ -0,0 +1,255 @@
+/*
+ * Copyright 2022 The Kindling Authors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+package one.kd;
+
+import java.io.BufferedInputStream;
+import java.io.Closeable;
+import java.io.EOFException;
+import java.io.FileInputStream;
+import java.io.IOException;
+import java.io.InputStream;
+import java.nio.charset.StandardCharsets;
+import java.util.HashMap;
+import java.util.Map;
+
+/**
+ * Reference decoder of the binary kd-* event stream (kdformat=binary).
+ * Record layout: 'k' 'b' | type (1 byte) | payload length (varint) | payload.
+ * Records of unknown types are skipped.
+ * Frame name references (framedict=true) are resolved, so stacks are always returned with names.
+ */
+public class KdReader implements Closeable {
+    private static final int MAGIC0 = 'k';
+    private static final int MAGIC1 = 'b';
+
+    private final InputStream in;
+    private final Map<Integer, String> frameNames = new HashMap<>();
+    private byte[] buf = new byte[4096];
+    private int pos;
+    private int limit;
+
+    public KdReader(String fileName) throws IOException {
+        this(new FileInputStream(fileName));
+    }
+
+    public KdReader(InputStream in) {
+        this.in = new BufferedInputStream(in, 65536);
+    }
+
+    @Override
+    public void close() throws IOException {
+        in.close();
+    }
+
+    /**
+     * Returns the next known record, or null at the end of stream.
+     */
+    public KdRecord readRecord() throws IOException {
+        while (true) {
+            int magic0 = in.read();
+            if (magic0 < 0) {
+                return null;
+            }
+            if (magic0 != MAGIC0 || in.read() != MAGIC1) {
+                throw new IOException("Invalid kd record header");
+            }
+
+            int type = readByte();
+            int length = (int) readStreamVarint();
+            readPayload(length);
+
+            switch (type) {
+                case KdRecord.STACK:
+                    return readStack(false);
+                case KdRecord.THREAD_NAME:
+                    return new KdThreadName(getVarint(), getString());
+                case KdRecord.LOCK_WAIT:
+                    return readLockWait();
+                case KdRecord.STACK_DEF:
+                    return readStackDef(false);
+                case KdRecord.SAMPLE:
+                    return new KdSample(getVarlong(), getVarint(), getVarint());
+                case KdRecord.FRAME_NAME:
+                    return readFrameName();
+                case KdRecord.STACK_REFS:
+                    return readStack(true);
+                case KdRecord.STACK_DEF_REFS:
+                    return readStackDef(true);
+                case KdRecord.LOCK_STACK_DEF:
+                    return new KdLockStackDef(getVarint(), getString());
+                case KdRecord.LOCK_HISTOGRAM:
+                    return readLockHistogram();
+                case KdRecord.LOCK_BLOCKER:
+                    return readLockBlocker();
+                case KdRecord.DEADLOCK:
+                    return readDeadlock();
+            }
+        }
+    }
+
+    private KdStack readStack(boolean refs) {
+        long timestamp = getVarlong();
+        int tid = getVarint();
+        return new KdStack(timestamp, tid, getFrames(refs));
+    }
+
+    private KdStackDef readStackDef(boolean refs) {
+        int stackId = getVarint();
+        return new KdStackDef(stackId, getFrames(refs));
+    }
+
+    private KdFrameName readFrameName() {
+        KdFrameName frameName = new KdFrameName(getVarint(), getString());
+        // IDs are reused after the profiler restarts, the latest definition wins
+        frameNames.put(frameName.id, frameName.name);
+        return frameName;
+    }
+
+    private String[] getFrames(boolean refs) {
+        String[] frames = new String[getVarint()];
+        for (int i = 0; i < frames.length; i++) {
+            if (refs) {
+                int id = getVarint();
+                String name = frameNames.get(id);
+                frames[i] = name != null ? name : "[unknown name " + id + "]";
+            } else {
+                frames[i] = getString();
+            }
+        }
+        return frames;
+    }
+
+    private KdLockWait readLockWait() {
+        long waitTimestamp = getVarlong();
+        long wakeTimestamp = getVarlong();
+        int tid = getVarint();
+        long lockAddress = getVarlong();
+        String lockType = getString();
+        String threadName = getString();
+        long duration = getVarlong();
+        int waitThreadId = getZigzag();
+        String stack = getString();
+        return new KdLockWait(waitTimestamp, wakeTimestamp, tid, lockAddress, lockType,
+                threadName, duration, waitThreadId, stack);
+    }
+
+    private KdLockHistogram readLockHistogram() {
+        long startTime = getVarlong();
+        long endTime = getVarlong();
+        String lockClass = getString();
+        int addressBucket = getVarint();
+        int stackId = getVarint();
+        long count = getVarlong();
+        long totalDuration = getVarlong();
+        long maxDuration = getVarlong();
+        int[] buckets = new int[getVarint()];
+        long[] counts = new long[buckets.length];
+        for (int i = 0; i < buckets.length; i++) {
+            buckets[i] = getVarint();
+            counts[i] = getVarlong();
+        }
+        return new KdLockHistogram(startTime, endTime, lockClass, addressBucket, stackId,
+                count, totalDuration, maxDuration, buckets, counts);
+    }
+
+    private KdLockBlocker readLockBlocker() {
+        long timestamp = getVarlong();
+        int tid = getZigzag();
+        long lockAddress = getVarlong();
+        String lockClass = getString();
+        int blockedThreads = getVarint();
+        long blockedNanos = getVarlong();
+        int maxDepth = getVarint();
+        boolean deadlock = pos < limit && buf[pos++] != 0;
+        return new KdLockBlocker(timestamp, tid, lockAddress, lockClass, blockedThreads, blockedNanos, maxDepth, deadlock);
+    }
+
+    private KdDeadlock readDeadlock() {
+        long timestamp = getVarlong();
+        int[] tids = new int[getVarint()];
+        long[] lockAddresses = new long[tids.length];
+        String[] lockClasses = new String[tids.length];
+        for (int i = 0; i < tids.length; i++) {
+            tids[i] = getVarint();
+            lockAddresses[i] = getVarlong();
+            lockClasses[i] = getString();
+        }
+        return new KdDeadlock(timestamp, tids, lockAddresses, lockClasses);
+    }
+
+    private int readByte() throws IOException {
+        int b = in.read();
+        if (b < 0) {
+            throw new EOFException("Truncated kd record");
+        }
+        return b;
+    }
+
+    private long readStreamVarint() throws IOException {
+        long result = 0;
+        for (int shift = 0; ; shift += 7) {
+            int b = readByte();
+            result |= (long) (b & 0x7f) << shift;
+            if (b < 0x80) {
+                return result;
+            }
+        }
+    }
+
+    private void readPayload(int length) throws IOException {
+        if (length > buf.length) {
+            buf = new byte[Math.max(length, buf.length * 2)];
+        }
+        for (int offset = 0; offset < length; ) {
+            int bytes = in.read(buf, offset, length - offset);
+            if (bytes < 0) {
+                throw new EOFException("Truncated kd record");
+            }
+            offset += bytes;
+        }
+        pos = 0;
+        limit = length;
+    }
+
+    private long getVarlong() {
+        long result = 0;
+        for (int shift = 0; pos < limit; shift += 7) {
+            byte b = buf[pos++];
+            result |= (long) (b & 0x7f) << shift;
+            if (b >= 0) {
+                break;
+            }
+        }
+        return result;
+    }
+
+    private int getVarint() {
+        return (int) getVarlong();
+    }
+
+    private int getZigzag() {
+        int v = getVarint();
+        return (v >>> 1) ^ -(v & 1);
+    }
+
+    private String getString() {
+        int length = getVarint();
+        String result = new String(buf, pos, length, StandardCharsets.UTF_8);
+        pos += length;
+        return result;
+    }
+}
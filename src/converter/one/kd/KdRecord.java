@@ -0,0 +1,46 @@
+/*
+ * Copyright 2022 The Kindling Authors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+package one.kd;
+
+/**
+ * Base class for records of the binary kd-* event stream.
+ */
+public abstract class KdRecord {
+    public static final int STACK = 1;
+    public static final int THREAD_NAME = 2;
+    public static final int LOCK_WAIT = 3;
+    public static final int STACK_DEF = 4;
+    public static final int SAMPLE = 5;
+    public static final int FRAME_NAME = 6;
+    public static final int STACK_REFS = 7;
+    public static final int STACK_DEF_REFS = 8;
+    public static final int LOCK_STACK_DEF = 9;
+    public static final int LOCK_HISTOGRAM = 10;
+    public static final int LOCK_BLOCKER = 11;
+    public static final int DEADLOCK = 12;
+
+    public final int type;
+
+    protected KdRecord(int type) {
+        this.type = type;
+    }
+
+    /**
+     * Renders the record in the kd-* text format produced with kdformat=text.
+     */
+    public abstract String toText();
+}
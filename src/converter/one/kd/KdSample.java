@@ -0,0 +1,36 @@
+/*
+ * Copyright 2022 The Kindling Authors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+package one.kd;
+
+public class KdSample extends KdRecord {
+    public final long timestamp;
+    public final int tid;
+    public final int stackId;
+
+    public KdSample(long timestamp, int tid, int stackId) {
+        super(SAMPLE);
+        this.timestamp = timestamp;
+        this.tid = tid;
+        this.stackId = stackId;
+    }
+
+    @Override
+    public String toText() {
+        // kd-smp@ts!tid!stack_id!
+        return "kd-smp@" + timestamp + '!' + tid + '!' + stackId + '!';
+    }
+}
@@ -0,0 +1,41 @@
+/*
+ * Copyright 2022 The Kindling Authors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+package one.kd;
+
+public class KdStack extends KdRecord {
+    public final long timestamp;
+    public final int tid;
+    public final String[] frames;
+
+    public KdStack(long timestamp, int tid, String[] frames) {
+        super(STACK);
+        this.timestamp = timestamp;
+        this.tid = tid;
+        this.frames = frames;
+    }
+
+    @Override
+    public String toText() {
+        // kd-stack@ts!tid!depth!finish!stack!
+        StringBuilder sb = new StringBuilder("kd-stack@");
+        sb.append(timestamp).append('!').append(tid).append("!0!1!");
+        for (String frame : frames) {
+            sb.append(frame).append('!');
+        }
+        return sb.toString();
+    }
+}
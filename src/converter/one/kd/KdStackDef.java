@@ -0,0 +1,42 @@
+/*
+ * Copyright 2022 The Kindling Authors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+package one.kd;
+
+/**
+ * Frames of a stack referenced by {@link KdSample} records (stackids=true).
+ */
+public class KdStackDef extends KdRecord {
+    public final int stackId;
+    public final String[] frames;
+
+    public KdStackDef(int stackId, String[] frames) {
+        super(STACK_DEF);
+        this.stackId = stackId;
+        this.frames = frames;
+    }
+
+    @Override
+    public String toText() {
+        // kd-sdef@stack_id!depth!finish!stack!
+        StringBuilder sb = new StringBuilder("kd-sdef@");
+        sb.append(stackId).append("!0!1!");
+        for (String frame : frames) {
+            sb.append(frame).append('!');
+        }
+        return sb.toString();
+    }
+}
@@ -76,6 +76,11 @@ unsigned int Dictionary::lookup(const char* key) {
 }
 
 unsigned int Dictionary::lookup(const char* key, size_t length) {
+    const char* interned;
+    return lookup(key, length, &interned);
+}
+
+unsigned int Dictionary::lookup(const char* key, size_t length, const char** interned) {
     DictTable* table = _table;
     unsigned int h = hash(key, length);
 
@@ -85,11 +90,13 @@ unsigned int Dictionary::lookup(const char* key, size_t length) {
             if (row->keys[c] == NULL) {
                 char* new_key = allocateKey(key, length);
                 if (__sync_bool_compare_and_swap(&row->keys[c], NULL, new_key)) {
+                    *interned = new_key;
                     return table->index(h % ROWS, c);
                 }
                 free(new_key);
             }
             if (keyEquals(row->keys[c], key, length)) {
+                *interned = row->keys[c];
                 return table->index(h % ROWS, c);
             }
         }
@@ -63,6 +63,8 @@ class Dictionary {
 
     unsigned int lookup(const char* key);
     unsigned int lookup(const char* key, size_t length);
+    // Also returns the dictionary's own copy of the key, valid until clear()
+    unsigned int lookup(const char* key, size_t length, const char** interned);
 
     void collect(std::map<unsigned int, const char*>& map);
 };
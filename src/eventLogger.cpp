@@ -0,0 +1,279 @@
+/*
+ * Copyright 2022 The Kindling Authors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include "eventLogger.h"
+#include "fdtransferClient.h"
+#include "log.h"
+#include "os.h"
+
+const size_t MIN_LOG_BUFFER_SIZE = 64 * 1024;
+
+int EventLogger::_fd = STDOUT_FILENO;
+bool EventLogger::_binary = false;
+#ifdef __linux__
+KdShmRing* volatile EventLogger::_shm = NULL;
+KdShmRing* EventLogger::_retired_shm = NULL;
+#endif
+
+volatile bool EventLogger::_async = false;
+LogBuffer EventLogger::_buffers[LOG_BUFFERS];
+char* EventLogger::_spare[LOG_BUFFERS];
+size_t EventLogger::_buffer_size = 0;
+u64 EventLogger::_flush_interval = 0;
+volatile u64 EventLogger::_dropped = 0;
+
+WaitableMutex EventLogger::_flush_lock;
+volatile bool EventLogger::_flush_requested = false;
+volatile bool EventLogger::_running = false;
+std::thread EventLogger::_writer;
+
+void EventLogger::open(const char* file_name) {
+    close();
+
+    if (file_name == NULL || strcmp(file_name, "stdout") == 0) {
+        _fd = STDOUT_FILENO;
+    } else if (strcmp(file_name, "stderr") == 0) {
+        _fd = STDERR_FILENO;
+    } else if ((_fd = ::open(file_name, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0) {
+        _fd = STDOUT_FILENO;
+        printf("Could not open log file: %s", file_name);
+    }
+}
+
+bool EventLogger::openShm(const char* path, long size) {
+#ifdef __linux__
+    KdShmRing* ring = KdShmRing::create(size);
+    if (ring == NULL) {
+        Log::warn("Could not create kdshm ring: %s", strerror(errno));
+        return false;
+    }
+    if (!FdTransferClient::sendKdShmFd(path, ring->fd(), (unsigned int)ring->size())) {
+        delete ring;
+        return false;
+    }
+    _shm = ring;
+    return true;
+#else
+    return false;
+#endif
+}
+
+void EventLogger::close() {
+    stopWriter();
+
+#ifdef __linux__
+    if (_shm != NULL) {
+        if (_shm->dropped() > 0) {
+            Log::warn("%llu kd-* records were dropped: kdshm consumer is behind", (unsigned long long)_shm->dropped());
+        }
+        // A late hook may still be writing to the ring: unmap it only one session later
+        delete _retired_shm;
+        _retired_shm = _shm;
+        _shm = NULL;
+    }
+#endif
+
+    if (_fd != STDOUT_FILENO && _fd != STDERR_FILENO) {
+        ::close(_fd);
+        _fd = STDOUT_FILENO;
+    }
+}
+
+void EventLogger::startWriter(long flush_interval, long buffer_size) {
+    stopWriter();
+    if (flush_interval <= 0) {
+        return;
+    }
+
+    size_t size = buffer_size < (long)MIN_LOG_BUFFER_SIZE ? MIN_LOG_BUFFER_SIZE : (size_t)buffer_size;
+    if (size != _buffer_size) {
+        // Buffers are only replaced while no writer is running and _async is off
+        for (int i = 0; i < LOG_BUFFERS; i++) {
+            _buffers[i]._lock.lock();
+            free(_buffers[i]._data);
+            free(_spare[i]);
+            _buffers[i]._data = (char*)malloc(size);
+            _buffers[i]._size = 0;
+            _spare[i] = (char*)malloc(size);
+            _buffers[i]._lock.unlock();
+            if (_buffers[i]._data == NULL || _spare[i] == NULL) {
+                Log::warn("Could not allocate event log buffers, falling back to synchronous writes");
+                _buffer_size = 0;
+                return;
+            }
+        }
+        _buffer_size = size;
+    }
+
+    _flush_interval = flush_interval / 1000;
+    _dropped = 0;
+    _flush_requested = false;
+    _running = true;
+    _async = true;
+    _writer = std::thread(writerLoop);
+}
+
+void EventLogger::stopWriter() {
+    if (!_running) {
+        return;
+    }
+
+    _async = false;
+    {
+        MutexLocker ml(_flush_lock);
+        _running = false;
+        _flush_lock.notify();
+    }
+    _writer.join();
+    flush();
+
+    if (_dropped > 0) {
+        Log::warn("%llu kd-* records were dropped: event log buffers were full", _dropped);
+    }
+}
+
+void EventLogger::log(const char* msg, ...) {
+    va_list args;
+    va_start(args, msg);
+    log(msg, args);
+    va_end(args);
+}
+
+void EventLogger::log(const char* msg, va_list args) {
+    // One extra byte for the line separator
+    char buf[1025];
+    size_t len = vsnprintf(buf, 1024, msg, args);
+    if (len >= 1024) {
+        len = 1023;
+    }
+    buf[len++] = '\n';
+    append(buf, len);
+}
+
+void EventLogger::append(const char* data, size_t len) {
+#ifdef __linux__
+    KdShmRing* shm = _shm;
+    if (shm != NULL) {
+        shm->write(data, len);
+        return;
+    }
+#endif
+
+    if (!_async) {
+        writeFully(data, len);
+        return;
+    }
+
+    LogBuffer& buffer = _buffers[(u32)OS::threadId() % LOG_BUFFERS];
+    buffer._lock.lock();
+    size_t size = buffer._size;
+    bool fits = size + len <= _buffer_size;
+    if (fits) {
+        memcpy(buffer._data + size, data, len);
+        size += len;
+        buffer._size = size;
+    }
+    buffer._lock.unlock();
+
+    if (!fits) {
+        atomicInc(_dropped);
+        requestFlush();
+    } else if (size >= _buffer_size / 2) {
+        requestFlush();
+    }
+}
+
+void EventLogger::writeFully(const char* data, size_t len) {
+    while (len > 0) {
+        ssize_t bytes = ::write(_fd, data, len);
+        if (bytes <= 0) {
+            if (bytes < 0 && errno == EINTR) continue;
+            return;
+        }
+        data += bytes;
+        len -= bytes;
+    }
+}
+
+void EventLogger::requestFlush() {
+    // Do not take _flush_lock here: producers must never block on the writer.
+    // A lost wakeup only delays the flush until the next interval.
+    if (!_flush_requested) {
+        _flush_requested = true;
+        _flush_lock.notify();
+    }
+}
+
+void EventLogger::flush() {
+    struct iovec iov[LOG_BUFFERS];
+    int count = 0;
+
+    for (int i = 0; i < LOG_BUFFERS; i++) {
+        LogBuffer& buffer = _buffers[i];
+        if (buffer._size == 0) {
+            continue;
+        }
+
+        buffer._lock.lock();
+        char* data = buffer._data;
+        size_t size = buffer._size;
+        buffer._data = _spare[i];
+        buffer._size = 0;
+        buffer._lock.unlock();
+
+        _spare[i] = data;
+        iov[count].iov_base = data;
+        iov[count].iov_len = size;
+        count++;
+    }
+
+    // Records never straddle buffers, so a partial write can simply be resumed
+    struct iovec* v = iov;
+    while (count > 0) {
+        ssize_t bytes = ::writev(_fd, v, count);
+        if (bytes <= 0) {
+            if (bytes < 0 && errno == EINTR) continue;
+            return;
+        }
+        while (count > 0 && (size_t)bytes >= v->iov_len) {
+            bytes -= v->iov_len;
+            v++;
+            count--;
+        }
+        if (count > 0) {
+            v->iov_base = (char*)v->iov_base + bytes;
+            v->iov_len -= bytes;
+        }
+    }
+}
+
+void EventLogger::writerLoop() {
+    MutexLocker ml(_flush_lock);
+    while (_running) {
+        if (!_flush_requested) {
+            _flush_lock.waitUntil(OS::micros() + _flush_interval);
+        }
+        _flush_requested = false;
+        flush();
+    }
+    // Drain whatever producers appended before _async was turned off
+    flush();
+}
@@ -5,54 +5,110 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdarg.h>
+#include <thread>
+#include "kdRecord.h"
+#include "kdshm/kdShm.h"
+#include "mutex.h"
+#include "spinLock.h"
 
+// Number of append buffers; producers are striped across them by thread ID
+const int LOG_BUFFERS = 16;
+// Flush interval in ns used with lock events when kdflush is not given
+const long DEFAULT_LOCK_FLUSH_INTERVAL = 100 * 1000 * 1000;
+
+// Append buffer shared by the producers of one stripe.
+// The lock is only held for a memcpy or a pointer swap, never for I/O.
+struct LogBuffer {
+    SpinLock _lock;
+    char* _data;
+    volatile size_t _size;
+};
+
+// Sink of the kd-* event stream.
+// By default every record is written synchronously. With kdflush=TIME, or whenever lock events
+// are on, since the threads that log them are inside JVMTI lock callbacks, records are appended
+// to in-memory buffers and a dedicated writer thread drains them with a single writev
+// every TIME or as soon as a buffer is half full. A record that does not fit into a full buffer
+// is dropped rather than making an application thread wait on disk I/O.
+// With kdshm=PATH records bypass the file entirely and go to a shared memory ring instead.
 class EventLogger {
   private:
-    static FILE* _file;
+    static int _fd;
+    static bool _binary;
+#ifdef __linux__
+    static KdShmRing* volatile _shm;
+    static KdShmRing* _retired_shm;
+#endif
 
-  public: 
-    static void open(const char* file_name) {
-        if (_file != stdout && _file != stderr) {
-            fclose(_file);
-        }
+    static volatile bool _async;
+    static LogBuffer _buffers[LOG_BUFFERS];
+    static char* _spare[LOG_BUFFERS];
+    static size_t _buffer_size;
+    static u64 _flush_interval;
+    static volatile u64 _dropped;
 
-        if (file_name == NULL || strcmp(file_name, "stdout") == 0) {
-            _file = stdout;
-        } else if (strcmp(file_name, "stderr") == 0) {
-            _file = stderr;
-        } else if ((_file = fopen(file_name, "w")) == NULL) {
-            _file = stdout;
-            printf("Could not open log file: %s", file_name);
-        }
+    static WaitableMutex _flush_lock;
+    static volatile bool _flush_requested;
+    static volatile bool _running;
+    static std::thread _writer;
+
+    static void append(const char* data, size_t len);
+    static void writeFully(const char* data, size_t len);
+    static void requestFlush();
+    static void flush();
+    static void writerLoop();
+    static void stopWriter();
+
+  public:
+    // kdformat=binary switches the stream from kd-* text lines to KdRecord frames
+    static void setBinary(bool binary) {
+        _binary = binary;
     }
 
-    static void close() {
-        if (_file != stdout && _file != stderr) {
-            fclose(_file);
-            _file = stdout;
-        }
+    static bool binary() {
+        return _binary;
     }
 
-    static void log(const char* msg, ...) {
-        va_list args;
-        va_start(args, msg);
-        log(msg, args);
-        va_end(args);
+    static void open(const char* file_name);
+    static void close();
+
+    // Creates the shared memory ring and hands it over to the consumer listening at path
+    static bool openShm(const char* path, long size);
+
+    // flush_interval is in nanoseconds; 0 keeps the logger synchronous
+    static void startWriter(long flush_interval, long buffer_size);
+
+    static u64 dropped() {
+        return _dropped;
+    }
+
+    static void log(const char* msg, ...);
+    static void log(const char* msg, va_list args);
+
+    static void write(const char* data, size_t len) {
+        append(data, len);
     }
 
-    static void log(const char* msg, va_list args) {
-        char buf[1024];
-        size_t len = vsnprintf(buf, sizeof(buf), msg, args);
-        if (len >= sizeof(buf)) {
-            len = sizeof(buf) - 1;
-            buf[len] = 0;
+    static void write(KdRecord& record) {
+        size_t len;
+        const char* data = record.finish(&len);
+        if (data != NULL) {
+            append(data, len);
+        } else {
+            atomicInc(_dropped);
         }
+    }
 
-        fprintf(_file, "%s\n", buf);
-        fflush(_file);
+    static void logThreadName(int tid, const char* name) {
+        if (_binary) {
+            KdRecord record(KD_RECORD_THREAD_NAME);
+            record.putVar32(tid);
+            record.putString(name);
+            write(record);
+        } else {
+            log("kd-tm@%d!%s!", tid, name);
+        }
     }
 };
 
-FILE* EventLogger::_file = stdout;
-
 #endif // _EVENT_LOGGER_H
@@ -31,6 +31,8 @@
 enum request_type {
     PERF_FD,
     KALLSYMS_FD,
+    // Sent by the profiler to a kd-* stream consumer, see kdshm/kdShm.h
+    KD_SHM_FD,
 };
 
 struct fd_request {
@@ -44,6 +46,12 @@ struct perf_fd_request {
     struct perf_event_attr attr;
 };
 
+struct kd_shm_fd_request {
+    struct fd_request header;
+    // size of the shared memory ring in bytes
+    unsigned int size;
+};
+
 struct fd_response {
     // of type "enum request_type"
     unsigned int type;
@@ -85,6 +93,64 @@ static inline bool socketPath(const char *path, struct sockaddr_un *sun, socklen
     return true;
 }
 
+// Sends a message with an optional file descriptor attached as SCM_RIGHTS
+static inline bool sendFdMessage(int sock, const void *buf, size_t len, int fd) {
+    struct msghdr msg = {0};
+
+    struct iovec iov[1];
+    iov[0].iov_base = (void*)buf;
+    iov[0].iov_len = len;
+    msg.msg_iov = iov;
+    msg.msg_iovlen = ARRAY_SIZE(iov);
+
+    union {
+        char buf[CMSG_SPACE(sizeof(fd))];
+        struct cmsghdr align;
+    } u;
+
+    if (fd != -1) {
+        msg.msg_control = u.buf;
+        msg.msg_controllen = sizeof(u.buf);
+
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(fd));
+        memcpy(CMSG_DATA(cmsg), &fd, sizeof(fd));
+    }
+
+    return sendmsg(sock, &msg, 0) == (ssize_t)len;
+}
+
+// Receives a message sent by sendFdMessage; *fd is -1 if no descriptor was attached
+static inline ssize_t recvFdMessage(int sock, void *buf, size_t len, int *fd) {
+    struct msghdr msg = {0};
+
+    struct iovec iov[1];
+    iov[0].iov_base = buf;
+    iov[0].iov_len = len;
+    msg.msg_iov = iov;
+    msg.msg_iovlen = ARRAY_SIZE(iov);
+
+    union {
+        char buf[CMSG_SPACE(sizeof(int))];
+        struct cmsghdr align;
+    } u;
+    msg.msg_control = u.buf;
+    msg.msg_controllen = sizeof(u.buf);
+
+    *fd = -1;
+    ssize_t ret = recvmsg(sock, &msg, 0);
+    if (ret > 0) {
+        struct cmsghdr *cmptr = CMSG_FIRSTHDR(&msg);
+        if (cmptr != NULL && cmptr->cmsg_len == CMSG_LEN(sizeof(int))
+            && cmptr->cmsg_level == SOL_SOCKET && cmptr->cmsg_type == SCM_RIGHTS) {
+            memcpy(fd, CMSG_DATA(cmptr), sizeof(int));
+        }
+    }
+    return ret;
+}
+
 #endif // __linux__
 
 #endif // _FDTRANSFER_H
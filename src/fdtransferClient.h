@@ -39,6 +39,9 @@ class FdTransferClient {
 
     static int requestPerfFd(int *tid, struct perf_event_attr *attr);
     static int requestKallsymsFd();
+
+    // Hands the kd-* shared memory ring over to the consumer listening at path
+    static bool sendKdShmFd(const char *path, int fd, unsigned int size);
 };
 
 #else
@@ -48,6 +51,7 @@ class FdTransferClient {
     static bool connectToServer(const char *path, int pid) { return false; }
     static bool hasPeer() { return false; }
     static void closePeer() { }
+    static bool sendKdShmFd(const char *path, int fd, unsigned int size) { return false; }
 };
 
 #endif // __linux__
@@ -107,6 +107,50 @@ int FdTransferClient::requestKallsymsFd() {
     return fd;
 }
 
+bool FdTransferClient::sendKdShmFd(const char *path, int fd, unsigned int size) {
+    struct sockaddr_un sun;
+    socklen_t addrlen;
+    if (!socketPath(path, &sun, &addrlen)) {
+        Log::warn("kdshm path is too long: %s", path);
+        return false;
+    }
+
+    int sock = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+    if (sock == -1) {
+        Log::warn("FdTransferClient socket(): %s", strerror(errno));
+        return false;
+    }
+
+    // Do not block for more than 10 seconds when waiting for a response
+    struct timeval tv = {10, 0};
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+    struct kd_shm_fd_request request;
+    request.header.type = KD_SHM_FD;
+    request.size = size;
+
+    struct fd_response resp;
+    int unused_fd = -1;
+    bool result = false;
+    if (connect(sock, (const struct sockaddr *)&sun, addrlen) == -1) {
+        Log::warn("FdTransferClient connect(%s): %s", path, strerror(errno));
+    } else if (!sendFdMessage(sock, &request, sizeof(request), fd)) {
+        Log::warn("FdTransferClient sendmsg(): %s", strerror(errno));
+    } else if (recvFdMessage(sock, &resp, sizeof(resp), &unused_fd) != sizeof(resp) || resp.type != KD_SHM_FD) {
+        Log::warn("FdTransferClient recvmsg(): no response from kdshm consumer");
+    } else if (resp.error != 0) {
+        Log::warn("kdshm consumer rejected the ring: %s", strerror(resp.error));
+    } else {
+        result = true;
+    }
+
+    if (unused_fd != -1) {
+        close(unused_fd);
+    }
+    close(sock);
+    return result;
+}
+
 int FdTransferClient::recvFd(unsigned int type, struct fd_response *resp, size_t resp_size) {
     struct msghdr msg = {0};
 
@@ -939,20 +939,16 @@ class Recording {
         _thread_set.collect(threads);
 
         Profiler* profiler = Profiler::instance();
-        MutexLocker ml(profiler->_thread_names_lock);
-        std::map<int, std::string>& thread_names = profiler->_thread_names;
-        std::map<int, jlong>& thread_ids = profiler->_thread_ids;
+        ThreadInfoTable& thread_info = profiler->_thread_info;
         char name_buf[32];
 
         buf->putVar32(T_THREAD);
         buf->putVar32(threads.size());
         for (int i = 0; i < threads.size(); i++) {
-            const char* thread_name;
+            const char* thread_name = thread_info.name(threads[i]);
             jlong thread_id;
-            std::map<int, std::string>::const_iterator it = thread_names.find(threads[i]);
-            if (it != thread_names.end()) {
-                thread_name = it->second.c_str();
-                thread_id = thread_ids[threads[i]];
+            if (thread_name != NULL) {
+                thread_id = thread_info.javaThreadId(threads[i]);
             } else {
                 sprintf(name_buf, "[tid=%d]", threads[i]);
                 thread_name = name_buf;
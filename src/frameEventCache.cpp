@@ -1,48 +1,131 @@
 #include "frameEventCache.h"
-#include "arch.h"
 #include <string.h>
 #include "eventLogger.h"
+#include "log.h"
+#include "os.h"
 #include "timeUtil.h"
+#include "vmEntry.h"
 
 using namespace std;
 
-static const int MAX_SIZE = 4096;
-static const int MAX_DEPTH = 128;
+static const size_t RING_PAGE_SIZE = RING_PAGE_CAPACITY * sizeof(P_FrameEventRing);
+static const u32 DEFINITION_PAGE_CAPACITY = 1 << DEFINITION_PAGE_BITS;
 
-FrameEvent::FrameEvent(int depth) : _thread_id(0), _timestamp(0), _num_frames(0) {
-    _frames = new ASGCT_CallFrame[depth];
+enum DefinitionState {
+    ID_UNDEFINED,
+    ID_DEFINING,
+    ID_DEFINED
+};
+
+DefinitionTable::~DefinitionTable() {
+    clear();
+}
+
+DefinitionTable::Entry* DefinitionTable::entry(u32 id) {
+    u32 page_index = id >> DEFINITION_PAGE_BITS;
+    Entry* page = __atomic_load_n(&_pages[page_index], __ATOMIC_ACQUIRE);
+    if (page == NULL) {
+        page = (Entry*)OS::safeAlloc(DEFINITION_PAGE_CAPACITY * sizeof(Entry));
+        if (page == NULL) {
+            return NULL;
+        }
+        if (!__sync_bool_compare_and_swap(&_pages[page_index], NULL, page)) {
+            OS::safeFree(page, DEFINITION_PAGE_CAPACITY * sizeof(Entry));
+            page = _pages[page_index];
+        }
+    }
+    return &page[id & (DEFINITION_PAGE_CAPACITY - 1)];
+}
+
+bool DefinitionTable::define(u32 id, u64 key) {
+    Entry* e = entry(id);
+    if (e == NULL) {
+        // Out of memory: a repeated definition is better than a dangling reference
+        return true;
+    }
+
+    while (true) {
+        u32 state = __atomic_load_n(&e->_state, __ATOMIC_ACQUIRE);
+        if (state == ID_DEFINED && __atomic_load_n(&e->_key, __ATOMIC_RELAXED) == key) {
+            return false;
+        } else if (state != ID_DEFINING && __sync_bool_compare_and_swap(&e->_state, state, ID_DEFINING)) {
+            e->_key = key;
+            return true;
+        }
+        // Symbolization of the definition happens outside any lock, so just wait for it
+        std::this_thread::yield();
+    }
 }
 
-FrameEvent::~FrameEvent() {
-    delete []_frames;
-    _frames = NULL;
+void DefinitionTable::defined(u32 id) {
+    Entry* e = entry(id);
+    if (e != NULL) {
+        __atomic_store_n(&e->_state, ID_DEFINED, __ATOMIC_RELEASE);
+    }
 }
 
-void FrameEvent::setEvent(int thread_id, int num_frames, ASGCT_CallFrame* frames) {
-    _timestamp = getCurrentTimestamp();
-    _thread_id = thread_id;
-    _num_frames = num_frames;
-    if (_num_frames > MAX_DEPTH) {
-        _num_frames = MAX_DEPTH;
+// Must not run concurrently with define(). Unmapping is cheaper than zeroing a page that is mostly untouched
+void DefinitionTable::clear() {
+    for (u32 i = 0; i < MAX_DEFINITION_PAGES; i++) {
+        if (_pages[i] != NULL) {
+            OS::safeFree(_pages[i], DEFINITION_PAGE_CAPACITY * sizeof(Entry));
+            _pages[i] = NULL;
+        }
     }
-    for (int i = 0; i < _num_frames; i++) {
-        _frames[i].bci = frames[i].bci;
-        _frames[i].method_id = frames[i].method_id;
+}
+
+u32 FrameEventCache::frameNameId(ASGCT_CallFrame& frame, FrameName* fn) {
+    const char* name = fn->name(frame);
+    u32 id = _frame_names.lookup(name);
+
+    // Workers that need the same name wait until the definition is written, so it precedes their references
+    if (_defined_names.define(id, 0)) {
+        if (EventLogger::binary()) {
+            KdRecord record(KD_RECORD_FRAME_NAME);
+            record.putVar32(id);
+            record.putString(name);
+            EventLogger::write(record);
+        } else {
+            // kd-fn@name_id!name!
+            EventLogger::log("kd-fn@%u!%s!", id, name);
+        }
+        _defined_names.defined(id);
+    }
+    return id;
+}
+
+const char* FrameEventCache::frameText(ASGCT_CallFrame& frame, FrameName* fn, char* ref_buf, size_t ref_size) {
+    if (_frame_dict) {
+        snprintf(ref_buf, ref_size, "%u", frameNameId(frame, fn));
+        return ref_buf;
+    }
+    return fn->name(frame);
+}
+
+void FrameEventCache::putFrames(KdRecord& record, CallTrace* trace, FrameName* fn) {
+    record.putVar32(trace->num_frames);
+    for (int i = 0; i < trace->num_frames; i++) {
+        if (_frame_dict) {
+            record.putVar32(frameNameId(trace->frames[i], fn));
+        } else {
+            record.putString(fn->name(trace->frames[i]));
+        }
     }
 }
 
-void FrameEvent::log(FrameName* frameName) {
+void FrameEventCache::logFrames(const char* prefix, CallTrace* trace, FrameName* fn) {
     string ret_string = string();
+    char ref_buf[16];
     int depth = 0;
-    for (int i = 0; i < _num_frames; i++) {
+    for (int i = 0; i < trace->num_frames; i++) {
         if (ret_string.empty()) {
             depth = i;
-            ret_string.append(frameName->name(_frames[i]));
+            ret_string.append(frameText(trace->frames[i], fn, ref_buf, sizeof(ref_buf)));
         } else {
-            const char* newName = frameName->name(_frames[i]);
+            const char* newName = frameText(trace->frames[i], fn, ref_buf, sizeof(ref_buf));
             // Split stack within 1K.
             if (strlen(newName) + ret_string.length() > 950) {
-                EventLogger::log("kd-stack@%lld!%d!%d!%d!%s", _timestamp, _thread_id, depth, 0, ret_string.c_str());
+                EventLogger::log("%s!%d!%d!%s", prefix, depth, 0, ret_string.c_str());
                 ret_string.clear();
                 depth = i;
             }
@@ -50,63 +133,313 @@ void FrameEvent::log(FrameName* frameName) {
         }
         ret_string.append("!");
     }
-    // kd-stack@ts!tid!depth!finish!stack!
-    EventLogger::log("kd-stack@%lld!%d!%d!%d!%s", _timestamp, _thread_id, depth, 1, ret_string.c_str());
+    EventLogger::log("%s!%d!%d!%s", prefix, depth, 1, ret_string.c_str());
 }
 
-FrameEventList::FrameEventList(int capacity, int max_depth) : _capacity(capacity), _count(0) {
-    _events = new P_FrameEvent[capacity];
-    for (int i = 0; i < capacity; i++) {
-        _events[i] = new FrameEvent(max_depth);
+void FrameEventCache::logStack(FrameEvent& event, CallTrace* trace, FrameName* fn) {
+    if (EventLogger::binary()) {
+        KdRecord record(_frame_dict ? KD_RECORD_STACK_REFS : KD_RECORD_STACK);
+        record.putVar64(event._timestamp);
+        record.putVar32(event._thread_id);
+        putFrames(record, trace, fn);
+        EventLogger::write(record);
+    } else {
+        // kd-stack@ts!tid!depth!finish!stack!
+        char prefix[64];
+        snprintf(prefix, sizeof(prefix), "kd-stack@%lld!%d", event._timestamp, event._thread_id);
+        logFrames(prefix, trace, fn);
     }
 }
 
-FrameEventList::~FrameEventList() {
-    delete []_events;
-    _count = 0;
+void FrameEventCache::logStackDefinition(u32 call_trace_id, CallTrace* trace, FrameName* fn) {
+    if (EventLogger::binary()) {
+        KdRecord record(_frame_dict ? KD_RECORD_STACK_DEF_REFS : KD_RECORD_STACK_DEF);
+        record.putVar32(call_trace_id);
+        putFrames(record, trace, fn);
+        EventLogger::write(record);
+    } else {
+        // kd-sdef@stack_id!depth!finish!stack!
+        char prefix[64];
+        snprintf(prefix, sizeof(prefix), "kd-sdef@%u", call_trace_id);
+        logFrames(prefix, trace, fn);
+    }
 }
 
-void FrameEventList::addFrameEvent(int thread_id, int num_frames, ASGCT_CallFrame* frames) {
-    int index = atomicInc(_count) % _capacity;
-    _events[index]->setEvent(thread_id, num_frames, frames);
+void FrameEventCache::logSample(FrameEvent& event) {
+    if (EventLogger::binary()) {
+        KdRecord record(KD_RECORD_SAMPLE);
+        record.putVar64(event._timestamp);
+        record.putVar32(event._thread_id);
+        record.putVar32(event._call_trace_id);
+        EventLogger::write(record);
+    } else {
+        // kd-smp@ts!tid!stack_id!
+        EventLogger::log("kd-smp@%lld!%d!%u!", event._timestamp, event._thread_id, event._call_trace_id);
+    }
 }
 
-void FrameEventList::log(FrameName* frameName) {
-    if (_count == 0) {
+void FrameEventCache::log(FrameEvent& event, FrameName* fn) {
+    u64 key = 0;
+    CallTraceHolder holder;
+    CallTrace* trace = _storage->getCallTrace(event._call_trace_id, holder, &key);
+    if (trace == NULL) {
+        // The trace is still being published by a concurrent put
+        atomicInc(_dropped);
         return;
     }
 
-    int collect_thread = OS::threadId();
-    for (int i = 0; i < _count && i < _capacity; i++) {
-        // Ignore collect thread.
-        if (collect_thread != _events[i]->_thread_id) {
-            _events[i]->log(frameName);
-        }
+    if (!_stack_ids) {
+        logStack(event, trace, fn);
+        return;
+    }
+
+    u32 id = event._call_trace_id;
+    if (_defined_traces.define(id, key)) {
+        logStackDefinition(id, trace, fn);
+        _defined_traces.defined(id);
+    }
+    logSample(event);
+}
+
+bool FrameEventRing::add(u32 call_trace_id) {
+    if (!__sync_bool_compare_and_swap(&_busy, 0, 1)) {
+        atomicInc(_dropped);
+        return false;
+    }
+
+    u32 head = _head;
+    if (head - __atomic_load_n(&_tail, __ATOMIC_ACQUIRE) >= FRAME_RING_CAPACITY) {
+        // The collector is behind: keep pending events intact and account for the loss
+        atomicInc(_dropped);
+        __atomic_store_n(&_busy, 0, __ATOMIC_RELEASE);
+        return false;
+    }
+
+    FrameEvent& event = _events[head & (FRAME_RING_CAPACITY - 1)];
+    // Raw ticks are much cheaper than timespec_get, the collector converts them in bulk
+    event._timestamp = TSC::ticks();
+    event._thread_id = _thread_id;
+    event._call_trace_id = call_trace_id;
+    // Publish the event only after it has been completely written
+    __atomic_store_n(&_head, head + 1, __ATOMIC_RELEASE);
+    __atomic_store_n(&_busy, 0, __ATOMIC_RELEASE);
+    return true;
+}
+
+int FrameEventRing::drain(FrameEventCache* cache, FrameName* frameName) {
+    u32 tail = _tail;
+    u32 head = __atomic_load_n(&_head, __ATOMIC_ACQUIRE);
+    for (u32 i = tail; i != head; i++) {
+        FrameEvent& event = _events[i & (FRAME_RING_CAPACITY - 1)];
+        event._timestamp = TicksClock::toNanos(event._timestamp);
+    }
+    for (u32 i = tail; i != head; i++) {
+        cache->log(_events[i & (FRAME_RING_CAPACITY - 1)], frameName);
     }
-    _count = 0;
+    // Release the slots back to the producer
+    __atomic_store_n(&_tail, head, __ATOMIC_RELEASE);
+    return head - tail;
 }
 
-FrameEventCache::FrameEventCache() : _write_index(0) {
-    _list = new P_FrameEventList[2];
-    _list[0] = new FrameEventList(MAX_SIZE, MAX_DEPTH);
-    _list[1] = new FrameEventList(MAX_SIZE, MAX_DEPTH);
+void FrameEventRing::discard() {
+    __atomic_store_n(&_tail, __atomic_load_n(&_head, __ATOMIC_ACQUIRE), __ATOMIC_RELEASE);
+    takeDropped();
+}
+
+FrameEventCache::FrameEventCache(CallTraceStorage* storage) :
+    _storage(storage), _rings(NULL), _overflow(0), _dropped(0), _stack_ids(false), _frame_dict(false),
+    _collect_frame_task(NULL), _workers(1), _cycle(0), _pending_workers(0), _stop_workers(false) {
+    memset(_pages, 0, sizeof(_pages));
+    memset(_worker_names, 0, sizeof(_worker_names));
 }
 
 FrameEventCache::~FrameEventCache() {
-    delete []_list;
+    for (FrameEventRing* ring = _rings; ring != NULL; ) {
+        FrameEventRing* next = ring->_next;
+        OS::safeFree(ring, sizeof(FrameEventRing));
+        ring = next;
+    }
+    for (u32 i = 0; i < MAX_RING_PAGES; i++) {
+        if (_pages[i] != NULL) {
+            OS::safeFree(_pages[i], RING_PAGE_SIZE);
+        }
+    }
 }
 
-void FrameEventCache::add(int thread_id, int num_frames, ASGCT_CallFrame* frames) {
-    _list[_write_index]->addFrameEvent(thread_id, num_frames, frames);
+FrameEventRing* FrameEventCache::getRing(int thread_id) {
+    u32 page_index = (u32)thread_id / RING_PAGE_CAPACITY;
+    if (page_index >= MAX_RING_PAGES) {
+        return NULL;
+    }
+
+    P_FrameEventRing* page = _pages[page_index];
+    if (page == NULL) {
+        page = (P_FrameEventRing*)OS::safeAlloc(RING_PAGE_SIZE);
+        if (page == NULL) {
+            return NULL;
+        }
+        P_FrameEventRing* old_page = __sync_val_compare_and_swap(&_pages[page_index], NULL, page);
+        if (old_page != NULL) {
+            OS::safeFree(page, RING_PAGE_SIZE);
+            page = old_page;
+        }
+    }
+
+    P_FrameEventRing& slot = page[(u32)thread_id % RING_PAGE_CAPACITY];
+    FrameEventRing* ring = slot;
+    if (ring == NULL) {
+        // safeAlloc returns zeroed memory, so the ring is empty right away
+        ring = (FrameEventRing*)OS::safeAlloc(sizeof(FrameEventRing));
+        if (ring == NULL) {
+            return NULL;
+        }
+        ring->_thread_id = thread_id;
+
+        FrameEventRing* old_ring = __sync_val_compare_and_swap(&slot, NULL, ring);
+        if (old_ring != NULL) {
+            OS::safeFree(ring, sizeof(FrameEventRing));
+            return old_ring;
+        }
+
+        // Make the new ring visible to the collector
+        FrameEventRing* head;
+        do {
+            head = _rings;
+            ring->_next = head;
+        } while (!__sync_bool_compare_and_swap(&_rings, head, ring));
+    }
+    return ring;
+}
+
+void FrameEventCache::add(int thread_id, u32 call_trace_id) {
+    FrameEventRing* ring = getRing(thread_id);
+    if (ring == NULL) {
+        atomicInc(_overflow);
+        return;
+    }
+    ring->add(call_trace_id);
+}
+
+void FrameEventCache::drainPartition(int worker, FrameName* fn, int collect_thread) {
+    for (FrameEventRing* ring = _rings; ring != NULL; ring = ring->_next) {
+        if ((int)((u32)ring->_thread_id % _workers) != worker) {
+            continue;
+        }
+        if (ring->_thread_id == collect_thread) {
+            // Ignore collect thread.
+            ring->discard();
+            continue;
+        }
+        ring->drain(this, fn);
+
+        u64 dropped = ring->takeDropped();
+        if (dropped > 0) {
+            atomicInc(_dropped, dropped);
+            Log::debug("Dropped %llu samples of thread %d", dropped, ring->_thread_id);
+        }
+    }
 }
 
 void FrameEventCache::collect(FrameName* fn) {
-    FrameEventList* list = _list[_write_index];
-    _write_index = 1 - _write_index;
-    list->log(fn);
+    TicksClock::calibrate();
+
+    int collect_thread = OS::threadId();
+    if (_workers <= 1) {
+        drainPartition(0, fn, collect_thread);
+        return;
+    }
+
+    {
+        std::lock_guard<std::mutex> guard(_cycle_lock);
+        _cycle++;
+        _pending_workers = _workers - 1;
+    }
+    _cycle_start.notify_all();
+
+    // The collector thread takes the first partition itself
+    drainPartition(0, fn, collect_thread);
+
+    std::unique_lock<std::mutex> guard(_cycle_lock);
+    while (_pending_workers > 0) {
+        _cycle_done.wait(guard);
+    }
+}
+
+void FrameEventCache::workerLoop(int worker) {
+    int collect_thread = OS::threadId();
+    u64 seen_cycle = 0;
+    {
+        std::lock_guard<std::mutex> guard(_cycle_lock);
+        seen_cycle = _cycle;
+    }
+
+    while (true) {
+        {
+            std::unique_lock<std::mutex> guard(_cycle_lock);
+            while (_cycle == seen_cycle && !_stop_workers) {
+                _cycle_start.wait(guard);
+            }
+            if (_stop_workers) {
+                return;
+            }
+            seen_cycle = _cycle;
+        }
+
+        drainPartition(worker, _worker_names[worker], collect_thread);
+
+        std::lock_guard<std::mutex> guard(_cycle_lock);
+        if (--_pending_workers == 0) {
+            _cycle_done.notify_one();
+        }
+    }
 }
 
-void FrameEventCache::startCollectThreadTask(FrameName* fn, long interval) {
+void FrameEventCache::startWorkers(FrameName* fn, int workers) {
+    _workers = workers < 1 ? 1 : workers > MAX_SYMBOLIZE_WORKERS ? MAX_SYMBOLIZE_WORKERS : workers;
+    _stop_workers = false;
+    for (int i = 1; i < _workers; i++) {
+        // Every worker needs its own scratch buffer; the method name cache is shared
+        _worker_names[i] = new FrameName(*fn);
+        _worker_threads[i] = std::thread([this, i]{
+            VM::attachThread("AsyncProfiler-Symbolize");
+            workerLoop(i);
+            VM::detachThread();
+        });
+    }
+}
+
+void FrameEventCache::stopWorkers() {
+    {
+        std::lock_guard<std::mutex> guard(_cycle_lock);
+        _stop_workers = true;
+    }
+    _cycle_start.notify_all();
+
+    for (int i = 1; i < _workers; i++) {
+        _worker_threads[i].join();
+        delete _worker_names[i];
+        _worker_names[i] = NULL;
+    }
+    _workers = 1;
+}
+
+void FrameEventCache::discard() {
+    for (FrameEventRing* ring = _rings; ring != NULL; ring = ring->_next) {
+        ring->discard();
+    }
+    _overflow = 0;
+    _dropped = 0;
+    _defined_traces.clear();
+    _frame_names.clear();
+    _defined_names.clear();
+}
+
+void FrameEventCache::startCollectThreadTask(FrameName* fn, long interval, Arguments& args) {
+    // Samples and names left from the previous session belong to a stale FrameName epoch
+    discard();
+    _stack_ids = args._stack_ids;
+    _frame_dict = args._frame_dict;
+    startWorkers(fn, args._kd_workers);
     _collect_frame_task = new CollectFrameEventTask(this, fn, interval);
     _collect_frame_thread = std::thread([&]{
         VM::attachThread("AsyncProfiler-Collect-Cpu");
@@ -121,6 +454,10 @@ void FrameEventCache::endCollectThreadTask() {
         _collect_frame_task->stop();
         _collect_frame_thread.join();
         delete _collect_frame_task;
-        _collect_frame_task = NULL;        
+        _collect_frame_task = NULL;
+    }
+    stopWorkers();
+    if (dropped() > 0) {
+        Log::warn("%llu CPU samples were dropped: collector could not keep up", dropped());
     }
-}
\ No newline at end of file
+}
@@ -1,59 +1,173 @@
 #ifndef _FRAME_EVENT_CACHE_H
 #define _FRAME_EVENT_CACHE_H
 
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <string.h>
+#include "arch.h"
+#include "arguments.h"
+#include "callTraceStorage.h"
+#include "dictionary.h"
 #include "vmEntry.h"
 #include "frameName.h"
+#include "kdRecord.h"
 #include "stoppableTask.h"
 
-class FrameEvent {
+// Number of samples one thread can buffer between two collection cycles. Must be a power of 2
+const u32 FRAME_RING_CAPACITY = 128;
+// Upper bound of kdworkers
+const int MAX_SYMBOLIZE_WORKERS = 16;
+// How many per-thread rings one index page can address
+const u32 RING_PAGE_CAPACITY = 4096;
+// Enough pages to address the whole range of Linux thread IDs (pid_max <= 4M)
+const u32 MAX_RING_PAGES = (1 << 22) / RING_PAGE_CAPACITY;
+
+// DefinitionTable covers the whole u32 range of stack and frame name IDs in pages of 2^19 entries
+const int DEFINITION_PAGE_BITS = 19;
+const u32 MAX_DEFINITION_PAGES = 1 << (32 - DEFINITION_PAGE_BITS);
+
+// Stack frames of a sample live in CallTraceStorage, the event refers to them by ID
+struct FrameEvent {
+    u64 _timestamp;
+    int _thread_id;
+    u32 _call_trace_id;
+};
+
+class FrameEventCache;
+
+// Single-producer / single-consumer ring owned by one thread.
+// The producer is a signal handler running on that thread, the consumer is CollectFrameEventTask.
+// A full ring never overwrites pending events: new samples are dropped and counted instead.
+class FrameEventRing {
     private:
-        u64 _timestamp;
-        int _num_frames;
-        ASGCT_CallFrame* _frames;
-    public:
+        FrameEventRing* _next;
         int _thread_id;
+        // Guards against a nested or an external producer for the same thread
+        volatile int _busy;
+        char _padding0[48];
+        volatile u32 _head;
+        char _padding1[60];
+        volatile u32 _tail;
+        volatile u64 _dropped;
+        char _padding2[52];
+        FrameEvent _events[FRAME_RING_CAPACITY];
 
-        FrameEvent(int depth);
-        ~FrameEvent();
-        void setEvent(int thread_id, int num_frames, ASGCT_CallFrame* frames);
-        void log(FrameName* frameName);
+        friend class FrameEventCache;
+    public:
+        bool add(u32 call_trace_id);
+        int drain(FrameEventCache* cache, FrameName* frameName);
+        void discard();
+
+        u64 takeDropped() {
+            return __sync_lock_test_and_set(&_dropped, 0);
+        }
 };
 
-typedef FrameEvent* P_FrameEvent;
+typedef FrameEventRing* P_FrameEventRing;
 
-class FrameEventList {
+// Tells which IDs of the kd-* stream have been defined, so that every definition is written once
+// and precedes all references to it. Symbolization workers query it without locks;
+// pages are mmapped on first use and kept until the table is destroyed.
+class DefinitionTable {
     private:
-        int _capacity;
-        volatile int _count;
-        P_FrameEvent* _events;
+        struct Entry {
+            // Tells a reused stack ID apart from the stack it was defined for
+            volatile u64 _key;
+            volatile u32 _state;
+            u32 _padding;
+        };
+
+        Entry* volatile _pages[MAX_DEFINITION_PAGES];
+
+        Entry* entry(u32 id);
+
     public:
-        FrameEventList(int capacity, int max_depth);
-        ~FrameEventList();
-        void addFrameEvent(int thread_id, int num_frames, ASGCT_CallFrame* frames);
-        void log(FrameName* frameName);
-};
+        DefinitionTable() {
+            memset((void*)_pages, 0, sizeof(_pages));
+        }
+
+        ~DefinitionTable();
 
-typedef FrameEventList* P_FrameEventList;
+        // Returns true if the caller has to write the definition of id for key and call defined(id) then.
+        // Waits while another worker is writing the same definition
+        bool define(u32 id, u64 key);
+        void defined(u32 id);
+        void clear();
+};
 
 class CollectFrameEventTask;
 
+// FrameEventCache::add is lock-free and signal-safe;
+// per-thread rings are allocated lazily and never released, so that tid reuse is cheap
 class FrameEventCache {
     private:
-        P_FrameEventList* _list;
-        volatile int _write_index;
+        CallTraceStorage* _storage;
+        P_FrameEventRing* _pages[MAX_RING_PAGES];
+        FrameEventRing* volatile _rings;
+        volatile u64 _overflow;
+        volatile u64 _dropped;
+
+        // With stackids, every stack is defined once per profiling session
+        // and samples refer to it by call trace ID. With tracemem=N an evicted ID may be reused
+        // for another stack; the stack hash tells when an ID has to be defined again.
+        bool _stack_ids;
+        DefinitionTable _defined_traces;
+
+        // With framedict, frame names are interned like JFR constant pools:
+        // a name is written once per profiling session and stacks refer to it by ID
+        bool _frame_dict;
+        Dictionary _frame_names;
+        DefinitionTable _defined_names;
 
         CollectFrameEventTask* _collect_frame_task;
         std::thread _collect_frame_thread;
 
+        // With kdworkers=N, the collector thread and N-1 workers symbolize a drained cycle together.
+        // Rings are partitioned by thread ID, so that samples of one thread keep their order.
+        int _workers;
+        FrameName* _worker_names[MAX_SYMBOLIZE_WORKERS];
+        std::thread _worker_threads[MAX_SYMBOLIZE_WORKERS];
+        std::mutex _cycle_lock;
+        std::condition_variable _cycle_start;
+        std::condition_variable _cycle_done;
+        u64 _cycle;
+        int _pending_workers;
+        bool _stop_workers;
+
+        FrameEventRing* getRing(int thread_id);
+        void discard();
+
+        void startWorkers(FrameName* fn, int workers);
+        void stopWorkers();
+        void workerLoop(int worker);
+        void drainPartition(int worker, FrameName* fn, int collect_thread);
+
+        u32 frameNameId(ASGCT_CallFrame& frame, FrameName* fn);
+        const char* frameText(ASGCT_CallFrame& frame, FrameName* fn, char* ref_buf, size_t ref_size);
+        void putFrames(KdRecord& record, CallTrace* trace, FrameName* fn);
+        void logFrames(const char* prefix, CallTrace* trace, FrameName* fn);
+        void logStack(FrameEvent& event, CallTrace* trace, FrameName* fn);
+        void logStackDefinition(u32 call_trace_id, CallTrace* trace, FrameName* fn);
+        void logSample(FrameEvent& event);
+
+        friend class FrameEventRing;
         friend class CollectFrameEventTask;
     public:
-        FrameEventCache();
+        FrameEventCache(CallTraceStorage* storage);
         ~FrameEventCache();
 
-        void add(jint thread_id, int num_frames, ASGCT_CallFrame* frames);
+        void add(jint thread_id, u32 call_trace_id);
+        void log(FrameEvent& event, FrameName* fn);
         void collect(FrameName* fn);
-        void startCollectThreadTask(FrameName* fn, long interval);
+        void startCollectThreadTask(FrameName* fn, long interval, Arguments& args);
         void endCollectThreadTask();
+
+        // Total number of samples lost because a ring was full or could not be allocated
+        u64 dropped() {
+            return _dropped + _overflow;
+        }
 };
 
 class CollectFrameEventTask: public Stoppable {
@@ -69,10 +183,12 @@ class CollectFrameEventTask: public Stoppable {
                 std::this_thread::sleep_for(std::chrono::milliseconds(intervalMs));
                 cache->collect(fn);
             }
+            // Drain whatever was recorded before the stop request
+            cache->collect(fn);
         }
     private:
         FrameEventCache* cache;
         FrameName* fn;
         long intervalMs;
 };
-#endif // _FRAME_EVENT_CACHE_H
\ No newline at end of file
+#endif // _FRAME_EVENT_CACHE_H
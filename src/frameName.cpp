@@ -80,17 +80,17 @@ bool Matcher::matches(const char* s) {
 }
 
 
-JMethodCache FrameName::_cache;
+MethodCache FrameName::_cache;
 
-FrameName::FrameName(Arguments& args, int style, int epoch, Mutex& thread_names_lock, ThreadMap& thread_names) :
+FrameName::FrameName(Arguments& args, int style, int epoch, ThreadInfoTable& thread_info) :
     _class_names(),
     _include(),
     _exclude(),
     _style(style),
     _cache_epoch((unsigned char)epoch),
     _cache_max_age(args._mcache),
-    _thread_names_lock(thread_names_lock),
-    _thread_names(thread_names)
+    _thread_info(thread_info),
+    _owns_cache(true)
 {
     memset(_buf, 0, sizeof(_buf));
 
@@ -100,19 +100,26 @@ FrameName::FrameName(Arguments& args, int style, int epoch, Mutex& thread_names_
     Profiler::instance()->classMap()->collect(_class_names);
 }
 
+FrameName::FrameName(const FrameName& other) :
+    _class_names(other._class_names),
+    _include(other._include),
+    _exclude(other._exclude),
+    _style(other._style),
+    _cache_epoch(other._cache_epoch),
+    _cache_max_age(other._cache_max_age),
+    _thread_info(other._thread_info),
+    _owns_cache(false)
+{
+    memset(_buf, 0, sizeof(_buf));
+}
+
 FrameName::~FrameName() {
-    if (_cache_max_age == 0) {
-        _cache.clear();
-    } else {
-        // Remove stale methods from the cache, leave the fresh ones for the next profiling session
-        for (JMethodCache::iterator it = _cache.begin(); it != _cache.end(); ) {
-            if (_cache_epoch - (unsigned char)it->second[0] >= _cache_max_age) {
-                _cache.erase(it++);
-            } else {
-                ++it;
-            }
-        }
+    if (!_owns_cache) {
+        return;
     }
+
+    // Remove stale methods from the cache, leave the fresh ones for the next profiling session
+    _cache.evict(_cache_epoch, _cache_max_age);
 }
 
 void FrameName::buildFilter(std::vector<Matcher>& vector, const char* base, int offset) {
@@ -268,12 +275,11 @@ const char* FrameName::name(ASGCT_CallFrame& frame, bool for_matching) {
 
         case BCI_THREAD_ID: {
             int tid = (int)(uintptr_t)frame.method_id;
-            MutexLocker ml(_thread_names_lock);
-            ThreadMap::iterator it = _thread_names.find(tid);
+            const char* thread_name = _thread_info.name(tid);
             if (for_matching) {
-                return it != _thread_names.end() ? it->second.c_str() : "";
-            } else if (it != _thread_names.end()) {
-                snprintf(_buf, sizeof(_buf) - 1, "[%s tid=%d]", it->second.c_str(), tid);
+                return thread_name != NULL ? thread_name : "";
+            } else if (thread_name != NULL) {
+                snprintf(_buf, sizeof(_buf) - 1, "[%s tid=%d]", thread_name, tid);
             } else {
                 snprintf(_buf, sizeof(_buf) - 1, "[tid=%d]", tid);
             }
@@ -288,18 +294,12 @@ const char* FrameName::name(ASGCT_CallFrame& frame, bool for_matching) {
         default: {
             const char* type_suffix = typeSuffix(FrameType::decode(frame.bci));
 
-            JMethodCache::iterator it = _cache.lower_bound(frame.method_id);
-            if (it != _cache.end() && it->first == frame.method_id) {
-                it->second[0] = _cache_epoch;
-                if (type_suffix != NULL) {
-                    snprintf(_buf, sizeof(_buf) - 1, "%s%s", it->second.c_str() + 1, type_suffix);
-                    return _buf;
-                }
-                return it->second.c_str() + 1;
+            if (_cache.lookup(frame.method_id, _cache_epoch, _buf, sizeof(_buf) - 1, type_suffix)) {
+                return _buf;
             }
 
             char* newName = javaMethodName(frame.method_id);
-            _cache.insert(it, JMethodCache::value_type(frame.method_id, std::string(1, _cache_epoch) + newName));
+            _cache.insert(frame.method_id, newName, _cache_epoch);
             return type_suffix != NULL ? strcat(newName, type_suffix) : newName;
         }
     }
@@ -22,11 +22,10 @@
 #include <vector>
 #include <string>
 #include "arguments.h"
-#include "mutex.h"
+#include "methodCache.h"
+#include "threadInfo.h"
 #include "vmEntry.h"
 
-typedef std::map<jmethodID, std::string> JMethodCache;
-typedef std::map<int, std::string> ThreadMap;
 typedef std::map<unsigned int, const char*> ClassMap;
 
 
@@ -57,7 +56,8 @@ class Matcher {
 
 class FrameName {
   private:
-    static JMethodCache _cache;
+    // Symbolization workers, dump paths and lock stacks may share the cache concurrently
+    static MethodCache _cache;
 
     ClassMap _class_names;
     std::vector<Matcher> _include;
@@ -66,8 +66,8 @@ class FrameName {
     int _style;
     unsigned char _cache_epoch;
     unsigned char _cache_max_age;
-    Mutex& _thread_names_lock;
-    ThreadMap& _thread_names;
+    ThreadInfoTable& _thread_info;
+    bool _owns_cache;
 
     void buildFilter(std::vector<Matcher>& vector, const char* base, int offset);
     char* truncate(char* name, int max_length);
@@ -77,7 +77,9 @@ class FrameName {
     char* javaClassName(const char* symbol, int length, int style);
 
   public:
-    FrameName(Arguments& args, int style, int epoch, Mutex& thread_names_lock, ThreadMap& thread_names);
+    FrameName(Arguments& args, int style, int epoch, ThreadInfoTable& thread_info);
+    // A copy has its own scratch buffer for use by another thread; only the original evicts the cache
+    FrameName(const FrameName& other);
     ~FrameName();
 
     const char* name(ASGCT_CallFrame& frame, bool for_matching = false);
@@ -146,7 +146,7 @@ void J9StackTraces::timerLoop() {
             int tid = J9Ext::GetOSThreadID(thread);
             // ExecutionEvent event;
             // Profiler::instance()->recordExternalSample(notif->counter, &event, tid, num_frames, frames);
-            Profiler::instance()->printExternalSample(tid, num_frames, frames);
+            Profiler::instance()->printExternalSample(notif->counter, tid, num_frames, frames);
 
             ptr += notif->size();
         }
@@ -71,7 +71,7 @@ void J9WallClock::timerLoop() {
                 // ExecutionEvent event;
                 // event._thread_state = (si->state & JVMTI_THREAD_STATE_RUNNABLE) ? THREAD_RUNNING : THREAD_SLEEPING;
                 // Profiler::instance()->recordExternalSample(_interval, &event, tid, si->frame_count, frames);
-                Profiler::instance()->printExternalSample(tid, si->frame_count, frames);
+                Profiler::instance()->printExternalSample(_interval, tid, si->frame_count, frames);
             }
             jvmti->Deallocate((unsigned char*)stack_infos);
         }
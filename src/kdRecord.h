@@ -0,0 +1,198 @@
+/*
+ * Copyright 2022 The Kindling Authors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _KDRECORD_H
+#define _KDRECORD_H
+
+#include <stdlib.h>
+#include <string.h>
+#include "arch.h"
+
+// Binary encoding of the kd-* event stream (kdformat=binary).
+// Every record is self-delimiting, so it never needs to be split:
+//
+//   'k' 'b' | type (1 byte) | payload length (varint) | payload
+//
+// Integers in the payload are LEB128 varints, signed values are zigzag-encoded,
+// strings are a varint length followed by UTF-8 bytes without a terminator.
+// See src/converter/one/kd/KdReader.java for the reference decoder.
+enum KdRecordType {
+    // varint64 timestamp, varint32 tid, varint32 num_frames, string[num_frames] frames (top first)
+    KD_RECORD_STACK       = 1,
+    // varint32 tid, string name
+    KD_RECORD_THREAD_NAME = 2,
+    // varint64 wait_ts, varint64 wake_ts, varint32 tid, varint64 lock_address, string lock_type,
+    // string thread_name, varint64 duration, zigzag32 wait_thread_id, string stack
+    KD_RECORD_LOCK_WAIT   = 3,
+    // stackids=true: varint32 stack_id, varint32 num_frames, string[num_frames] frames (top first)
+    KD_RECORD_STACK_DEF   = 4,
+    // stackids=true: varint64 timestamp, varint32 tid, varint32 stack_id
+    KD_RECORD_SAMPLE      = 5,
+    // framedict=true: varint32 name_id, string name; precedes the first reference to name_id
+    KD_RECORD_FRAME_NAME  = 6,
+    // framedict=true: same as KD_RECORD_STACK and KD_RECORD_STACK_DEF, frames are varint32 name_ids
+    KD_RECORD_STACK_REFS  = 7,
+    KD_RECORD_STACK_DEF_REFS = 8,
+    // lockhist=TIME: varint32 stack_id, string stack; precedes the first histogram of stack_id
+    KD_RECORD_LOCK_STACK_DEF = 9,
+    // lockhist=TIME: varint64 start, varint64 end, string lock_class, varint32 address_bucket,
+    // varint32 stack_id, varint64 count, varint64 total, varint64 max,
+    // varint32 n, n * (varint32 bucket, varint64 count)
+    KD_RECORD_LOCK_HISTOGRAM = 10,
+    // lockgraph=TIME: varint64 timestamp, zigzag32 tid, varint64 lock_address, string lock_class,
+    // varint32 blocked_threads, varint64 blocked_nanos, varint32 max_depth, u8 deadlock
+    KD_RECORD_LOCK_BLOCKER = 11,
+    // lockgraph=TIME: varint64 timestamp, varint32 n, n * (varint32 tid, varint64 lock_address, string lock_class);
+    // every thread waits for the lock held by the next one
+    KD_RECORD_DEADLOCK = 12
+};
+
+const char KD_RECORD_MAGIC0 = 'k';
+const char KD_RECORD_MAGIC1 = 'b';
+// Magic + type + the longest varint32
+const size_t KD_RECORD_MAX_HEADER = 8;
+
+// Records up to this size are built in place, without touching the heap.
+// Only deep kd-stack records, which are written by the frame workers, may grow beyond it
+const size_t KD_RECORD_INLINE_SIZE = 4096;
+// Longest string of a record that must stay within KD_RECORD_INLINE_SIZE, e.g. a thread name
+const size_t KD_RECORD_MAX_NAME = 1024;
+
+class KdRecord {
+  private:
+    char* _buf;
+    size_t _size;
+    size_t _capacity;
+    bool _failed;
+    u8 _type;
+    char _inline[KD_RECORD_INLINE_SIZE];
+
+    bool reserve(size_t len) {
+        if (_size + len <= _capacity) {
+            return true;
+        }
+        if (_failed) {
+            return false;
+        }
+
+        size_t capacity = _capacity * 2;
+        while (capacity < _size + len) {
+            capacity *= 2;
+        }
+        char* buf = (char*)malloc(capacity);
+        if (buf == NULL) {
+            _failed = true;
+            return false;
+        }
+        memcpy(buf, _buf, _size);
+        if (_buf != _inline) {
+            free(_buf);
+        }
+        _buf = buf;
+        _capacity = capacity;
+        return true;
+    }
+
+    void putByte(char c) {
+        if (reserve(1)) {
+            _buf[_size++] = c;
+        }
+    }
+
+  public:
+    KdRecord(KdRecordType type) : _buf(_inline), _size(KD_RECORD_MAX_HEADER), _capacity(KD_RECORD_INLINE_SIZE),
+        _failed(false), _type((u8)type) {
+    }
+
+    ~KdRecord() {
+        if (_buf != _inline) {
+            free(_buf);
+        }
+    }
+
+    void put8(u8 v) {
+        putByte((char)v);
+    }
+
+    void putVar32(u32 v) {
+        while (v > 0x7f) {
+            putByte((char)v | 0x80);
+            v >>= 7;
+        }
+        putByte((char)v);
+    }
+
+    void putVar64(u64 v) {
+        while (v > 0x7f) {
+            putByte((char)v | 0x80);
+            v >>= 7;
+        }
+        putByte((char)v);
+    }
+
+    void putZigzag32(int v) {
+        putVar32(((u32)v << 1) ^ (u32)(v >> 31));
+    }
+
+    void putString(const char* v, size_t len) {
+        putVar32((u32)len);
+        if (len > 0 && reserve(len)) {
+            memcpy(_buf + _size, v, len);
+            _size += len;
+        }
+    }
+
+    void putString(const char* v) {
+        if (v == NULL) {
+            putVar32(0);
+        } else {
+            putString(v, strlen(v));
+        }
+    }
+
+    // Like putString, but cut at max_len bytes
+    void putString(const char* v, size_t len, size_t max_len) {
+        putString(v, len < max_len ? len : max_len);
+    }
+
+    // Writes the header right before the payload and returns the beginning of the record,
+    // or NULL if a record that outgrew the inline buffer could not be allocated
+    const char* finish(size_t* len) {
+        if (_failed) {
+            *len = 0;
+            return NULL;
+        }
+
+        u32 payload = (u32)(_size - KD_RECORD_MAX_HEADER);
+        char header[KD_RECORD_MAX_HEADER];
+        size_t header_len = 0;
+        header[header_len++] = KD_RECORD_MAGIC0;
+        header[header_len++] = KD_RECORD_MAGIC1;
+        header[header_len++] = (char)_type;
+        while (payload > 0x7f) {
+            header[header_len++] = (char)payload | 0x80;
+            payload >>= 7;
+        }
+        header[header_len++] = (char)payload;
+
+        char* start = _buf + (KD_RECORD_MAX_HEADER - header_len);
+        memcpy(start, header, header_len);
+        *len = _size - (KD_RECORD_MAX_HEADER - header_len);
+        return start;
+    }
+};
+
+#endif // _KDRECORD_H
@@ -0,0 +1,225 @@
+/*
+ * Copyright 2022 The Kindling Authors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _KDSHM_H
+#define _KDSHM_H
+
+#ifdef __linux__
+
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+
+// Shared memory transport of the kd-* event stream (kdshm=PATH).
+//
+// The profiler allocates a memfd, maps it and hands the descriptor to the consumer
+// listening on PATH with a KD_SHM_FD fdtransfer request. Both sides map the same pages:
+//
+//   KdShmHeader | slot 0 | slot 1 | ... | slot N-1      (N is a power of 2)
+//
+// Every slot is KD_SHM_SLOT_SIZE bytes. A record longer than one slot occupies several
+// consecutive slots, all but the last one flagged with KD_SHM_MORE.
+// Producers claim slots with a CAS on head and publish each slot by storing its position + 1
+// into seq. The single consumer advances tail once a whole record has been read.
+// A full ring never blocks a producer: the record is dropped and counted in the header.
+
+const uint32_t KD_SHM_MAGIC = 0x4b445348;  // "KDSH"
+const uint32_t KD_SHM_VERSION = 1;
+const uint32_t KD_SHM_SLOT_SIZE = 1024;
+const uint32_t KD_SHM_MORE = 1;
+
+struct KdShmHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t slot_size;
+    uint32_t slot_count;
+    char _padding0[48];
+    volatile uint64_t head;
+    char _padding1[56];
+    volatile uint64_t tail;
+    char _padding2[56];
+    volatile uint64_t dropped;
+    char _padding3[56];
+};
+
+struct KdShmSlot {
+    volatile uint64_t seq;
+    uint32_t length;
+    uint32_t flags;
+
+    char* data() {
+        return (char*)(this + 1);
+    }
+};
+
+const uint32_t KD_SHM_SLOT_PAYLOAD = KD_SHM_SLOT_SIZE - sizeof(KdShmSlot);
+
+class KdShmRing {
+  private:
+    int _fd;
+    size_t _map_size;
+    KdShmHeader* _header;
+    uint64_t _mask;
+
+    KdShmRing(int fd, size_t map_size, KdShmHeader* header) :
+        _fd(fd), _map_size(map_size), _header(header), _mask(header->slot_count - 1) {
+    }
+
+    KdShmSlot* slotAt(uint64_t pos) {
+        return (KdShmSlot*)((char*)(_header + 1) + (pos & _mask) * KD_SHM_SLOT_SIZE);
+    }
+
+  public:
+    ~KdShmRing() {
+        munmap(_header, _map_size);
+        close(_fd);
+    }
+
+    // Producer side: allocates a zeroed ring of at most the given size
+    static KdShmRing* create(size_t size) {
+#ifdef __NR_memfd_create
+        uint32_t slot_count = 1;
+        while (sizeof(KdShmHeader) + (size_t)slot_count * 2 * KD_SHM_SLOT_SIZE <= size) {
+            slot_count *= 2;
+        }
+        size_t map_size = sizeof(KdShmHeader) + (size_t)slot_count * KD_SHM_SLOT_SIZE;
+
+        int fd = syscall(__NR_memfd_create, "async-profiler-kd", 0);
+        if (fd == -1) {
+            return NULL;
+        }
+        if (ftruncate(fd, map_size) != 0) {
+            close(fd);
+            return NULL;
+        }
+
+        void* addr = mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (addr == MAP_FAILED) {
+            close(fd);
+            return NULL;
+        }
+
+        KdShmHeader* header = (KdShmHeader*)addr;
+        header->magic = KD_SHM_MAGIC;
+        header->version = KD_SHM_VERSION;
+        header->slot_size = KD_SHM_SLOT_SIZE;
+        header->slot_count = slot_count;
+        return new KdShmRing(fd, map_size, header);
+#else
+        return NULL;
+#endif
+    }
+
+    // Consumer side: maps a ring received from the producer. Takes ownership of fd
+    static KdShmRing* attach(int fd) {
+        struct stat st;
+        if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(KdShmHeader)) {
+            close(fd);
+            return NULL;
+        }
+
+        void* addr = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (addr == MAP_FAILED) {
+            close(fd);
+            return NULL;
+        }
+
+        KdShmHeader* header = (KdShmHeader*)addr;
+        if (header->magic != KD_SHM_MAGIC || header->version != KD_SHM_VERSION ||
+            header->slot_size != KD_SHM_SLOT_SIZE || header->slot_count == 0 ||
+            (header->slot_count & (header->slot_count - 1)) != 0 ||
+            sizeof(KdShmHeader) + (size_t)header->slot_count * KD_SHM_SLOT_SIZE > (size_t)st.st_size) {
+            munmap(addr, st.st_size);
+            close(fd);
+            return NULL;
+        }
+        return new KdShmRing(fd, st.st_size, header);
+    }
+
+    int fd() {
+        return _fd;
+    }
+
+    size_t size() {
+        return _map_size;
+    }
+
+    uint64_t dropped() {
+        return __atomic_load_n(&_header->dropped, __ATOMIC_ACQUIRE);
+    }
+
+    // Producer side; safe to call from any number of threads at once
+    bool write(const char* data, size_t len) {
+        uint64_t slots = len == 0 ? 1 : (len + KD_SHM_SLOT_PAYLOAD - 1) / KD_SHM_SLOT_PAYLOAD;
+
+        uint64_t pos;
+        do {
+            pos = __atomic_load_n(&_header->head, __ATOMIC_ACQUIRE);
+            if (pos + slots - __atomic_load_n(&_header->tail, __ATOMIC_ACQUIRE) > _mask + 1) {
+                __sync_fetch_and_add(&_header->dropped, 1);
+                return false;
+            }
+        } while (!__sync_bool_compare_and_swap(&_header->head, pos, pos + slots));
+
+        for (uint64_t i = 0; i < slots; i++) {
+            KdShmSlot* slot = slotAt(pos + i);
+            uint32_t chunk = len < KD_SHM_SLOT_PAYLOAD ? (uint32_t)len : KD_SHM_SLOT_PAYLOAD;
+            memcpy(slot->data(), data, chunk);
+            slot->length = chunk;
+            slot->flags = i + 1 < slots ? KD_SHM_MORE : 0;
+            __atomic_store_n(&slot->seq, pos + i + 1, __ATOMIC_RELEASE);
+            data += chunk;
+            len -= chunk;
+        }
+        return true;
+    }
+
+    // Consumer side; must be called from one thread only.
+    // Returns the length of the next record, or 0 if no complete record is available yet.
+    // A record longer than capacity is truncated in buf, but its full length is returned.
+    size_t read(char* buf, size_t capacity) {
+        uint64_t tail = _header->tail;
+        size_t len = 0;
+
+        for (uint64_t pos = tail; ; pos++) {
+            KdShmSlot* slot = slotAt(pos);
+            if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != pos + 1) {
+                // The record is not completely published yet
+                return 0;
+            }
+
+            uint32_t chunk = slot->length <= KD_SHM_SLOT_PAYLOAD ? slot->length : KD_SHM_SLOT_PAYLOAD;
+            if (len < capacity) {
+                memcpy(buf + len, slot->data(), chunk < capacity - len ? chunk : capacity - len);
+            }
+            len += chunk;
+
+            if ((slot->flags & KD_SHM_MORE) == 0) {
+                // Release the slots back to producers
+                __atomic_store_n(&_header->tail, pos + 1, __ATOMIC_RELEASE);
+                return len;
+            }
+        }
+    }
+};
+
+#endif // __linux__
+
+#endif // _KDSHM_H
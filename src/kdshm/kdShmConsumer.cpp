@@ -0,0 +1,110 @@
+/*
+ * Copyright 2022 The Kindling Authors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifdef __linux__
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/time.h>
+
+#include "kdShmConsumer.h"
+#include "../fdtransfer/fdtransfer.h"
+
+
+bool KdShmConsumer::listen(const char* path) {
+    close();
+
+    struct sockaddr_un sun;
+    socklen_t addrlen;
+    if (!socketPath(path, &sun, &addrlen)) {
+        fprintf(stderr, "Path '%s' is too long\n", path);
+        return false;
+    }
+
+    _server = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+    if (_server == -1) {
+        perror("KdShmConsumer socket()");
+        return false;
+    }
+
+    unlink(path);
+    if (bind(_server, (const struct sockaddr*)&sun, addrlen) < 0 || ::listen(_server, 1) < 0) {
+        perror("KdShmConsumer listen()");
+        ::close(_server);
+        _server = -1;
+        return false;
+    }
+
+    return true;
+}
+
+bool KdShmConsumer::accept(int timeout) {
+    if (_server == -1) {
+        return false;
+    }
+
+    const struct timeval tv = {timeout, 0};
+    setsockopt(_server, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+    int peer = ::accept(_server, NULL, NULL);
+    if (peer == -1) {
+        perror("KdShmConsumer accept()");
+        return false;
+    }
+
+    struct kd_shm_fd_request request;
+    int fd;
+    ssize_t ret = recvFdMessage(peer, &request, sizeof(request), &fd);
+
+    struct fd_response resp;
+    resp.type = KD_SHM_FD;
+    resp.error = 0;
+
+    if (ret != sizeof(request) || request.header.type != KD_SHM_FD || fd == -1) {
+        fprintf(stderr, "KdShmConsumer: unexpected request\n");
+        resp.error = EINVAL;
+    } else {
+        KdShmRing* ring = KdShmRing::attach(fd);
+        fd = -1;
+        if (ring == NULL) {
+            resp.error = EINVAL;
+        } else {
+            delete _ring;
+            _ring = ring;
+        }
+    }
+
+    if (fd != -1) {
+        ::close(fd);
+    }
+    sendFdMessage(peer, &resp, sizeof(resp), -1);
+    ::close(peer);
+
+    return resp.error == 0;
+}
+
+void KdShmConsumer::close() {
+    if (_server != -1) {
+        ::close(_server);
+        _server = -1;
+    }
+    delete _ring;
+    _ring = NULL;
+}
+
+#endif // __linux__
@@ -0,0 +1,67 @@
+/*
+ * Copyright 2022 The Kindling Authors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _KDSHM_CONSUMER_H
+#define _KDSHM_CONSUMER_H
+
+#ifdef __linux__
+
+#include "kdShm.h"
+
+
+// Consumer side of the kdshm=PATH transport (build/libkdshm.a).
+//
+//   KdShmConsumer consumer;
+//   consumer.listen("/tmp/kd.sock");       // before the profiler starts
+//   consumer.accept(10);                   // wait for the profiler to hand over the ring
+//   while ((len = consumer.read(buf, sizeof(buf))) > 0) { ... }
+//
+// Records are kd-* text lines (with the trailing '\n') or KdRecord frames, depending on kdformat.
+class KdShmConsumer {
+  private:
+    int _server;
+    KdShmRing* _ring;
+
+  public:
+    KdShmConsumer() : _server(-1), _ring(NULL) {
+    }
+
+    ~KdShmConsumer() {
+        close();
+    }
+
+    // Binds a SOCK_SEQPACKET socket at path; a stale socket file is replaced
+    bool listen(const char* path);
+
+    // Waits up to timeout seconds (0 = forever) for a KD_SHM_FD request and maps the ring
+    bool accept(int timeout);
+
+    // Returns the length of the next record, or 0 if none is available yet
+    size_t read(char* buf, size_t capacity) {
+        return _ring != NULL ? _ring->read(buf, capacity) : 0;
+    }
+
+    // Number of records the profiler dropped because the ring was full
+    uint64_t dropped() {
+        return _ring != NULL ? _ring->dropped() : 0;
+    }
+
+    void close();
+};
+
+#endif // __linux__
+
+#endif // _KDSHM_CONSUMER_H
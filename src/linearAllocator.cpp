@@ -20,6 +20,7 @@
 
 LinearAllocator::LinearAllocator(size_t chunk_size) {
     _chunk_size = chunk_size;
+    _size = 0;
     _reserve = _tail = allocateChunk(NULL);
 }
 
@@ -65,12 +66,14 @@ Chunk* LinearAllocator::allocateChunk(Chunk* current) {
     if (chunk != NULL) {
         chunk->prev = current;
         chunk->offs = sizeof(Chunk);
+        __sync_fetch_and_add(&_size, _chunk_size);
     }
     return chunk;
 }
 
 void LinearAllocator::freeChunk(Chunk* current) {
     OS::safeFree(current, _chunk_size);
+    __sync_fetch_and_sub(&_size, _chunk_size);
 }
 
 void LinearAllocator::reserveChunk(Chunk* current) {
@@ -32,6 +32,7 @@ class LinearAllocator {
     size_t _chunk_size;
     Chunk* _tail;
     Chunk* _reserve;
+    volatile size_t _size;
 
     Chunk* allocateChunk(Chunk* current);
     void freeChunk(Chunk* current);
@@ -45,6 +46,11 @@ class LinearAllocator {
     void clear();
 
     void* alloc(size_t size);
+
+    // Bytes of all chunks currently mapped, including the reserve
+    size_t size() {
+        return _size;
+    }
 };
 
 #endif // _LINEARALLOCATOR_H
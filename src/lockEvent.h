@@ -2,52 +2,46 @@
 #define _LOCKEVENT_H
 
 #include <jvmti.h>
-#include <vector>
-#include <string>
-#include <fstream>
+#include <stdio.h>
+#include "arch.h"
 #include "log.h"
 #include "eventLogger.h"
+#include "os.h"
+#include "spinLock.h"
+#include "timeUtil.h"
 
-const char* JAVA_LOCK_WAIT_EVENT = "java_lock_wait_event";
-struct LockWaitEvent {
-    LockWaitEvent(
-        jint thread_id, 
-        std::string thread_name, 
-        jint java_thread_id, 
-        uintptr_t lock_object_address, 
-        std::string lock_type, 
-        std::string lock_name,
-        jlong create_timestamp) : 
-        _java_thread_id(java_thread_id),
-        _native_thread_id(thread_id),
-        _thread_name(thread_name),
-        _lock_object_address(lock_object_address),
-        _lock_type(lock_type),
-        _lock_name(lock_name),
-        _wait_timestamp(create_timestamp),
-        _wake_timestamp(0),
-        _wait_duration(0),
-        _wait_thread_id(0) {
-    } 
-
-    ~LockWaitEvent() {
-    }
+const char* const LOCK_TYPE_MONITOR_WAIT = "MonitorWait";
+const char* const LOCK_TYPE_MONITOR_ENTER = "MonitorEnter";
+const char* const LOCK_TYPE_UNSAFE_PARK = "UnsafePark";
 
-    std::string _event_name = JAVA_LOCK_WAIT_EVENT;
+// Number of Java frames of a lock wait in kd-jf and lock histograms
+const int LOCK_STACK_DEPTH = 10;
+// Number of Java frames captured per lock wait when it is also recorded as a profiler sample
+const int LOCK_SAMPLE_DEPTH = 64;
+// Capacity of the symbolized stack trace; a kd-jf text line is limited to 1K anyway
+const size_t LOCK_STACK_LIMIT = 1024;
+
+// Lives in LockEventPool and carries no heap-allocated members,
+// so recording a lock wait does not call malloc.
+struct LockWaitEvent {
     // The thread which produces the event 
     jint _java_thread_id;
     jint _native_thread_id;
-    std::string _thread_name;
+    // Interned by LockRecorder
+    const char* _thread_name;
     // The lock object address
     uintptr_t _lock_object_address;
-    // The lock event type
-    std::string _lock_type;
-    // The lock name
-    std::string _lock_name;
+    // The lock event type, one of LOCK_TYPE_*
+    const char* _lock_type;
+    // The lock class in Profiler::classMap(), 0 if unknown
+    u32 _lock_class_id;
+    // Whether the thread that acquired the lock last is worth tracking:
+    // always for monitors, only for ReentrantLock-like synchronizers when parking
+    bool _track_holder;
 
-    // The timestamp when the thread tries to acquire the lock
+    // TSC::ticks() when the thread tries to acquire the lock
     jlong _wait_timestamp;
-    // The timestamp when the thread acquires the lock
+    // TSC::ticks() when the thread acquires the lock
     jlong _wake_timestamp;
 
     // How much duration the thread waits to acquire the lock.
@@ -56,17 +50,187 @@ struct LockWaitEvent {
     // A list of thread IDs that have acquired the lock when the current thread wait for the lock
     jint _wait_thread_id;
 
-    // The stack trace of the current thread when acquiring the lock
-    std::string _stack_trace;
+    // Next thread waiting for the same lock in LockRecorder, or the next free event in LockEventPool
+    LockWaitEvent* _next_waiter;
+
+    // The stack trace of the current thread when acquiring the lock.
+    // Captured once as jmethodIDs and bcis, shared by the profiler sample and kd-jf;
+    // the top LOCK_STACK_DEPTH frames are turned into text by symbolize() only if the event is reported.
+    u32 _num_frames;
+    jmethodID _frames[LOCK_SAMPLE_DEPTH];
+    jint _bcis[LOCK_SAMPLE_DEPTH];
+    u32 _stack_length;
+    char _stack_trace[LOCK_STACK_LIMIT];
+
+    void init(jint thread_id, const char* thread_name, jint java_thread_id, uintptr_t lock_object_address,
+              const char* lock_type, u32 lock_class_id, bool track_holder, jlong create_timestamp) {
+        _java_thread_id = java_thread_id;
+        _native_thread_id = thread_id;
+        _thread_name = thread_name;
+        _lock_object_address = lock_object_address;
+        _lock_type = lock_type;
+        _lock_class_id = lock_class_id;
+        _track_holder = track_holder;
+        _wait_timestamp = create_timestamp;
+        _wake_timestamp = 0;
+        _wait_duration = 0;
+        _wait_thread_id = 0;
+        _next_waiter = NULL;
+        _num_frames = 0;
+        _stack_length = 0;
+        _stack_trace[0] = 0;
+    }
+
+    void symbolize(jvmtiEnv* jvmti) {
+        size_t length = 0;
+        u32 num_frames = _num_frames < LOCK_STACK_DEPTH ? _num_frames : LOCK_STACK_DEPTH;
+        for (u32 i = 0; i < num_frames; i++) {
+            char* method_name = NULL;
+            char* signature = NULL;
+            if (jvmti->GetMethodName(_frames[i], &method_name, NULL, NULL) == 0) {
+                jclass declaring_class;
+                if (jvmti->GetMethodDeclaringClass(_frames[i], &declaring_class) == 0) {
+                    jvmti->GetClassSignature(declaring_class, &signature, NULL);
+                }
+                if (length < LOCK_STACK_LIMIT) {
+                    // Truncated like the text line the stack ends up in
+                    int n = snprintf(_stack_trace + length, LOCK_STACK_LIMIT - length, "%s.%s",
+                                     method_name, signature != NULL ? signature : "");
+                    if (n > 0) {
+                        length = length + n < LOCK_STACK_LIMIT ? length + n : LOCK_STACK_LIMIT - 1;
+                    }
+                }
+            }
+            jvmti->Deallocate((unsigned char*)method_name);
+            jvmti->Deallocate((unsigned char*)signature);
+        }
+        _stack_trace[length] = 0;
+        _stack_length = (u32)length;
+    }
 
     void print() {
-        printf("{\"threadId\":%d,\"threadName\":\"%s\", \"javaThreadId\":%d,\"waitTimestamp\":%ld,\"wakeTimestamp\":%ld,\"objectAddr\":\"%lx\",\"lockType\":\"%s\", \"lockName\":%s,\"waitDuration\":%ld,\"waitThread\":%d,\"stack\":\"%s\"}",
-        _native_thread_id, _thread_name.c_str(), _java_thread_id, _wait_timestamp, _wake_timestamp, _lock_object_address, _lock_type.c_str(), _lock_name.c_str(), _wait_duration, _wait_thread_id, _stack_trace.c_str());
+        printf("{\"threadId\":%d,\"threadName\":\"%s\", \"javaThreadId\":%d,\"waitTimestamp\":%ld,\"wakeTimestamp\":%ld,\"objectAddr\":\"%lx\",\"lockType\":\"%s\", \"lockClass\":%u,\"waitDuration\":%ld,\"waitThread\":%d,\"stack\":\"%s\"}",
+        _native_thread_id, _thread_name, _java_thread_id, _wait_timestamp, _wake_timestamp, _lock_object_address, _lock_type, _lock_class_id, _wait_duration, _wait_thread_id, _stack_trace);
         printf("\n");
     }
 
     void log() {
-        EventLogger::log("kd-jf@%ld!%ld!%d!%x!%s!%s!%ld!%d!%s!", _wait_timestamp, _wake_timestamp, _native_thread_id, _lock_object_address, _lock_type.c_str(), _thread_name.c_str(), _wait_duration, _wait_thread_id, _stack_trace.c_str());
+        jlong wait_timestamp = TicksClock::toNanos(_wait_timestamp);
+        jlong wake_timestamp = TicksClock::toNanos(_wake_timestamp);
+        if (EventLogger::binary()) {
+            // Fits into the inline buffer of KdRecord: the stack is at most LOCK_STACK_LIMIT
+            // and the only string of unbounded length is cut at KD_RECORD_MAX_NAME
+            KdRecord record(KD_RECORD_LOCK_WAIT);
+            record.putVar64(wait_timestamp);
+            record.putVar64(wake_timestamp);
+            record.putVar32(_native_thread_id);
+            record.putVar64(_lock_object_address);
+            record.putString(_lock_type);
+            record.putString(_thread_name, _thread_name != NULL ? strlen(_thread_name) : 0, KD_RECORD_MAX_NAME);
+            record.putVar64(_wait_duration);
+            record.putZigzag32(_wait_thread_id);
+            record.putString(_stack_trace, _stack_length);
+            EventLogger::write(record);
+            return;
+        }
+        EventLogger::log("kd-jf@%ld!%ld!%d!%x!%s!%s!%ld!%d!%s!", wait_timestamp, wake_timestamp, _native_thread_id, _lock_object_address, _lock_type, _thread_name, _wait_duration, _wait_thread_id, _stack_trace);
+    }
+};
+
+// Number of free lists; threads are striped across them by ID.
+// An event is normally released by the thread that allocated it.
+const int LOCK_EVENT_STRIPES = 16;
+const int LOCK_EVENT_SLAB_SIZE = 256;
+// An event lives while its thread waits, so 16K events are far more than enough.
+// A LockWaitEvent with LOCK_SAMPLE_DEPTH frames is ~1.9 KB, so a full pool is ~31 MB;
+// slabs are only mapped on demand, so it takes that much only with thousands of waiting threads
+const int LOCK_EVENT_MAX_SLABS = 64;
+
+// Fixed-size slab allocator of LockWaitEvents. Slabs are mmapped on demand and kept
+// until the pool is destroyed, so in steady state alloc and release only pop and push a free list.
+class LockEventPool {
+  private:
+    struct FreeList {
+        SpinLock _lock;
+        LockWaitEvent* _head;
+        char _padding[64 - sizeof(SpinLock) - sizeof(LockWaitEvent*)];
+    };
+
+    FreeList _free[LOCK_EVENT_STRIPES];
+    SpinLock _slab_lock;
+    LockWaitEvent* _slabs[LOCK_EVENT_MAX_SLABS];
+    volatile int _slab_count;
+    volatile u64 _exhausted;
+
+    bool addSlab(FreeList& list) {
+        _slab_lock.lock();
+        if (_slab_count == LOCK_EVENT_MAX_SLABS) {
+            _slab_lock.unlock();
+            return false;
+        }
+        LockWaitEvent* slab = (LockWaitEvent*)OS::safeAlloc(LOCK_EVENT_SLAB_SIZE * sizeof(LockWaitEvent));
+        if (slab == NULL) {
+            _slab_lock.unlock();
+            return false;
+        }
+        _slabs[_slab_count++] = slab;
+        _slab_lock.unlock();
+
+        for (int i = 0; i < LOCK_EVENT_SLAB_SIZE - 1; i++) {
+            slab[i]._next_waiter = &slab[i + 1];
+        }
+        list._lock.lock();
+        slab[LOCK_EVENT_SLAB_SIZE - 1]._next_waiter = list._head;
+        list._head = slab;
+        list._lock.unlock();
+        return true;
+    }
+
+  public:
+    LockEventPool() : _slab_count(0), _exhausted(0) {
+        for (int i = 0; i < LOCK_EVENT_STRIPES; i++) {
+            _free[i]._head = NULL;
+        }
+    }
+
+    ~LockEventPool() {
+        for (int i = 0; i < _slab_count; i++) {
+            OS::safeFree(_slabs[i], LOCK_EVENT_SLAB_SIZE * sizeof(LockWaitEvent));
+        }
+    }
+
+    // Returns an uninitialized event, or NULL if the pool has reached its limit
+    LockWaitEvent* alloc(int thread_id) {
+        FreeList& list = _free[(u32)thread_id % LOCK_EVENT_STRIPES];
+        while (true) {
+            list._lock.lock();
+            LockWaitEvent* event = list._head;
+            if (event != NULL) {
+                list._head = event->_next_waiter;
+                list._lock.unlock();
+                return event;
+            }
+            list._lock.unlock();
+
+            if (!addSlab(list)) {
+                atomicInc(_exhausted);
+                return NULL;
+            }
+        }
+    }
+
+    void release(LockWaitEvent* event, int thread_id) {
+        FreeList& list = _free[(u32)thread_id % LOCK_EVENT_STRIPES];
+        list._lock.lock();
+        event->_next_waiter = list._head;
+        list._head = event;
+        list._lock.unlock();
+    }
+
+    // How many lock waits were not recorded because the pool was exhausted
+    u64 exhausted() {
+        return _exhausted;
     }
 };
-#endif // _LOCKEVENT_H
\ No newline at end of file
+
+#endif // _LOCKEVENT_H
@@ -0,0 +1,228 @@
+/*
+ * Copyright 2022 The Kindling Authors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include <stdio.h>
+#include <algorithm>
+#include <map>
+#include "lockGraph.h"
+#include "eventLogger.h"
+#include "profiler.h"
+#include "timeUtil.h"
+
+
+static bool byWaiter(const WaitEdge& a, const WaitEdge& b) {
+    // The most recent wait of a thread goes first
+    return a._waiter < b._waiter || (a._waiter == b._waiter && a._wait_ticks > b._wait_ticks);
+}
+
+static bool byBlockedTime(const BlockingRoot& a, const BlockingRoot& b) {
+    return a._blocked_nanos > b._blocked_nanos;
+}
+
+static u64 waitedNanos(const WaitEdge& edge, u64 now_ticks) {
+    return now_ticks > edge._wait_ticks ? TicksClock::ticksToNanos(now_ticks - edge._wait_ticks) : 0;
+}
+
+int WaitGraph::findWaiter(int thread) {
+    WaitEdge key = {thread, 0, 0, 0, (u64)-1};
+    std::vector<WaitEdge>::iterator it = std::lower_bound(_edges.begin(), _edges.end(), key, byWaiter);
+    return it != _edges.end() && it->_waiter == thread ? (int)(it - _edges.begin()) : -1;
+}
+
+void WaitGraph::analyze(u64 now_ticks, std::vector<BlockingRoot>& roots, std::vector<std::vector<int> >& cycles) {
+    roots.clear();
+    cycles.clear();
+
+    // A thread waits for one lock at a time; an older edge is left over from a missed wake-up
+    std::sort(_edges.begin(), _edges.end(), byWaiter);
+    size_t n = 0;
+    for (size_t i = 0; i < _edges.size(); i++) {
+        if (n == 0 || _edges[i]._waiter != _edges[n - 1]._waiter) {
+            _edges[n++] = _edges[i];
+        }
+    }
+    _edges.resize(n);
+
+    _next.assign(n, -1);
+    _root.assign(n, -1);
+    _depth.assign(n, 0);
+    for (size_t i = 0; i < n; i++) {
+        if (_edges[i]._holder != 0) {
+            _next[i] = findWaiter(_edges[i]._holder);
+        }
+    }
+
+    // Walk every chain once. _root is -1 for edges not visited yet and -2 for edges on the current path;
+    // afterwards it points to the last edge of the chain, or to the edge where the chain enters a cycle.
+    std::vector<int> path;
+    for (size_t i = 0; i < n; i++) {
+        if (_root[i] != -1) {
+            continue;
+        }
+
+        path.clear();
+        int j = (int)i;
+        while (j != -1 && _root[j] == -1) {
+            _root[j] = -2;
+            path.push_back(j);
+            j = _next[j];
+        }
+
+        int root;
+        u32 depth;
+        if (j == -1) {
+            root = path.back();
+            depth = 0;
+        } else if (_root[j] == -2) {
+            // The path has run into itself: the threads from j on are deadlocked
+            size_t start = std::find(path.begin(), path.end(), j) - path.begin();
+            cycles.push_back(std::vector<int>(path.begin() + start, path.end()));
+            for (size_t k = start; k < path.size(); k++) {
+                _root[path[k]] = j;
+                _depth[path[k]] = 1;
+            }
+            path.resize(start);
+            root = j;
+            depth = 1;
+        } else {
+            root = _root[j];
+            depth = _depth[j];
+        }
+
+        for (size_t k = path.size(); k-- > 0; ) {
+            _root[path[k]] = root;
+            _depth[path[k]] = ++depth;
+        }
+    }
+
+    // Chains ending in the same thread are merged, so are waits on one lock with an unknown holder
+    std::map<std::pair<int, uintptr_t>, size_t> root_index;
+    for (size_t i = 0; i < n; i++) {
+        int r = _root[i];
+        const WaitEdge& last = _edges[r];
+        bool deadlock = _next[r] != -1;
+        int thread = deadlock ? last._waiter : last._holder != 0 ? last._holder : -1;
+        std::pair<int, uintptr_t> key(thread, thread == -1 ? last._address : 0);
+
+        std::map<std::pair<int, uintptr_t>, size_t>::iterator it = root_index.find(key);
+        if (it == root_index.end()) {
+            BlockingRoot root = {thread, last._address, last._lock_class_id, deadlock, 0, 0, 0};
+            it = root_index.insert(std::make_pair(key, roots.size())).first;
+            roots.push_back(root);
+        }
+
+        BlockingRoot& root = roots[it->second];
+        root._blocked_threads++;
+        root._blocked_nanos += waitedNanos(_edges[i], now_ticks);
+        if (_depth[i] > root._max_depth) {
+            root._max_depth = _depth[i];
+        }
+    }
+
+    std::sort(roots.begin(), roots.end(), byBlockedTime);
+}
+
+void WaitGraph::report(u64 now_ticks, u64 min_blocked_nanos) {
+    std::vector<BlockingRoot> roots;
+    std::vector<std::vector<int> > cycles;
+    analyze(now_ticks, roots, cycles);
+    if (roots.empty() || roots[0]._blocked_nanos < min_blocked_nanos) {
+        return;
+    }
+
+    u64 timestamp = TicksClock::toNanos(now_ticks);
+    std::map<unsigned int, const char*> class_names;
+    Profiler::instance()->classMap()->collect(class_names);
+
+    for (size_t i = 0; i < roots.size() && i < LOCK_GRAPH_TOP_ROOTS; i++) {
+        const BlockingRoot& root = roots[i];
+        if (root._blocked_nanos < min_blocked_nanos) {
+            break;
+        }
+        std::map<unsigned int, const char*>::iterator it = class_names.find(root._lock_class_id);
+        const char* class_name = it != class_names.end() ? it->second : "";
+
+        if (EventLogger::binary()) {
+            KdRecord record(KD_RECORD_LOCK_BLOCKER);
+            record.putVar64(timestamp);
+            record.putZigzag32(root._thread);
+            record.putVar64(root._address);
+            record.putString(class_name);
+            record.putVar32(root._blocked_threads);
+            record.putVar64(root._blocked_nanos);
+            record.putVar32(root._max_depth);
+            record.put8(root._deadlock ? 1 : 0);
+            EventLogger::write(record);
+        } else {
+            // kd-lbr@timestamp!tid!lock_address!lock_class!blocked_threads!blocked_nanos!max_depth!deadlock!
+            EventLogger::log("kd-lbr@%llu!%d!%lx!%s!%u!%llu!%u!%d!", timestamp, root._thread, (unsigned long)root._address,
+                             class_name, root._blocked_threads, root._blocked_nanos, root._max_depth, root._deadlock ? 1 : 0);
+        }
+    }
+
+    char line[4096];
+    for (size_t i = 0; i < cycles.size(); i++) {
+        const std::vector<int>& cycle = cycles[i];
+        bool stuck = true;
+        for (size_t k = 0; k < cycle.size(); k++) {
+            stuck = stuck && waitedNanos(_edges[cycle[k]], now_ticks) >= LOCK_DEADLOCK_MIN_WAIT;
+        }
+        if (!stuck) {
+            continue;
+        }
+
+        if (EventLogger::binary()) {
+            KdRecord record(KD_RECORD_DEADLOCK);
+            record.putVar64(timestamp);
+            record.putVar32(cycle.size());
+            for (size_t k = 0; k < cycle.size(); k++) {
+                const WaitEdge& edge = _edges[cycle[k]];
+                std::map<unsigned int, const char*>::iterator it = class_names.find(edge._lock_class_id);
+                record.putVar32(edge._waiter);
+                record.putVar64(edge._address);
+                record.putString(it != class_names.end() ? it->second : "");
+            }
+            EventLogger::write(record);
+        } else {
+            // kd-ldl@timestamp!tid:lock_address:lock_class,...!  every thread waits for the lock held by the next one.
+            // A cycle that does not fit into the line ends with "..." after the last complete thread.
+            const size_t limit = sizeof(line) - 5;  // room for "...!\n"
+            size_t len = snprintf(line, limit, "kd-ldl@%llu!", timestamp);
+            size_t written = 0;
+            for (; written < cycle.size(); written++) {
+                const WaitEdge& edge = _edges[cycle[written]];
+                std::map<unsigned int, const char*>::iterator it = class_names.find(edge._lock_class_id);
+                int n = snprintf(line + len, limit - len, written + 1 < cycle.size() ? "%d:%lx:%s," : "%d:%lx:%s",
+                                 edge._waiter, (unsigned long)edge._address, it != class_names.end() ? it->second : "");
+                if (n < 0 || (size_t)n >= limit - len) {
+                    break;
+                }
+                len += n;
+            }
+            if (written < cycle.size()) {
+                line[len++] = '.';
+                line[len++] = '.';
+                line[len++] = '.';
+                Log::warn("kd-ldl record truncated: %d of %d deadlocked threads fit into %d bytes",
+                          (int)written, (int)cycle.size(), (int)sizeof(line));
+            }
+            line[len++] = '!';
+            line[len++] = '\n';
+            EventLogger::write(line, len);
+        }
+    }
+}
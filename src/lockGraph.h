@@ -0,0 +1,92 @@
+/*
+ * Copyright 2022 The Kindling Authors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#ifndef _LOCKGRAPH_H
+#define _LOCKGRAPH_H
+
+#include <stdint.h>
+#include <vector>
+#include "arch.h"
+
+// Number of root blockers reported per snapshot, the ones causing the most blocked time
+const int LOCK_GRAPH_TOP_ROOTS = 10;
+// A holder is only known as the thread that acquired the lock last, so a short cycle may be
+// an artifact of a holder that has released the lock already. Cycles are reported as deadlocks
+// only if every thread in them has been waiting at least that long.
+const u64 LOCK_DEADLOCK_MIN_WAIT = 1000000000;
+
+// One thread blocked on one lock
+struct WaitEdge {
+    int _waiter;
+    // Thread that acquired the lock last, 0 if unknown
+    int _holder;
+    uintptr_t _address;
+    u32 _lock_class_id;
+    u64 _wait_ticks;
+};
+
+struct BlockingRoot {
+    // Thread at the end of the blocking chains, -1 if the lock holder is unknown.
+    // For a deadlock, one of the threads in the cycle.
+    int _thread;
+    // One of the contended locks held by that thread
+    uintptr_t _address;
+    u32 _lock_class_id;
+    bool _deadlock;
+    // Threads blocked directly or transitively, and the sum of their wait time so far
+    u32 _blocked_threads;
+    u64 _blocked_nanos;
+    // Longest blocking chain; 1 if all threads wait on the root directly
+    u32 _max_depth;
+};
+
+// Wait-for graph of a LockRecorder snapshot: thread -> the thread holding the lock it waits for.
+// Every thread waits for at most one lock, so the graph is a set of chains ending either
+// in a running thread (the root blocker) or in a cycle (a deadlock).
+class WaitGraph {
+  private:
+    std::vector<WaitEdge> _edges;
+    std::vector<int> _next;
+    std::vector<int> _root;
+    std::vector<u32> _depth;
+
+    int findWaiter(int thread);
+
+  public:
+    void clear() {
+        _edges.clear();
+    }
+
+    void addEdge(int waiter, int holder, uintptr_t address, u32 lock_class_id, u64 wait_ticks) {
+        WaitEdge edge = {waiter, holder == waiter ? 0 : holder, address, lock_class_id, wait_ticks};
+        _edges.push_back(edge);
+    }
+
+    const WaitEdge& edge(int index) {
+        return _edges[index];
+    }
+
+    // Fills roots sorted by blocked time and cycles as lists of edge indexes.
+    // A cycle is also present in roots, marked as _deadlock.
+    void analyze(u64 now_ticks, std::vector<BlockingRoot>& roots, std::vector<std::vector<int> >& cycles);
+
+    // Emits the top roots causing at least min_blocked_nanos of blocked time as kd-lbr records
+    // and the deadlocks as kd-ldl records
+    void report(u64 now_ticks, u64 min_blocked_nanos);
+};
+
+#endif // _LOCKGRAPH_H
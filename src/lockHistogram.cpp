@@ -0,0 +1,313 @@
+/*
+ * Copyright 2022 The Kindling Authors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include <stdio.h>
+#include <string.h>
+#include "lockHistogram.h"
+#include "log.h"
+#include "os.h"
+#include "profiler.h"
+#include "timeUtil.h"
+#include "vmEntry.h"
+
+
+LockHistograms::LockHistograms() :
+    _enabled(false), _histograms(NULL), _stacks(NULL), _overflow(0), _interval_start(0), _task(NULL) {
+}
+
+LockHistograms::~LockHistograms() {
+    endFlushTask();
+    if (_histograms != NULL) {
+        OS::safeFree(_histograms, LOCK_HISTOGRAMS * sizeof(LockHistogram));
+        OS::safeFree(_stacks, LOCK_HIST_STACKS * sizeof(LockWaitStack));
+    }
+}
+
+int LockHistograms::bucketOf(u64 nanos) {
+    u64 units = nanos >> 10;
+    if (units < (1 << LOCK_HIST_SUB_BITS)) {
+        return (int)units;
+    }
+    int magnitude = 63 - __builtin_clzll(units);
+    int bucket = ((magnitude - LOCK_HIST_SUB_BITS + 1) << LOCK_HIST_SUB_BITS)
+               + (int)((units >> (magnitude - LOCK_HIST_SUB_BITS)) & ((1 << LOCK_HIST_SUB_BITS) - 1));
+    return bucket < LOCK_HIST_BUCKETS ? bucket : LOCK_HIST_BUCKETS - 1;
+}
+
+u64 LockHistograms::bucketLowerBound(int bucket) {
+    if (bucket < (1 << LOCK_HIST_SUB_BITS)) {
+        return (u64)bucket << 10;
+    }
+    int magnitude = (bucket >> LOCK_HIST_SUB_BITS) + LOCK_HIST_SUB_BITS - 1;
+    u64 units = (u64)((1 << LOCK_HIST_SUB_BITS) + (bucket & ((1 << LOCK_HIST_SUB_BITS) - 1))) << (magnitude - LOCK_HIST_SUB_BITS);
+    return units << 10;
+}
+
+u32 LockHistograms::stackId(LockWaitEvent* event) {
+    if (event->_num_frames == 0) {
+        return 0;
+    }
+
+    u32 num_frames = event->_num_frames < LOCK_STACK_DEPTH ? event->_num_frames : LOCK_STACK_DEPTH;
+    u64 hash = num_frames;
+    for (u32 i = 0; i < num_frames; i++) {
+        hash = (hash ^ (u64)(uintptr_t)event->_frames[i]) * 0x9e3779b97f4a7c15ULL;
+        hash ^= hash >> 29;
+    }
+    hash |= 1;
+
+    u32 slot = (u32)(hash >> 32) % LOCK_HIST_STACKS;
+    for (int i = 0; i < LOCK_HIST_STACKS; i++) {
+        LockWaitStack* stack = &_stacks[slot];
+        u64 current = stack->_hash;
+        if (current == 0) {
+            if (__sync_bool_compare_and_swap(&stack->_hash, 0, hash)) {
+                stack->_num_frames = num_frames;
+                memcpy(stack->_frames, event->_frames, num_frames * sizeof(jmethodID));
+                __atomic_store_n(&stack->_ready, true, __ATOMIC_RELEASE);
+                return slot + 1;
+            }
+            current = stack->_hash;
+        }
+        if (current == hash) {
+            return slot + 1;
+        }
+        slot = (slot + 1) % LOCK_HIST_STACKS;
+    }
+    return 0;
+}
+
+// A freed slot is reused only once the whole probe sequence has shown that the key is not there
+LockHistogram* LockHistograms::histogram(u32 class_id, u32 address_bucket, u32 stack_id) {
+    u64 key = LOCK_HIST_USED | (u64)stack_id << 36 | (u64)address_bucket << 32 | class_id;
+    u32 start = (u32)((key * 0x9e3779b97f4a7c15ULL) >> 40) % LOCK_HISTOGRAMS;
+
+    for (int attempt = 0; attempt < 4; attempt++) {
+        LockHistogram* freed = NULL;
+        LockHistogram* empty = NULL;
+        u32 slot = start;
+        for (int i = 0; i < LOCK_HISTOGRAMS; i++) {
+            LockHistogram* h = &_histograms[slot];
+            u64 current = h->_key;
+            if (current == key) {
+                return h;
+            } else if (current == LOCK_HIST_FREED) {
+                if (freed == NULL) freed = h;
+            } else if (current == 0) {
+                empty = h;
+                break;
+            }
+            slot = (slot + 1) % LOCK_HISTOGRAMS;
+        }
+
+        LockHistogram* h = freed != NULL ? freed : empty;
+        if (h == NULL) {
+            return NULL;
+        }
+        if (__sync_bool_compare_and_swap(&h->_key, h == freed ? LOCK_HIST_FREED : 0, key)) {
+            h->_idle = 0;
+            return h;
+        }
+        // Somebody else took the slot, possibly for the same key: look again
+    }
+    return NULL;
+}
+
+void LockHistograms::record(LockWaitEvent* event) {
+    if (!_enabled) {
+        return;
+    }
+
+    u32 address_bucket = ((u32)(event->_lock_object_address >> 3) * 0x9e3779b9U) % LOCK_ADDRESS_BUCKETS;
+    LockHistogram* h = histogram(event->_lock_class_id, address_bucket, stackId(event));
+    if (h == NULL) {
+        atomicInc(_overflow);
+        return;
+    }
+
+    u64 duration = event->_wait_duration > 0 ? event->_wait_duration : 0;
+    atomicInc(h->_count);
+    atomicInc(h->_total, duration);
+    u64 max = h->_max;
+    while (duration > max && !__sync_bool_compare_and_swap(&h->_max, max, duration)) {
+        max = h->_max;
+    }
+    __sync_fetch_and_add(&h->_buckets[bucketOf(duration)], 1);
+}
+
+void LockHistograms::defineStacks(jvmtiEnv* jvmti) {
+    // Symbolized the same way as kd-jf stacks, reusing the event's buffer
+    LockWaitEvent scratch;
+    for (int i = 0; i < LOCK_HIST_STACKS; i++) {
+        LockWaitStack* stack = &_stacks[i];
+        if (stack->_defined || !__atomic_load_n(&stack->_ready, __ATOMIC_ACQUIRE)) {
+            continue;
+        }
+
+        scratch._num_frames = stack->_num_frames;
+        memcpy(scratch._frames, stack->_frames, stack->_num_frames * sizeof(jmethodID));
+        scratch.symbolize(jvmti);
+
+        if (EventLogger::binary()) {
+            KdRecord record(KD_RECORD_LOCK_STACK_DEF);
+            record.putVar32(i + 1);
+            record.putString(scratch._stack_trace, scratch._stack_length);
+            EventLogger::write(record);
+        } else {
+            // kd-lsd@stack_id!stack!
+            EventLogger::log("kd-lsd@%d!%s!", i + 1, scratch._stack_trace);
+        }
+        stack->_defined = true;
+    }
+}
+
+void LockHistograms::flush() {
+    if (_histograms == NULL) {
+        return;
+    }
+
+    defineStacks(VM::jvmti());
+
+    u64 interval_end = getCurrentTimestamp();
+    std::map<unsigned int, const char*> class_names;
+    Profiler::instance()->classMap()->collect(class_names);
+
+    // Bucket list of a text record may be longer than the 1K limit of EventLogger::log
+    char line[4096];
+    u64 buckets[LOCK_HIST_BUCKETS];
+
+    for (int i = 0; i < LOCK_HISTOGRAMS; i++) {
+        LockHistogram* h = &_histograms[i];
+        u64 key = h->_key;
+        if (key == 0 || key == LOCK_HIST_FREED) {
+            continue;
+        }
+        if (h->_count == 0) {
+            // Idle since the previous flush as well: free the slot. A wait that has just looked up
+            // this histogram may still land in it; it is then reported with the next combination
+            if (++h->_idle >= 2) {
+                __sync_bool_compare_and_swap(&h->_key, key, LOCK_HIST_FREED);
+            }
+            continue;
+        }
+        h->_idle = 0;
+
+        // Counters are taken one by one; a wait recorded in between may be split across intervals
+        u64 count = __sync_lock_test_and_set(&h->_count, 0);
+        u64 total = __sync_lock_test_and_set(&h->_total, 0);
+        u64 max = __sync_lock_test_and_set(&h->_max, 0);
+        int used = 0;
+        for (int b = 0; b < LOCK_HIST_BUCKETS; b++) {
+            buckets[b] = __sync_lock_test_and_set(&h->_buckets[b], 0);
+            if (buckets[b] != 0) {
+                used++;
+            }
+        }
+
+        u32 class_id = (u32)key;
+        u32 address_bucket = (u32)(key >> 32) & 0xf;
+        u32 stack_id = (u32)((key & ~LOCK_HIST_USED) >> 36);
+        std::map<unsigned int, const char*>::iterator it = class_names.find(class_id);
+        const char* class_name = it != class_names.end() ? it->second : "";
+
+        if (EventLogger::binary()) {
+            KdRecord record(KD_RECORD_LOCK_HISTOGRAM);
+            record.putVar64(_interval_start);
+            record.putVar64(interval_end);
+            record.putString(class_name);
+            record.putVar32(address_bucket);
+            record.putVar32(stack_id);
+            record.putVar64(count);
+            record.putVar64(total);
+            record.putVar64(max);
+            record.putVar32(used);
+            for (int b = 0; b < LOCK_HIST_BUCKETS; b++) {
+                if (buckets[b] != 0) {
+                    record.putVar32(b);
+                    record.putVar64(buckets[b]);
+                }
+            }
+            EventLogger::write(record);
+        } else {
+            // kd-lh@start!end!class!address_bucket!stack_id!count!total!max!bucket:count,...!
+            size_t len = snprintf(line, sizeof(line), "kd-lh@%llu!%llu!%s!%u!%u!%llu!%llu!%llu!",
+                                  _interval_start, interval_end, class_name, address_bucket, stack_id, count, total, max);
+            for (int b = 0; b < LOCK_HIST_BUCKETS && len < sizeof(line); b++) {
+                if (buckets[b] != 0) {
+                    len += snprintf(line + len, sizeof(line) - len, used-- > 1 ? "%d:%llu," : "%d:%llu", b, buckets[b]);
+                }
+            }
+            if (len + 2 <= sizeof(line)) {
+                line[len++] = '!';
+                line[len++] = '\n';
+                EventLogger::write(line, len);
+            }
+        }
+    }
+
+    _interval_start = interval_end;
+
+    u64 overflow = __sync_lock_test_and_set(&_overflow, 0);
+    if (overflow > 0) {
+        Log::warn("%llu lock waits did not fit into lock histograms", overflow);
+    }
+}
+
+void LockHistograms::reset() {
+    if (_histograms != NULL) {
+        memset(_histograms, 0, LOCK_HISTOGRAMS * sizeof(LockHistogram));
+        memset(_stacks, 0, LOCK_HIST_STACKS * sizeof(LockWaitStack));
+    }
+    _overflow = 0;
+}
+
+void LockHistograms::startFlushTask(long interval) {
+    if (_histograms == NULL) {
+        _histograms = (LockHistogram*)OS::safeAlloc(LOCK_HISTOGRAMS * sizeof(LockHistogram));
+        _stacks = (LockWaitStack*)OS::safeAlloc(LOCK_HIST_STACKS * sizeof(LockWaitStack));
+        if (_histograms == NULL || _stacks == NULL) {
+            Log::warn("Could not allocate lock histograms");
+            if (_histograms != NULL) OS::safeFree(_histograms, LOCK_HISTOGRAMS * sizeof(LockHistogram));
+            if (_stacks != NULL) OS::safeFree(_stacks, LOCK_HIST_STACKS * sizeof(LockWaitStack));
+            _histograms = NULL;
+            _stacks = NULL;
+            return;
+        }
+    }
+
+    _interval_start = getCurrentTimestamp();
+    _enabled = true;
+    _task = new LockHistogramTask(this, interval);
+    _thread = std::thread([&]{
+        VM::attachThread("AsyncProfiler-Lock-Histograms");
+        _task->run();
+        VM::detachThread();
+    });
+}
+
+void LockHistograms::endFlushTask() {
+    if (_task != NULL) {
+        _enabled = false;
+        _task->stop();
+        _thread.join();
+        delete _task;
+        _task = NULL;
+        // Emit what was recorded since the last flush
+        flush();
+        reset();
+    }
+}
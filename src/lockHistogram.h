@@ -0,0 +1,125 @@
+/*
+ * Copyright 2022 The Kindling Authors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _LOCKHISTOGRAM_H
+#define _LOCKHISTOGRAM_H
+
+#include <jvmti.h>
+#include <thread>
+#include "arch.h"
+#include "lockEvent.h"
+#include "stoppableTask.h"
+
+// Log-linear buckets of wait durations, HDR style: durations are counted in 1024 ns units,
+// every power of 2 is split into 8 linear sub-buckets (12.5% precision).
+// Buckets 0-7 hold 0-7 units; the last bucket collects everything from ~64 s on.
+const int LOCK_HIST_SUB_BITS = 3;
+const int LOCK_HIST_BUCKETS = 192;
+// Lock addresses are spread over this many buckets, so that unrelated instances
+// of one lock class are not always folded together
+const int LOCK_ADDRESS_BUCKETS = 16;
+// Fixed memory: (lock class, address bucket, stack) combinations and distinct waiting stacks.
+// Waits on stacks beyond the limit are counted under stack ID 0; waits that find
+// no free histogram are only counted as overflow.
+// A histogram without waits for a whole interval is freed for another combination.
+const int LOCK_HISTOGRAMS = 2048;
+const int LOCK_HIST_STACKS = 4096;
+const u64 LOCK_HIST_USED = 1ULL << 63;
+// Key of a freed histogram: lookups probe past it, new combinations may take it
+const u64 LOCK_HIST_FREED = 1;
+
+struct LockHistogram {
+    // LOCK_HIST_USED | stack_id << 36 | address_bucket << 32 | class_id, 0 if never used
+    volatile u64 _key;
+    // Flushes that found no waits since the previous one
+    volatile u32 _idle;
+    volatile u64 _count;
+    volatile u64 _total;
+    volatile u64 _max;
+    volatile u32 _buckets[LOCK_HIST_BUCKETS];
+};
+
+struct LockWaitStack {
+    volatile u64 _hash;
+    volatile bool _ready;
+    bool _defined;
+    u32 _num_frames;
+    jmethodID _frames[LOCK_STACK_DEPTH];
+};
+
+class LockHistogramTask;
+
+// lockhist=TIME: every lock wait, no matter how short, is added to the latency histogram
+// of its (lock class, address bucket, waiting stack). Every TIME the non-empty histograms
+// are emitted as kd-lh records and reset; a waiting stack is defined once per session
+// with a kd-lsd record. Recording is lock-free and allocation-free.
+class LockHistograms {
+  private:
+    volatile bool _enabled;
+    LockHistogram* _histograms;
+    LockWaitStack* _stacks;
+    volatile u64 _overflow;
+    u64 _interval_start;
+
+    LockHistogramTask* _task;
+    std::thread _thread;
+
+    u32 stackId(LockWaitEvent* event);
+    LockHistogram* histogram(u32 class_id, u32 address_bucket, u32 stack_id);
+    void defineStacks(jvmtiEnv* jvmti);
+
+  public:
+    LockHistograms();
+    ~LockHistograms();
+
+    static int bucketOf(u64 nanos);
+    // Smallest duration in ns that falls into the bucket
+    static u64 bucketLowerBound(int bucket);
+
+    bool enabled() {
+        return _enabled;
+    }
+
+    void record(LockWaitEvent* event);
+    void flush();
+    void reset();
+
+    void startFlushTask(long interval);
+    void endFlushTask();
+};
+
+class LockHistogramTask: public Stoppable {
+  public:
+    LockHistogramTask(LockHistograms* histograms, long interval) {
+        this->histograms = histograms;
+        this->intervalMs = interval >= 10000000 ? interval / 1000000 : 10;
+    }
+
+    void run() {
+        while (!stopRequested()) {
+            // Sleep in short steps, so that a long interval does not delay stopping the profiler
+            for (long slept = 0; slept < intervalMs && !stopRequested(); slept += 100) {
+                std::this_thread::sleep_for(std::chrono::milliseconds(intervalMs - slept < 100 ? intervalMs - slept : 100));
+            }
+            histograms->flush();
+        }
+    }
+  private:
+    LockHistograms* histograms;
+    long intervalMs;
+};
+
+#endif // _LOCKHISTOGRAM_H
@@ -15,132 +15,52 @@
  */
 
 #include "lockRecorder.h"
-#include <iostream>
 #include "timeUtil.h"
-
-u64 expiredDuration = 30e9;
-
-void LockRecorder::recordLockedThread(uintptr_t lock_address, LockWaitEvent* event) {
-    auto last_locked_thread_it = _locked_thread_map->find(lock_address);
-    if (last_locked_thread_it == _locked_thread_map->end()) {
-        // No last thread found
-        _locked_thread_map->emplace(lock_address, event);
-    } else {
-        LockWaitEvent* lastEvent = last_locked_thread_it->second;
-        delete lastEvent;
-        (*_locked_thread_map)[lock_address] = event;
-    }
-}
+#include "vmEntry.h"
 
 void LockRecorder::clearLockedThread() {
-    jlong current_timestamp = getCurrentTimestamp();
-    lock_guard<mutex> lock(_mutex);
-    auto i = this->_locked_thread_map->begin();
-    while (i != this->_locked_thread_map->end()) {
-        auto event = i->second;
-        // Check if there is a thread waiting to lock it.
-        auto lock_address = i->first;
-        auto wait_lock_thread_it = _wait_lock_map->find(lock_address);
-        // We never remove the events if there is a thread waiting for.
-        if (wait_lock_thread_it != _wait_lock_map->end()) {
-            ++i;
-            continue;
-        }
-        if (current_timestamp - event->_wait_timestamp > expiredDuration) {
-            delete i->second;
-            i = this->_locked_thread_map->erase(i);
-        } else {
-            ++i;
-        }
-    }
-}
-
-bool isConcurrentLock(const string lock_name) {
-    // Do not count synchronizers other than ReentrantLock, ReentrantReadWriteLock
-    return lock_name == "Ljava/util/concurrent/locks/ReentrantLock" ||
-           lock_name == "Ljava/util/concurrent/locks/ReentrantReadWriteLock";
+    // Lock events carry raw TSC ticks; keep their conversion to wall-clock time anchored
+    TicksClock::calibrate();
+    u64 current_ticks = TSC::ticks();
+    u64 ttl = _holder_ttl;
+    // We never remove the holder of a lock if there is a thread waiting for it.
+    _locks.expireHolders([current_ticks, ttl](u64 holder_ticks) {
+        return TicksClock::ticksToNanos(current_ticks - holder_ticks) > ttl;
+    });
 }
 
 // Thread-safe must be guaranteed.
 void LockRecorder::updateWaitLockThread(LockWaitEvent* event) {
-    uintptr_t lock_address = event->_lock_object_address;
-    jint native_thread_id = event->_native_thread_id;
-    bool concurrentLock = event->_lock_type != "UnsafePark" || isConcurrentLock(event->_lock_name);
-    if (concurrentLock) {
-        jint locked_thread = findContendedThreads(lock_address, native_thread_id);
-        event->_wait_thread_id = locked_thread;
-    }
-
-    lock_guard<mutex> lock(_mutex);
-    auto wait_iterator = _wait_lock_map->find(lock_address);
-    auto threads_map = wait_iterator->second;
-    // No object in the map
-    if (wait_iterator == _wait_lock_map->end()) {
-        threads_map = new map<jint, LockWaitEvent*>();
-        threads_map->emplace(native_thread_id, event);
-        _wait_lock_map->emplace(lock_address, threads_map);
-        return;
-    }
-
-    // There is the object in the map. Try to find the thread_id.
-    auto thread_iterator = threads_map->find(native_thread_id);
-    // No the thread_id in the map.
-    if (thread_iterator == threads_map->end()) {
-        threads_map->emplace(native_thread_id, event);
-        return;
+    if (!_locks.addWaiter(event->_lock_object_address, event, event->_track_holder)) {
+        // One lock can not be waited by a same thread twice.
+        _pool.release(event, event->_native_thread_id);
     }
-
-    // It is supported not to enter this branch.
-    // Because one lock can not be waited by a same thread twice. 
-    // TODO: remove the println code.
-    // printf("[WARN] A lock is waited by a same thread twice. thread_id=%d, thread_name=%s.\n", native_thread_id, event->_thread_name.data());
-    delete event;
 }
 
-void LockRecorder::updateWakeThread(uintptr_t lock_address, jint thread_id, string thread_name, jlong wake_timestamp) {
-    lock_guard<mutex> lock(_mutex);
-    auto wait_iterator = _wait_lock_map->find(lock_address);
-    if (wait_iterator == _wait_lock_map->end()) {
-        // This should not happen because there should be a same lock.
-        // printf("[WARN] There is no the same lock. lock_address=%lu, thread_id=%d, thread_name=%s.\n", lock_address, thread_id, thread_name.data());
-        return;
-    }
-
-    auto threads_map = wait_iterator->second;
-    auto event_iterator = threads_map->find(thread_id);
-    if (event_iterator == threads_map->end()) {
+void LockRecorder::updateWakeThread(uintptr_t lock_address, jint thread_id, jlong wake_timestamp) {
+    LockWaitEvent* event = _locks.wake(lock_address, thread_id);
+    if (event == NULL) {
         // This should not happen because there should be a waited thread before it is waked.
-        // printf("[WARN] There is no the same thread waiting to be waked. thread_id=%d, thread_name=%s.\n", thread_id, thread_name.data());
         return;
     }
-    LockWaitEvent* event = event_iterator->second;
-    threads_map->erase(thread_id);
-    if (threads_map->size() == 0) {
-        _wait_lock_map->erase(lock_address);
-        delete threads_map;
-    }
-    event->_wake_timestamp = wake_timestamp;
-    event->_wait_duration = wake_timestamp - event->_wait_timestamp;
 
-    recordLockedThread(lock_address, event);
+    event->_wake_timestamp = wake_timestamp;
+    event->_wait_duration = TicksClock::ticksToNanos(wake_timestamp - event->_wait_timestamp);
+    // Histograms count every wait, including the ones below the reporting threshold
+    _histograms.record(event);
+    if (_sample_sink != NULL) {
+        _sample_sink(event);
+    }
 
     if (!filter(event)) {
+        // Most waits are shorter than the threshold; only reported ones pay for symbolization
+        if (_stack_mode == LOCK_STACK_LAZY) {
+            event->symbolize(VM::jvmti());
+        }
         // event->print();
         event->log();
     }
-}
-
-jint LockRecorder::findContendedThreads(uintptr_t lock_address, jint thread_id) {
-    unique_lock<mutex> uni_lock(_mutex, defer_lock);
-    uni_lock.lock();
-    auto last_locked_thread_it = _locked_thread_map->find(lock_address);
-    uni_lock.unlock();
-    if (last_locked_thread_it == _locked_thread_map->end() 
-     || last_locked_thread_it->second->_native_thread_id == thread_id) {
-        // No last thread found
-        return -1;
-    }
-    return last_locked_thread_it->second->_native_thread_id;
+    _pool.release(event, thread_id);
 }
 
 // 11ms
@@ -153,22 +73,24 @@ inline bool filter(LockWaitEvent* event) {
     return false;
 }
 
-void LockRecorder::reset() {
-    lock_guard<mutex> lock(_mutex);
-    for (auto it = _locked_thread_map->begin(); it != _locked_thread_map->end(); it++) {
-        auto event = it->second;
-        delete event;
-    }
-    _locked_thread_map->clear();
-    for (auto it = _wait_lock_map->begin(); it != _wait_lock_map->end(); it++) {
-        auto thread_map = it->second;
-        for (auto ite = thread_map->begin(); ite != thread_map->end(); ite++) {
-            auto event = ite->second;
-            delete event;
+void LockRecorder::reportBlocking() {
+    _graph.clear();
+    _locks.forEachWaiter([this](LockEntry<LockWaitEvent>* entry, LockWaitEvent* waiter) {
+        // Object.wait() does not wait for the holder. When parking, the thread that acquired
+        // the lock last only means something for ReentrantLock-like synchronizers.
+        if (waiter->_lock_type != LOCK_TYPE_MONITOR_WAIT) {
+            _graph.addEdge(waiter->_native_thread_id, waiter->_track_holder ? entry->_holder : 0,
+                           entry->_address, waiter->_lock_class_id, waiter->_wait_timestamp);
         }
-        delete thread_map;
-    }
-    _wait_lock_map->clear();
+    });
+    // Roots are reported by the same threshold as single lock waits
+    _graph.report(TSC::ticks(), threshold);
+}
+
+void LockRecorder::reset() {
+    _locks.clear([this](LockWaitEvent* event) {
+        _pool.release(event, event->_native_thread_id);
+    });
 }
 
 void LockRecorder::startClearLockedThreadTask() {
@@ -186,4 +108,22 @@ void LockRecorder::endClearLockedThreadTask() {
         delete _clear_map_task;
         _clear_map_task = NULL;
     }
-}
\ No newline at end of file
+}
+
+void LockRecorder::startGraphTask(long interval) {
+    _graph_task = new WaitGraphTask(this, interval);
+    _graph_thread = std::thread([&]{
+        VM::attachThread("AsyncProfiler-Lock-Graph");
+        _graph_task->run();
+        VM::detachThread();
+    });
+}
+
+void LockRecorder::endGraphTask() {
+    if (_graph_task != NULL) {
+        _graph_task->stop();
+        _graph_thread.join();
+        delete _graph_task;
+        _graph_task = NULL;
+    }
+}
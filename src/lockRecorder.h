@@ -18,52 +18,105 @@
 #define _LOCKRECORDER_H
 
 #include <jvmti.h>
-#include <map>
-#include <mutex>
+#include <string.h>
+#include "arguments.h"
+#include "dictionary.h"
 #include "lockEvent.h"
+#include "lockGraph.h"
+#include "lockHistogram.h"
+#include "lockTable.h"
 #include "stoppableTask.h"
 
 using namespace std;
 
 bool filter(LockWaitEvent* event);
 
+typedef void (*LockSampleSink)(LockWaitEvent* event);
+
 class ClearMapTask;
+class WaitGraphTask;
 
 class LockRecorder {
   public:
-    LockRecorder() {
-        _has_stack = true;
-        _locked_thread_map = new map<uintptr_t, LockWaitEvent*>();
-        _wait_lock_map = new map<uintptr_t, map<jint, LockWaitEvent*>*>();
+    LockRecorder() : _stack_mode(LOCK_STACK_LAZY), _holder_ttl(30000000000ULL), _sample_sink(NULL), _clear_map_task(NULL), _graph_task(NULL) {
     }
 
     ~LockRecorder() {
         reset();
-        delete _locked_thread_map;
-        delete _wait_lock_map;
     }
+    // Returns an event to fill in and pass to updateWaitLockThread, or NULL if the pool is exhausted
+    LockWaitEvent* allocateEvent(int thread_id) {
+        return _pool.alloc(thread_id);
+    }
+
+    // Thread names are interned once, so events only point to them
+    const char* internThreadName(const char* name) {
+        const char* interned = "";
+        if (name != NULL) {
+            _thread_names.lookup(name, strlen(name), &interned);
+        }
+        return interned;
+    }
+
     void updateWaitLockThread(LockWaitEvent* event);
-    void updateWakeThread(uintptr_t lock_address, jint thread_id, string thread_name, jlong wake_timestamp);
+    void updateWakeThread(uintptr_t lock_address, jint thread_id, jlong wake_timestamp);
     void clearLockedThread();
     void startClearLockedThreadTask();
     void endClearLockedThreadTask();
     // reset is used to clear the maps when the logTracer stops.
     void reset();
-    bool isRecordStack() {
-        return _has_stack;
+    void setStackMode(LockStack mode) {
+        _stack_mode = mode;
+    }
+    LockStack stackMode() {
+        return _stack_mode;
+    }
+    // lockttl=TIME: how long the last holder of a lock nobody waits for is remembered
+    void setHolderTtl(u64 ttl) {
+        _holder_ttl = ttl;
+    }
+    u64 holderTtl() {
+        return _holder_ttl;
+    }
+    // Every completed wait is also passed to sink before kd-jf filtering; NULL disables
+    void setSampleSink(LockSampleSink sink) {
+        _sample_sink = sink;
+    }
+    bool samplesEnabled() {
+        return _sample_sink != NULL;
+    }
+    // lockhist=TIME
+    void startHistograms(long interval) {
+        _histograms.startFlushTask(interval);
+    }
+    void endHistograms() {
+        _histograms.endFlushTask();
+    }
+    // lockgraph=TIME
+    void reportBlocking();
+    void startGraphTask(long interval);
+    void endGraphTask();
+    // Lock classes of monitors are only needed to label samples, histograms and blocking reports
+    bool classifyMonitors() {
+        return _sample_sink != NULL || _histograms.enabled() || _graph_task != NULL;
     }
   private:
-    bool _has_stack;
-    std::mutex _mutex;
+    LockStack _stack_mode;
+    u64 _holder_ttl;
+    LockSampleSink _sample_sink;
 
-    map<uintptr_t, LockWaitEvent*>* _locked_thread_map;
-    map<uintptr_t, map<jint, LockWaitEvent*>*>* _wait_lock_map;
+    // Per lock address: the threads waiting for it and the last one that acquired it
+    LockShards<LockWaitEvent> _locks;
+    LockEventPool _pool;
+    Dictionary _thread_names;
+    LockHistograms _histograms;
 
     ClearMapTask* _clear_map_task;
     std::thread _clear_map_thread;
 
-    void recordLockedThread(uintptr_t lock_address, LockWaitEvent* event);
-    jint findContendedThreads(uintptr_t lock_address, jint thread_id);
+    WaitGraph _graph;
+    WaitGraphTask* _graph_task;
+    std::thread _graph_thread;
 
     friend class ClearMapTask;
 };
@@ -75,14 +128,40 @@ class ClearMapTask: public Stoppable {
     }
     void run() {
         // Check if thread is requested to stop
+        // Expiry only visits expired holders, so a short TTL can be checked as often as it needs
+        long interval_ms = recorder->holderTtl() / 1000000;
+        if (interval_ms > 5000) {
+            interval_ms = 5000;
+        } else if (interval_ms < 100) {
+            interval_ms = 100;
+        }
         while (stopRequested() == false)
         {
             recorder->clearLockedThread();
-            std::this_thread::sleep_for(std::chrono::milliseconds(5000));
+            std::this_thread::sleep_for(std::chrono::milliseconds(interval_ms));
+        }
+    }
+  private:
+    LockRecorder* recorder;
+};
+
+class WaitGraphTask: public Stoppable {
+  public:
+    WaitGraphTask(LockRecorder* recorder, long interval) {
+        this->recorder = recorder;
+        this->intervalMs = interval >= 10000000 ? interval / 1000000 : 10;
+    }
+    void run() {
+        while (!stopRequested()) {
+            for (long slept = 0; slept < intervalMs && !stopRequested(); slept += 100) {
+                std::this_thread::sleep_for(std::chrono::milliseconds(intervalMs - slept < 100 ? intervalMs - slept : 100));
+            }
+            recorder->reportBlocking();
         }
     }
   private:
     LockRecorder* recorder;
+    long intervalMs;
 };
 
 #endif // _LOCKRECORDER_H
\ No newline at end of file
@@ -0,0 +1,410 @@
+/*
+ * Copyright 2022 The Kindling Authors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _LOCKTABLE_H
+#define _LOCKTABLE_H
+
+#include <sched.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include "arch.h"
+
+
+// Maximum number of LockShards; locks are spread across shards by address
+const int LOCK_SHARDS = 64;
+const u32 LOCK_TABLE_INITIAL_CAPACITY = 64;
+// Busy-wait iterations before a contended ShardLock starts yielding the CPU
+const int SHARD_LOCK_SPINS = 128;
+
+// State of one contended lock. Waiter is expected to have
+// Waiter* _next_waiter, jint _native_thread_id, jint _wait_thread_id and jlong _wait_timestamp.
+template <class Waiter>
+struct LockEntry {
+    // 0 marks a free slot
+    uintptr_t _address;
+    // Thread that acquired the lock after the last contended wait, 0 if none
+    int _holder;
+    // When the holder started waiting for the lock
+    u64 _holder_ticks;
+    // Threads waiting for the lock right now, linked by _next_waiter
+    Waiter* _waiters;
+};
+
+// Record of the expiry queue: holder_ticks of the entry when it was queued
+struct LockExpiry {
+    uintptr_t _address;
+    u64 _ticks;
+};
+
+// Flat open-addressing map of lock address -> LockEntry with linear probing.
+// remove() shifts the following entries back, so there are no tombstones.
+// Every entry also has exactly one record in a FIFO expiry queue, which expire() consumes
+// from the oldest end, so that expiry costs O(expired) rather than a scan of the whole table.
+// Not thread-safe: a table is guarded by the lock of its shard.
+template <class Waiter>
+class LockTable {
+  private:
+    LockEntry<Waiter>* _entries;
+    u32 _capacity;
+    u32 _size;
+    // Ring of _size records starting at _queue_head, same capacity as the table
+    LockExpiry* _queue;
+    u32 _queue_head;
+
+    bool grow() {
+        u32 capacity = _capacity == 0 ? LOCK_TABLE_INITIAL_CAPACITY : _capacity * 2;
+        LockEntry<Waiter>* entries = (LockEntry<Waiter>*)calloc(capacity, sizeof(LockEntry<Waiter>));
+        LockExpiry* queue = (LockExpiry*)malloc(capacity * sizeof(LockExpiry));
+        if (entries == NULL || queue == NULL) {
+            free(entries);
+            free(queue);
+            return false;
+        }
+
+        u32 mask = capacity - 1;
+        for (u32 i = 0; i < _capacity; i++) {
+            if (_entries[i]._address != 0) {
+                u32 slot = slotOf(_entries[i]._address, mask);
+                while (entries[slot]._address != 0) {
+                    slot = (slot + 1) & mask;
+                }
+                entries[slot] = _entries[i];
+            }
+        }
+
+        for (u32 i = 0; i < _size; i++) {
+            queue[i] = _queue[(_queue_head + i) & (_capacity - 1)];
+        }
+
+        free(_entries);
+        free(_queue);
+        _entries = entries;
+        _capacity = capacity;
+        _queue = queue;
+        _queue_head = 0;
+        return true;
+    }
+
+    // The slot of a removed entry may be taken by one of the following entries.
+    // The caller has already taken the record of the entry off the queue.
+    void remove(LockEntry<Waiter>* entry) {
+        u32 mask = _capacity - 1;
+        u32 hole = entry - _entries;
+
+        for (u32 slot = (hole + 1) & mask; _entries[slot]._address != 0; slot = (slot + 1) & mask) {
+            u32 home = slotOf(_entries[slot]._address, mask);
+            // The entry may move back unless its home slot lies between the hole and itself
+            if (((slot - home) & mask) >= ((slot - hole) & mask)) {
+                _entries[hole] = _entries[slot];
+                hole = slot;
+            }
+        }
+
+        _entries[hole]._address = 0;
+        _size--;
+    }
+
+  public:
+    LockTable() : _entries(NULL), _capacity(0), _size(0), _queue(NULL), _queue_head(0) {
+    }
+
+    ~LockTable() {
+        free(_entries);
+        free(_queue);
+    }
+
+    static u64 hash(uintptr_t address) {
+        // Objects are 8-byte aligned
+        return (u64)(address >> 3) * 0x9e3779b97f4a7c15ULL;
+    }
+
+    static u32 slotOf(uintptr_t address, u32 mask) {
+        return (u32)(hash(address) >> 20) & mask;
+    }
+
+    u32 capacity() {
+        return _capacity;
+    }
+
+    u32 size() {
+        return _size;
+    }
+
+    LockEntry<Waiter>* at(u32 slot) {
+        return &_entries[slot];
+    }
+
+    LockEntry<Waiter>* find(uintptr_t address) {
+        if (_size == 0) {
+            return NULL;
+        }
+
+        u32 mask = _capacity - 1;
+        for (u32 slot = slotOf(address, mask); _entries[slot]._address != 0; slot = (slot + 1) & mask) {
+            if (_entries[slot]._address == address) {
+                return &_entries[slot];
+            }
+        }
+        return NULL;
+    }
+
+    // Returns NULL only if the table is full and cannot grow
+    LockEntry<Waiter>* findOrInsert(uintptr_t address) {
+        LockEntry<Waiter>* entry = find(address);
+        if (entry != NULL) {
+            return entry;
+        }
+
+        // Keep the load factor under 3/4
+        if (_size >= _capacity - _capacity / 4 && !grow() && _size == _capacity) {
+            return NULL;
+        }
+
+        u32 mask = _capacity - 1;
+        u32 slot = slotOf(address, mask);
+        while (_entries[slot]._address != 0) {
+            slot = (slot + 1) & mask;
+        }
+
+        entry = &_entries[slot];
+        entry->_address = address;
+        entry->_holder = 0;
+        entry->_holder_ticks = 0;
+        entry->_waiters = NULL;
+
+        LockExpiry* record = &_queue[(_queue_head + _size) & mask];
+        record->_address = address;
+        record->_ticks = 0;
+        _size++;
+        return entry;
+    }
+
+    // Removes entries nobody waits for if expired(holder_ticks) says so. Records are queued
+    // in roughly increasing holder_ticks, so the walk stops at the first one not expired.
+    // An entry whose holder has changed since it was queued is queued again with its new holder_ticks.
+    template <class Expired>
+    void expire(Expired expired) {
+        for (u32 budget = _size; budget > 0; budget--) {
+            LockExpiry record = _queue[_queue_head];
+            if (!expired(record._ticks)) {
+                break;
+            }
+
+            u32 mask = _capacity - 1;
+            _queue_head = (_queue_head + 1) & mask;
+
+            LockEntry<Waiter>* entry = find(record._address);
+            if (entry->_waiters == NULL && expired(entry->_holder_ticks)) {
+                remove(entry);
+            } else {
+                // Entries with waiters are requeued as well; each one is looked at once per call at most
+                LockExpiry* requeued = &_queue[(_queue_head + _size - 1) & mask];
+                requeued->_address = record._address;
+                requeued->_ticks = entry->_holder_ticks;
+            }
+        }
+    }
+
+    void clear() {
+        free(_entries);
+        free(_queue);
+        _entries = NULL;
+        _queue = NULL;
+        _capacity = 0;
+        _size = 0;
+        _queue_head = 0;
+    }
+};
+
+// Lock of one LockShard. Critical sections are short, so a waiter spins first, but only
+// for SHARD_LOCK_SPINS rounds: with more runnable threads than CPUs the holder may have been
+// preempted, and spinning would then burn the rest of the time slice the holder needs.
+class ShardLock {
+  private:
+    volatile int _lock;
+
+  public:
+    ShardLock() : _lock(0) {
+    }
+
+    bool tryLock() {
+        return __sync_bool_compare_and_swap(&_lock, 0, 1);
+    }
+
+    void lock() {
+        for (int spins = 0; !tryLock(); ) {
+            // Wait for the lock to look free before trying the CAS again
+            while (_lock != 0) {
+                if (++spins < SHARD_LOCK_SPINS) {
+                    spinPause();
+                } else {
+                    sched_yield();
+                }
+            }
+        }
+    }
+
+    void unlock() {
+        __sync_lock_release(&_lock);
+    }
+};
+
+template <class Waiter>
+struct LockShard {
+    ShardLock _lock;
+    LockTable<Waiter> _table;
+    // A full cache line between the fields of neighbouring shards keeps them off each other's
+    // lines wherever the array starts. alignas would not: LockRecorder is created with plain new,
+    // which ignores extended alignment before C++17
+    char _padding[64];
+};
+
+// Contended locks partitioned into shards by address; each shard has its own lock and table,
+// so that lock events on unrelated monitors do not serialize on one profiler mutex.
+// Critical sections never allocate events, log or do any I/O.
+template <class Waiter>
+class LockShards {
+  private:
+    LockShard<Waiter> _shards[LOCK_SHARDS];
+    u32 _shard_mask;
+
+  public:
+    // shards must be a power of 2 not greater than LOCK_SHARDS
+    LockShards(int shards = LOCK_SHARDS) : _shard_mask(shards - 1) {
+    }
+
+    int shards() {
+        return _shard_mask + 1;
+    }
+
+    LockShard<Waiter>& shardOf(uintptr_t address) {
+        return _shards[(u32)(LockTable<Waiter>::hash(address) >> 58) & _shard_mask];
+    }
+
+    // Links waiter to the lock at address. With find_holder, also stores the thread that
+    // acquired the lock last into waiter->_wait_thread_id (-1 if none or the waiter itself).
+    // Returns false if the thread is already waiting for this lock; the caller keeps the waiter then.
+    bool addWaiter(uintptr_t address, Waiter* waiter, bool find_holder) {
+        LockShard<Waiter>& shard = shardOf(address);
+        shard._lock.lock();
+
+        LockEntry<Waiter>* entry = shard._table.findOrInsert(address);
+        if (entry == NULL) {
+            shard._lock.unlock();
+            return false;
+        }
+
+        if (find_holder) {
+            int holder = entry->_holder;
+            waiter->_wait_thread_id = holder == 0 || holder == waiter->_native_thread_id ? -1 : holder;
+        }
+
+        for (Waiter* w = entry->_waiters; w != NULL; w = w->_next_waiter) {
+            if (w->_native_thread_id == waiter->_native_thread_id) {
+                // One lock can not be waited by the same thread twice
+                shard._lock.unlock();
+                return false;
+            }
+        }
+
+        waiter->_next_waiter = entry->_waiters;
+        entry->_waiters = waiter;
+        shard._lock.unlock();
+        return true;
+    }
+
+    // Unlinks the waiter of thread_id and records that thread as the holder of the lock.
+    // Returns the waiter, now owned by the caller, or NULL if the thread was not waiting.
+    Waiter* wake(uintptr_t address, int thread_id) {
+        LockShard<Waiter>& shard = shardOf(address);
+        shard._lock.lock();
+
+        LockEntry<Waiter>* entry = shard._table.find(address);
+        Waiter* waiter = NULL;
+        if (entry != NULL) {
+            for (Waiter** prev = &entry->_waiters; *prev != NULL; prev = &(*prev)->_next_waiter) {
+                if ((*prev)->_native_thread_id == thread_id) {
+                    waiter = *prev;
+                    *prev = waiter->_next_waiter;
+                    waiter->_next_waiter = NULL;
+                    entry->_holder = thread_id;
+                    entry->_holder_ticks = waiter->_wait_timestamp;
+                    break;
+                }
+            }
+        }
+
+        shard._lock.unlock();
+        return waiter;
+    }
+
+    // Forgets holders of locks nobody waits for, if expired(holder_ticks) says so.
+    // Only the expired part of each table is visited, see LockTable::expire
+    template <class Expired>
+    void expireHolders(Expired expired) {
+        for (u32 i = 0; i <= _shard_mask; i++) {
+            LockShard<Waiter>& shard = _shards[i];
+            shard._lock.lock();
+            shard._table.expire(expired);
+            shard._lock.unlock();
+        }
+    }
+
+    // Calls visit(entry, waiter) for every waiting thread, holding the lock of one shard at a time
+    template <class Visit>
+    void forEachWaiter(Visit visit) {
+        for (u32 i = 0; i <= _shard_mask; i++) {
+            LockShard<Waiter>& shard = _shards[i];
+            shard._lock.lock();
+            LockTable<Waiter>& table = shard._table;
+            for (u32 slot = 0; slot < table.capacity(); slot++) {
+                LockEntry<Waiter>* entry = table.at(slot);
+                if (entry->_address == 0) {
+                    continue;
+                }
+                for (Waiter* w = entry->_waiters; w != NULL; w = w->_next_waiter) {
+                    visit(entry, w);
+                }
+            }
+            shard._lock.unlock();
+        }
+    }
+
+    // Drops all state; every waiter still linked is passed to release
+    template <class Release>
+    void clear(Release release) {
+        for (u32 i = 0; i <= _shard_mask; i++) {
+            LockShard<Waiter>& shard = _shards[i];
+            shard._lock.lock();
+            LockTable<Waiter>& table = shard._table;
+            for (u32 slot = 0; slot < table.capacity(); slot++) {
+                LockEntry<Waiter>* entry = table.at(slot);
+                if (entry->_address == 0) {
+                    continue;
+                }
+                for (Waiter* w = entry->_waiters; w != NULL; ) {
+                    Waiter* next = w->_next_waiter;
+                    release(w);
+                    w = next;
+                }
+            }
+            table.clear();
+            shard._lock.unlock();
+        }
+    }
+};
+
+#endif // _LOCKTABLE_H
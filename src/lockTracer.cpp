@@ -22,7 +22,6 @@
 #include "profiler.h"
 #include "tsc.h"
 #include "vmStructs.h"
-#include "timeUtil.h"
 
 double LockTracer::_ticks_to_nanos;
 jlong LockTracer::_threshold;
@@ -30,6 +29,10 @@ jlong LockTracer::_start_time = 0;
 jclass LockTracer::_UnsafeClass = NULL;
 jclass LockTracer::_LockSupport = NULL;
 jmethodID LockTracer::_getBlocker = NULL;
+jfieldID LockTracer::_parkBlocker = NULL;
+jfieldID LockTracer::_threadName = NULL;
+LockClassCache LockTracer::_class_cache;
+LockThreadCache LockTracer::_thread_cache;
 RegisterNativesFunc LockTracer::_orig_RegisterNatives = NULL;
 UnsafeParkFunc LockTracer::_orig_Unsafe_park = NULL;
 bool LockTracer::_initialized = false;
@@ -42,6 +45,8 @@ Error LockTracer::start(Arguments& args) {
     if (!_initialized) {
         initialize();
     }
+    // Klasses may have been unloaded since the last session
+    _class_cache.clear();
 
     // Enable Java Monitor events
     jvmtiEnv* jvmti = VM::jvmti();
@@ -56,7 +61,16 @@ Error LockTracer::start(Arguments& args) {
         bindUnsafePark(UnsafeParkHook);
     }
 
+    _lockRecorder->setStackMode(args._lock_stack);
+    _lockRecorder->setHolderTtl(args._lock_ttl);
+    _lockRecorder->setSampleSink(args._lock_samples ? recordContendedLock : NULL);
     _lockRecorder->startClearLockedThreadTask();
+    if (args._lock_hist > 0) {
+        _lockRecorder->startHistograms(args._lock_hist);
+    }
+    if (args._lock_graph > 0) {
+        _lockRecorder->startGraphTask(args._lock_graph);
+    }
     return Error::OK;
 }
 
@@ -74,6 +88,8 @@ void LockTracer::stop() {
     }
     if (_lockRecorder != NULL) {
         _lockRecorder->endClearLockedThreadTask();
+        _lockRecorder->endHistograms();
+        _lockRecorder->endGraphTask();
         _lockRecorder->reset();
     }
 }
@@ -110,37 +126,35 @@ void LockTracer::initialize() {
 
     _LockSupport = (jclass)env->NewGlobalRef(env->FindClass("java/util/concurrent/locks/LockSupport"));
     _getBlocker = env->GetStaticMethodID(_LockSupport, "getBlocker", "(Ljava/lang/Thread;)Ljava/lang/Object;");
-
     env->ExceptionClear();
+
+    // LockSupport.getBlocker() just reads Thread.parkBlocker; do the same without a Java upcall
+    jclass thread_class = env->FindClass("java/lang/Thread");
+    if (thread_class == NULL || (_parkBlocker = env->GetFieldID(thread_class, "parkBlocker", "Ljava/lang/Object;")) == NULL) {
+        env->ExceptionClear();
+    }
+    // Without Thread.name, renamed threads keep their cached name
+    if (thread_class == NULL || (_threadName = env->GetFieldID(thread_class, "name", "Ljava/lang/String;")) == NULL) {
+        env->ExceptionClear();
+    }
     _initialized = true;
 }
 
 void JNICALL LockTracer::MonitorWait(jvmtiEnv* jvmti, JNIEnv* env, jthread thread, jobject object, jlong timeout) {
-    recordLockInfo(LOCK_MONITOR_WAIT, jvmti, env, thread, object, getCurrentTimestamp());
+    recordLockInfo(LOCK_MONITOR_WAIT, jvmti, env, thread, object, TSC::ticks());
 }
 
 void JNICALL LockTracer::MonitorWaited(jvmtiEnv* jvmti, JNIEnv* env, jthread thread, jobject object, jboolean timed_out) {
-    recordLockInfo(LOCK_MONITOR_WAITED, jvmti, env, thread, object, getCurrentTimestamp());
+    recordLockInfo(LOCK_MONITOR_WAITED, jvmti, env, thread, object, TSC::ticks());
 }
 
 void JNICALL LockTracer::MonitorContendedEnter(jvmtiEnv* jvmti, JNIEnv* env, jthread thread, jobject object) {
-    // jlong enter_time = TSC::ticks();
-    recordLockInfo(LOCK_MONITOR_ENTER, jvmti, env, thread, object, getCurrentTimestamp());
-    // jvmti->SetTag(thread, enter_time);
+    recordLockInfo(LOCK_MONITOR_ENTER, jvmti, env, thread, object, TSC::ticks());
 }
 
 void JNICALL LockTracer::MonitorContendedEntered(jvmtiEnv* jvmti, JNIEnv* env, jthread thread, jobject object) {
-    // jlong entered_time = TSC::ticks();
-    recordLockInfo(LOCK_MONITOR_ENTERED, jvmti, env, thread, object, getCurrentTimestamp());
-    // jlong enter_time;
-    // jvmti->GetTag(thread, &enter_time);
-
-    // Time is meaningless if lock attempt has started before profiling
-    // if (_enabled && entered_time - enter_time >= _threshold && enter_time >= _start_time) {
-    //     char* lock_name = getLockName(jvmti, env, object);
-    //     recordContendedLock(BCI_LOCK, enter_time, entered_time, lock_name, object, 0);
-    //     jvmti->Deallocate((unsigned char*)lock_name);
-    // }
+    // The profiler sample is recorded by LockRecorder through recordContendedLock
+    recordLockInfo(LOCK_MONITOR_ENTERED, jvmti, env, thread, object, TSC::ticks());
 }
 
 jint JNICALL LockTracer::RegisterNativesHook(JNIEnv* env, jclass cls, const JNINativeMethod* methods, jint nMethods) {
@@ -158,155 +172,213 @@ jint JNICALL LockTracer::RegisterNativesHook(JNIEnv* env, jclass cls, const JNIN
 
 void JNICALL LockTracer::UnsafeParkHook(JNIEnv* env, jobject instance, jboolean isAbsolute, jlong time) {
     jvmtiEnv* jvmti = VM::jvmti();
-    jobject park_blocker = _enabled ? getParkBlocker(jvmti, env) : NULL;
-    jlong park_start_time, park_end_time;
     jthread thread;
+    jobject park_blocker = _enabled ? getParkBlocker(jvmti, env, &thread) : NULL;
     if (park_blocker != NULL) {
-        park_start_time = TSC::ticks();
-        jvmti->GetCurrentThread(&thread);
-        recordLockInfo(LOCK_BEFORE_PARK, jvmti, env, thread, park_blocker, getCurrentTimestamp());
+        recordLockInfo(LOCK_BEFORE_PARK, jvmti, env, thread, park_blocker, TSC::ticks());
     }
 
     _orig_Unsafe_park(env, instance, isAbsolute, time);
 
     if (park_blocker != NULL) {
-        recordLockInfo(LOCK_AFTER_PARK, jvmti, env, thread, park_blocker, getCurrentTimestamp());
-        // park_end_time = TSC::ticks();
-        // if (park_end_time - park_start_time >= _threshold) {
-        //     char* lock_name = getLockName(jvmti, env, park_blocker);
-        //     if (lock_name == NULL || isConcurrentLock(lock_name)) {
-        //         recordContendedLock(BCI_PARK, park_start_time, park_end_time, lock_name, park_blocker, time);
-        //     }
-        //     jvmti->Deallocate((unsigned char*)lock_name);
-        // }
+        recordLockInfo(LOCK_AFTER_PARK, jvmti, env, thread, park_blocker, TSC::ticks());
     }
 }
 
-jobject LockTracer::getParkBlocker(jvmtiEnv* jvmti, JNIEnv* env) {
-    jthread thread;
-    if (jvmti->GetCurrentThread(&thread) != 0) {
+jobject LockTracer::getParkBlocker(jvmtiEnv* jvmti, JNIEnv* env, jthread* thread) {
+    if (jvmti->GetCurrentThread(thread) != 0) {
         return NULL;
     }
 
+    if (_parkBlocker != NULL) {
+        return env->GetObjectField(*thread, _parkBlocker);
+    }
+
     // Call LockSupport.getBlocker(Thread.currentThread())
-    return env->CallStaticObjectMethod(_LockSupport, _getBlocker, thread);
+    return env->CallStaticObjectMethod(_LockSupport, _getBlocker, *thread);
 }
 
-void LockTracer::recordLockInfo(LockEventType event_type, jvmtiEnv* jvmti, JNIEnv* env, jthread thread, jobject object, jlong timestamp) {
-    // hasStack=false;
+void LockTracer::getLockClass(jvmtiEnv* jvmti, JNIEnv* env, jobject object, u32* class_id, bool* track_holder) {
+    jclass cls = env->GetObjectClass(object);
+
+    if (VMStructs::hasClassNames()) {
+        VMKlass* klass = VMKlass::fromJavaClass(env, cls);
+        VMSymbol* symbol = klass->name();
+        if (!_class_cache.lookup(klass, symbol, class_id, track_holder)) {
+            *class_id = Profiler::instance()->classMap()->lookup(symbol->body(), symbol->length());
+            *track_holder = isConcurrentLock(symbol->body(), symbol->length());
+            _class_cache.insert(klass, symbol, *class_id, *track_holder);
+        }
+        return;
+    }
+
+    char* class_name = NULL;
+    if (jvmti->GetClassSignature(cls, &class_name, NULL) == 0) {
+        if (class_name[0] == 'L') {
+            *class_id = Profiler::instance()->classMap()->lookup(class_name + 1, strlen(class_name) - 2);
+        } else {
+            *class_id = Profiler::instance()->classMap()->lookup(class_name);
+        }
+        *track_holder = isConcurrentLock(class_name);
+    }
+    jvmti->Deallocate((unsigned char*)class_name);
+}
+
+const char* LockTracer::getThreadName(jvmtiEnv* jvmti, JNIEnv* env, jthread thread, int native_thread_id, jlong java_thread_id) {
+    // Thread.setName() replaces the String, so its address tells if the thread has been renamed.
+    // A GC moving the String only costs one more GetThreadInfo.
+    uintptr_t name_oop = 0;
+    if (_threadName != NULL) {
+        jobject name = env->GetObjectField(thread, _threadName);
+        if (name != NULL) {
+            name_oop = *(uintptr_t*)name;
+            env->DeleteLocalRef(name);
+        }
+    }
+
+    const char* thread_name;
+    if (_thread_cache.lookup(native_thread_id, java_thread_id, name_oop, &thread_name)) {
+        return thread_name;
+    }
+
     jvmtiThreadInfo thread_info;
-    jlong java_thread_id = 0;
-    int native_thread_id = VMThread::nativeThreadId(env, thread);
-    if (native_thread_id >= 0 && jvmti->GetThreadInfo(thread, &thread_info) == 0) {
-        java_thread_id = VMThread::javaThreadId(env, thread);
+    if (jvmti->GetThreadInfo(thread, &thread_info) != 0) {
+        return "";
     }
-    
-    std::string event_name;
-    std::string lock_type;
-    std::string lock_name;
+    thread_name = _lockRecorder->internThreadName(thread_info.name);
+    jvmti->Deallocate((unsigned char*)thread_info.name);
+
+    _thread_cache.insert(native_thread_id, java_thread_id, name_oop, thread_name);
+    return thread_name;
+}
+
+void LockTracer::recordLockInfo(LockEventType event_type, jvmtiEnv* jvmti, JNIEnv* env, jthread thread, jobject object, jlong timestamp) {
+    int native_thread_id = VMThread::nativeThreadId(env, thread);
+
     switch (event_type) {
-        case LOCK_MONITOR_WAIT:
-            event_name = "MonitorWait";
-            lock_type = "MonitorWait";
-            break;
-        case LOCK_MONITOR_ENTER:
-            event_name = "MonitorEnter";
-            lock_type = "MonitorEnter";
-            break;
-        case LOCK_BEFORE_PARK: {
-            event_name = "UnsafeParkHookBefore";
-            lock_type = "UnsafePark";
-            char* class_name = NULL;
-            if (jvmti->GetClassSignature(env->GetObjectClass(object), &class_name, NULL) == 0) {
-                lock_name = class_name;
-            }
-            jvmti->Deallocate((unsigned char*)class_name);
-            break;
-        }
         case LOCK_MONITOR_WAITED:
-            event_name = "MonitorWaited";
-            break;
         case LOCK_MONITOR_ENTERED:
-            event_name = "MonitorEntered";
-            break;
         case LOCK_AFTER_PARK:
-            event_name = "UnsafeParkHookAfter";
+            _lockRecorder->updateWakeThread(*(uintptr_t*)object, native_thread_id, timestamp);
+            return;
+        default:
             break;
     }
 
+    LockWaitEvent* event = _lockRecorder->allocateEvent(native_thread_id);
+    if (event == NULL) {
+        return;
+    }
+
+    jlong java_thread_id = 0;
+    const char* thread_name = "";
+    if (native_thread_id >= 0) {
+        java_thread_id = VMThread::javaThreadId(env, thread);
+        thread_name = getThreadName(jvmti, env, thread, native_thread_id, java_thread_id);
+    }
+
+    const char* lock_type = LOCK_TYPE_MONITOR_ENTER;
+    u32 lock_class_id = 0;
+    bool track_holder = true;
     switch (event_type) {
         case LOCK_MONITOR_WAIT:
-        case LOCK_MONITOR_ENTER:
-        case LOCK_BEFORE_PARK: {
-            LockWaitEvent* event = new LockWaitEvent(native_thread_id, thread_info.name, java_thread_id, *(uintptr_t*)object, lock_type, lock_name, timestamp);
-            if (_lockRecorder->isRecordStack()) {
-                event->_stack_trace = getStackTrace(jvmti, thread, 10);
-            }
-            _lockRecorder->updateWaitLockThread(event);
+            lock_type = LOCK_TYPE_MONITOR_WAIT;
             break;
-        }
-        case LOCK_MONITOR_WAITED:
-        case LOCK_MONITOR_ENTERED:
-        case LOCK_AFTER_PARK:
-            _lockRecorder->updateWakeThread(*(uintptr_t*)object, native_thread_id, thread_info.name, timestamp);
+        case LOCK_BEFORE_PARK:
+            lock_type = LOCK_TYPE_UNSAFE_PARK;
+            track_holder = false;
+            getLockClass(jvmti, env, object, &lock_class_id, &track_holder);
+            break;
+        default:
+            if (_lockRecorder->classifyMonitors()) {
+                // Monitors always track the holder, the class only labels the histogram
+                bool ignored;
+                getLockClass(jvmti, env, object, &lock_class_id, &ignored);
+            }
             break;
     }
 
-    jvmti->Deallocate((unsigned char*)thread_info.name);
+    event->init(native_thread_id, thread_name, java_thread_id,
+                *(uintptr_t*)object, lock_type, lock_class_id, track_holder, timestamp);
+    LockStack stack_mode = _lockRecorder->stackMode();
+    if (stack_mode != LOCK_STACK_NONE) {
+        // One capture serves both the profiler sample and kd-jf
+        int depth = _lockRecorder->samplesEnabled() ? LOCK_SAMPLE_DEPTH : LOCK_STACK_DEPTH;
+        event->_num_frames = getStackTrace(jvmti, thread, event->_frames, event->_bcis, depth);
+        if (stack_mode == LOCK_STACK_EAGER) {
+            event->symbolize(jvmti);
+        }
+    }
+    _lockRecorder->updateWaitLockThread(event);
 }
 
-string LockTracer::getStackTrace(jvmtiEnv* jvmti, jthread thread, int depth) {
-    jvmtiFrameInfo frames[depth];
+u32 LockTracer::getStackTrace(jvmtiEnv* jvmti, jthread thread, jmethodID* methods, jint* bcis, int depth) {
+    jvmtiFrameInfo frames[LOCK_SAMPLE_DEPTH];
     jint count;
-    jvmtiError err;
-    string ret_string = string();
-    err = jvmti->GetStackTrace(thread, 0, depth, frames, &count);
-    if (err == JVMTI_ERROR_NONE && count >= 1) {
-        for (int i=0; i < count; i++) {
-            char *method_name = NULL;
-            char *signature = NULL;
-            err = jvmti->GetMethodName(frames[i].method, &method_name, NULL, NULL);
-            if (err == JVMTI_ERROR_NONE) {
-                jclass declaring_class;
-                err = jvmti->GetMethodDeclaringClass(frames[i].method, &declaring_class);
-                if (err == JVMTI_ERROR_NONE) {
-                    jvmti->GetClassSignature(declaring_class, &signature, NULL);
-                }
-                ret_string.append(method_name).append(".").append(signature);
-            }
-            jvmti->Deallocate((unsigned char*)method_name);
-            jvmti->Deallocate((unsigned char*)signature);
-        }
+    if (depth > LOCK_SAMPLE_DEPTH || jvmti->GetStackTrace(thread, 0, depth, frames, &count) != JVMTI_ERROR_NONE) {
+        return 0;
+    }
+    for (int i = 0; i < count; i++) {
+        methods[i] = frames[i].method;
+        bcis[i] = (jint)frames[i].location;
     }
-    return ret_string;
+    return count;
+}
+
+static inline bool startsWith(const char* s, size_t length, const char* prefix, size_t prefix_length) {
+    return length >= prefix_length && memcmp(s, prefix, prefix_length) == 0;
 }
 
 bool LockTracer::isConcurrentLock(const char* lock_name) {
+    // Class signature, e.g. Ljava/util/concurrent/Semaphore;
+    return lock_name[0] == 'L' && isConcurrentLock(lock_name + 1, strlen(lock_name) - 1);
+}
+
+bool LockTracer::isConcurrentLock(const char* class_name, size_t length) {
     // Do not count synchronizers other than ReentrantLock, ReentrantReadWriteLock and Semaphore
-    return strncmp(lock_name, "Ljava/util/concurrent/locks/ReentrantLock", 41) == 0 ||
-           strncmp(lock_name, "Ljava/util/concurrent/locks/ReentrantReadWriteLock", 50) == 0 ||
-           strncmp(lock_name, "Ljava/util/concurrent/Semaphore", 31) == 0;
+    return startsWith(class_name, length, "java/util/concurrent/locks/ReentrantLock", 40) ||
+           startsWith(class_name, length, "java/util/concurrent/locks/ReentrantReadWriteLock", 49) ||
+           startsWith(class_name, length, "java/util/concurrent/Semaphore", 30);
 }
 
-void LockTracer::recordContendedLock(int event_type, u64 start_time, u64 end_time,
-                                     const char* lock_name, jobject lock, jlong timeout) {
+void LockTracer::recordContendedLock(LockWaitEvent* wait) {
+    // Time is meaningless if lock attempt has started before profiling
+    if (wait->_wake_timestamp - wait->_wait_timestamp < _threshold || wait->_wait_timestamp < _start_time) {
+        return;
+    }
+
+    int event_type;
+    if (wait->_lock_type == LOCK_TYPE_MONITOR_ENTER) {
+        event_type = BCI_LOCK;
+    } else if (wait->_lock_type == LOCK_TYPE_UNSAFE_PARK && wait->_track_holder) {
+        // Do not count synchronizers other than ReentrantLock, ReentrantReadWriteLock and Semaphore
+        event_type = BCI_PARK;
+    } else {
+        return;
+    }
+
+    if (wait->_num_frames == 0) {
+        // lockstack=none
+        return;
+    }
+
     LockEvent event;
-    event._class_id = 0;
-    event._start_time = start_time;
-    event._end_time = end_time;
-    event._address = *(uintptr_t*)lock;
-    event._timeout = timeout;
-
-    if (lock_name != NULL) {
-        if (lock_name[0] == 'L') {
-            event._class_id = Profiler::instance()->classMap()->lookup(lock_name + 1, strlen(lock_name) - 2);
-        } else {
-            event._class_id = Profiler::instance()->classMap()->lookup(lock_name);
-        }
+    event._class_id = wait->_lock_class_id;
+    event._start_time = wait->_wait_timestamp;
+    event._end_time = wait->_wake_timestamp;
+    event._address = wait->_lock_object_address;
+    event._timeout = 0;
+
+    // Room for the frames the profiler may add: lock class, thread and scheduling policy
+    ASGCT_CallFrame frames[LOCK_SAMPLE_DEPTH + 3];
+    int num_frames = wait->_num_frames;
+    for (int i = 0; i < num_frames; i++) {
+        frames[i].method_id = wait->_frames[i];
+        frames[i].bci = wait->_bcis[i];
     }
 
-    u64 duration_nanos = (u64)((end_time - start_time) * _ticks_to_nanos);
-    Profiler::instance()->recordSample(NULL, duration_nanos, event_type, &event);
+    Profiler::instance()->recordExternalSample(wait->_wait_duration, &event, wait->_native_thread_id,
+                                               num_frames, frames, event_type);
 }
 
 void LockTracer::bindUnsafePark(UnsafeParkFunc entry) {
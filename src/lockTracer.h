@@ -21,6 +21,8 @@
 #include "arch.h"
 #include "engine.h"
 #include "lockRecorder.h"
+#include "spinLock.h"
+#include "vmStructs.h"
 
 enum LockEventType {
     LOCK_MONITOR_WAIT,
@@ -31,6 +33,137 @@ enum LockEventType {
     LOCK_AFTER_PARK,
 };
 
+const int LOCK_CLASS_CACHE_SIZE = 1024;
+
+// Class of park blockers by klass, so that a park neither calls GetClassSignature
+// nor hashes the class name. A hit is validated against the klass name symbol,
+// in case the klass has been unloaded and its memory reused.
+class LockClassCache {
+  private:
+    struct Entry {
+        VMKlass* volatile _klass;
+        VMSymbol* _symbol;
+        u32 _class_id;
+        bool _track_holder;
+    };
+
+    Entry _entries[LOCK_CLASS_CACHE_SIZE];
+    SpinLock _lock;
+
+    static u32 slotOf(VMKlass* klass) {
+        return (u32)(((uintptr_t)klass >> 3) * 0x9e3779b9U) % LOCK_CLASS_CACHE_SIZE;
+    }
+
+  public:
+    LockClassCache() {
+        clear();
+    }
+
+    bool lookup(VMKlass* klass, VMSymbol* symbol, u32* class_id, bool* track_holder) {
+        u32 slot = slotOf(klass);
+        for (int i = 0; i < LOCK_CLASS_CACHE_SIZE; i++) {
+            Entry* e = &_entries[(slot + i) % LOCK_CLASS_CACHE_SIZE];
+            VMKlass* current = __atomic_load_n(&e->_klass, __ATOMIC_ACQUIRE);
+            if (current == NULL) {
+                return false;
+            } else if (current == klass) {
+                if (e->_symbol != symbol) {
+                    return false;
+                }
+                *class_id = e->_class_id;
+                *track_holder = e->_track_holder;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // Fills the entry before publishing the klass, so lookups need no lock
+    void insert(VMKlass* klass, VMSymbol* symbol, u32 class_id, bool track_holder) {
+        u32 slot = slotOf(klass);
+        _lock.lock();
+        for (int i = 0; i < LOCK_CLASS_CACHE_SIZE; i++) {
+            Entry* e = &_entries[(slot + i) % LOCK_CLASS_CACHE_SIZE];
+            if (e->_klass == klass) {
+                // Reused klass memory: the entry cannot be rewritten under concurrent lookups,
+                // so this class keeps missing until the cache is cleared
+                break;
+            } else if (e->_klass == NULL) {
+                e->_symbol = symbol;
+                e->_class_id = class_id;
+                e->_track_holder = track_holder;
+                __atomic_store_n(&e->_klass, klass, __ATOMIC_RELEASE);
+                break;
+            }
+        }
+        _lock.unlock();
+    }
+
+    // Not safe against concurrent lookups; call while lock events are disabled
+    void clear() {
+        memset(_entries, 0, sizeof(_entries));
+    }
+};
+
+const int LOCK_THREAD_CACHE_SIZE = 4096;
+
+// Identity of threads seen by lock callbacks, so that a lock event neither calls GetThreadInfo,
+// which allocates and copies the thread name, nor interns the name again.
+// Entries are found by native thread ID and validated by the Java thread ID, which is never reused.
+// A renamed thread is recognized by a different name String object.
+// Each entry is a small seqlock: _tid is -1 while the entry is being written.
+class LockThreadCache {
+  private:
+    struct Entry {
+        volatile int _tid;
+        jlong _java_thread_id;
+        uintptr_t _name_oop;
+        const char* _name;
+    };
+
+    Entry _entries[LOCK_THREAD_CACHE_SIZE];
+
+  public:
+    LockThreadCache() {
+        clear();
+    }
+
+    bool lookup(int tid, jlong java_thread_id, uintptr_t name_oop, const char** name) {
+        Entry* e = &_entries[(u32)tid % LOCK_THREAD_CACHE_SIZE];
+        if (__atomic_load_n(&e->_tid, __ATOMIC_ACQUIRE) != tid) {
+            return false;
+        }
+        bool hit = e->_java_thread_id == java_thread_id && e->_name_oop == name_oop;
+        *name = e->_name;
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        // The entry may have been taken by another thread while reading it
+        return hit && __atomic_load_n(&e->_tid, __ATOMIC_RELAXED) == tid;
+    }
+
+    void insert(int tid, jlong java_thread_id, uintptr_t name_oop, const char* name) {
+        Entry* e = &_entries[(u32)tid % LOCK_THREAD_CACHE_SIZE];
+        int current = e->_tid;
+        if (current == -1 || !__sync_bool_compare_and_swap(&e->_tid, current, -1)) {
+            // Another thread with the same slot is writing it; stay uncached this time
+            return;
+        }
+        e->_java_thread_id = java_thread_id;
+        e->_name_oop = name_oop;
+        e->_name = name;
+        __atomic_store_n(&e->_tid, tid, __ATOMIC_RELEASE);
+    }
+
+    void remove(int tid) {
+        Entry* e = &_entries[(u32)tid % LOCK_THREAD_CACHE_SIZE];
+        __sync_bool_compare_and_swap(&e->_tid, tid, 0);
+    }
+
+    // Not safe against concurrent lookups; call while lock events are disabled
+    void clear() {
+        memset(_entries, 0, sizeof(_entries));
+    }
+};
+
 typedef jint (JNICALL *RegisterNativesFunc)(JNIEnv*, jclass, const JNINativeMethod*, jint);
 typedef void (JNICALL *UnsafeParkFunc)(JNIEnv*, jobject, jboolean, jlong);
 
@@ -42,6 +175,10 @@ class LockTracer : public Engine {
     static jclass _UnsafeClass;
     static jclass _LockSupport;
     static jmethodID _getBlocker;
+    static jfieldID _parkBlocker;
+    static jfieldID _threadName;
+    static LockClassCache _class_cache;
+    static LockThreadCache _thread_cache;
     static bool _initialized;
 
     static LockRecorder* _lockRecorder;
@@ -54,12 +191,15 @@ class LockTracer : public Engine {
     static UnsafeParkFunc _orig_Unsafe_park;
     static void JNICALL UnsafeParkHook(JNIEnv* env, jobject instance, jboolean isAbsolute, jlong time);
 
-    static jobject getParkBlocker(jvmtiEnv* jvmti, JNIEnv* env);
+    static jobject getParkBlocker(jvmtiEnv* jvmti, JNIEnv* env, jthread* thread);
+    static const char* getThreadName(jvmtiEnv* jvmti, JNIEnv* env, jthread thread, int native_thread_id, jlong java_thread_id);
+    static void getLockClass(jvmtiEnv* jvmti, JNIEnv* env, jobject object, u32* class_id, bool* track_holder);
     static void recordLockInfo(LockEventType event_type, jvmtiEnv* jvmti, JNIEnv* env, jthread thread, jobject object, jlong timestamp);
-    static string getStackTrace(jvmtiEnv* jvmti, jthread thread, int depth);
+    // Captures up to depth jmethodIDs of the thread's stack without symbolizing them
+    static u32 getStackTrace(jvmtiEnv* jvmti, jthread thread, jmethodID* methods, jint* bcis, int depth);
     static bool isConcurrentLock(const char* lock_name);
-    static void recordContendedLock(int event_type, u64 start_time, u64 end_time,
-                                    const char* lock_name, jobject lock, jlong timeout);
+    static bool isConcurrentLock(const char* class_name, size_t length);
+    static void recordContendedLock(LockWaitEvent* wait);
     static void bindUnsafePark(UnsafeParkFunc entry);
   public:
     const char* title() {
@@ -73,6 +213,11 @@ class LockTracer : public Engine {
     Error start(Arguments& args);
     void stop();
 
+    // Called on ThreadEnd, before the native thread ID can be reused
+    static void forgetThread(int tid) {
+        _thread_cache.remove(tid);
+    }
+
     static void JNICALL MonitorWait(jvmtiEnv* jvmti, JNIEnv* env, jthread thread, jobject object, jlong timeout);
     static void JNICALL MonitorWaited(jvmtiEnv* jvmti, JNIEnv* env, jthread thread, jobject object, jboolean timed_out);
     static void JNICALL MonitorContendedEnter(jvmtiEnv* jvmti, JNIEnv* env, jthread thread, jobject object);
@@ -0,0 +1,213 @@
+/*
+ * Copyright 2022 The Kindling Authors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include <stdio.h>
+#include <string.h>
+#include "methodCache.h"
+#include "os.h"
+
+
+static const u32 METHOD_CACHE_CAPACITY = 4096;
+static const size_t METHOD_NAME_CHUNK_SIZE = 256 * 1024;
+
+
+MethodCache::MethodCache() : _lock(), _table(NULL), _capacity(0), _size(0), _names(NULL) {
+}
+
+MethodCache::~MethodCache() {
+    clear();
+}
+
+MethodCacheEntry* MethodCache::allocateTable(u32 capacity) {
+    // Anonymous mmap is zeroed, i.e. all slots are free
+    return (MethodCacheEntry*)OS::safeAlloc(capacity * sizeof(MethodCacheEntry));
+}
+
+void MethodCache::freeTable(MethodCacheEntry* table, u32 capacity) {
+    if (table != NULL) {
+        OS::safeFree(table, capacity * sizeof(MethodCacheEntry));
+    }
+}
+
+bool MethodCache::put(MethodCacheEntry* table, u32 capacity, jmethodID method, const char* name, unsigned char epoch) {
+    u32 mask = capacity - 1;
+    u32 slot = hash(method) & mask;
+
+    for (u32 step = 0; step < capacity; step++) {
+        MethodCacheEntry* e = &table[slot];
+        jmethodID current = e->method;
+        if (current == NULL) {
+            if (__sync_bool_compare_and_swap(&e->method, NULL, method)) {
+                e->epoch = epoch;
+                __atomic_store_n(&e->name, name, __ATOMIC_RELEASE);
+                return true;
+            }
+            current = e->method;
+        }
+        if (current == method) {
+            // Another thread has cached the same method
+            return false;
+        }
+        slot = (slot + 1) & mask;
+    }
+
+    return false;
+}
+
+bool MethodCache::lookup(jmethodID method, unsigned char epoch, char* buf, size_t size, const char* suffix) {
+    _lock.lockShared();
+
+    if (_table != NULL) {
+        u32 mask = _capacity - 1;
+        u32 slot = hash(method) & mask;
+
+        for (u32 step = 0; step < _capacity; step++) {
+            MethodCacheEntry* e = &_table[slot];
+            jmethodID current = e->method;
+            if (current == NULL) {
+                break;
+            }
+            if (current == method) {
+                const char* name = __atomic_load_n(&e->name, __ATOMIC_ACQUIRE);
+                if (name == NULL) {
+                    // Claimed, but not yet published
+                    break;
+                }
+                // All concurrent users belong to the same epoch, so they store the same byte
+                if (e->epoch != epoch) {
+                    e->epoch = epoch;
+                }
+                // Copy out under the lock: the entry may be evicted right after
+                snprintf(buf, size, "%s%s", name, suffix != NULL ? suffix : "");
+                _lock.unlockShared();
+                return true;
+            }
+            slot = (slot + 1) & mask;
+        }
+    }
+
+    _lock.unlockShared();
+    return false;
+}
+
+void MethodCache::insert(jmethodID method, const char* name, unsigned char epoch) {
+    // Keep the load factor under 3/4, so that probe sequences stay short
+    while (true) {
+        _lock.lockShared();
+        if (_table != NULL && _size < _capacity - _capacity / 4) {
+            break;
+        }
+        _lock.unlockShared();
+
+        _lock.lock();
+        bool grown = true;
+        if (_table == NULL) {
+            _names = new LinearAllocator(METHOD_NAME_CHUNK_SIZE);
+            grown = rebuild(METHOD_CACHE_CAPACITY, _names, 0, 0);
+        } else if (_size >= _capacity - _capacity / 4) {
+            grown = rebuild(_capacity * 2, _names, 0, 0);
+        }
+        _lock.unlock();
+
+        if (!grown) {
+            // Not enough memory; the name is simply not cached
+            return;
+        }
+    }
+
+    size_t length = strlen(name) + 1;
+    char* copy = (char*)_names->alloc(length);
+    if (copy != NULL) {
+        memcpy(copy, name, length);
+        if (put(_table, _capacity, method, copy, epoch)) {
+            __sync_fetch_and_add(&_size, 1);
+        }
+    }
+
+    _lock.unlockShared();
+}
+
+// Must be called under the exclusive lock.
+// When names differs from the current arena, surviving names are copied into it
+bool MethodCache::rebuild(u32 capacity, LinearAllocator* names, unsigned char epoch, unsigned char max_age) {
+    MethodCacheEntry* table = allocateTable(capacity);
+    if (table == NULL) {
+        return false;
+    }
+
+    u32 size = 0;
+    for (u32 i = 0; i < _capacity; i++) {
+        MethodCacheEntry* e = &_table[i];
+        const char* name = e->name;
+        if (name == NULL) {
+            continue;
+        }
+        if (max_age != 0 && (unsigned char)(epoch - e->epoch) >= max_age) {
+            continue;
+        }
+        if (names != _names) {
+            size_t length = strlen(name) + 1;
+            char* copy = (char*)names->alloc(length);
+            if (copy == NULL) {
+                continue;
+            }
+            memcpy(copy, name, length);
+            name = copy;
+        }
+        if (put(table, capacity, e->method, name, e->epoch)) {
+            size++;
+        }
+    }
+
+    freeTable(_table, _capacity);
+    if (names != _names) {
+        delete _names;
+        _names = names;
+    }
+    _table = table;
+    _capacity = capacity;
+    _size = size;
+    return true;
+}
+
+void MethodCache::clear() {
+    _lock.lock();
+    freeTable(_table, _capacity);
+    delete _names;
+    _table = NULL;
+    _capacity = 0;
+    _size = 0;
+    _names = NULL;
+    _lock.unlock();
+}
+
+void MethodCache::evict(unsigned char epoch, unsigned char max_age) {
+    if (max_age == 0) {
+        clear();
+        return;
+    }
+
+    _lock.lock();
+    if (_table != NULL) {
+        // Stale names are dropped together with the old arena
+        LinearAllocator* names = new LinearAllocator(METHOD_NAME_CHUNK_SIZE);
+        if (!rebuild(_capacity, names, epoch, max_age)) {
+            delete names;
+        }
+    }
+    _lock.unlock();
+}
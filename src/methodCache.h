@@ -0,0 +1,81 @@
+/*
+ * Copyright 2022 The Kindling Authors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _METHODCACHE_H
+#define _METHODCACHE_H
+
+#include <jvmti.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "arch.h"
+#include "linearAllocator.h"
+#include "spinLock.h"
+
+
+struct MethodCacheEntry {
+    jmethodID volatile method;
+    const char* volatile name;
+    volatile unsigned char epoch;
+};
+
+// Concurrent jmethodID -> method name cache shared by all FrameName instances.
+//
+// Open addressing with linear probing over a flat array of entries; names live in an arena.
+// Lookups and inserts run in parallel under the shared side of the lock: an insert claims
+// a free slot with CAS on method and publishes name last, so a reader never sees half an entry.
+// Growing the table and evicting stale entries rebuild it under the exclusive side.
+// Every hit stamps the entry with the epoch (profiling session) of the caller;
+// entries not touched for max_age sessions are evicted at the end of a session.
+class MethodCache {
+  private:
+    SpinLock _lock;
+    MethodCacheEntry* _table;
+    u32 _capacity;
+    volatile u32 _size;
+    LinearAllocator* _names;
+
+    static u32 hash(jmethodID method) {
+        u64 h = (u64)(uintptr_t)method * 0x9e3779b97f4a7c15ULL;
+        return (u32)(h >> 32);
+    }
+
+    static MethodCacheEntry* allocateTable(u32 capacity);
+    static void freeTable(MethodCacheEntry* table, u32 capacity);
+
+    static bool put(MethodCacheEntry* table, u32 capacity, jmethodID method, const char* name, unsigned char epoch);
+
+    bool rebuild(u32 capacity, LinearAllocator* names, unsigned char epoch, unsigned char max_age);
+
+  public:
+    MethodCache();
+    ~MethodCache();
+
+    // On hit, copies the cached name followed by suffix into buf
+    bool lookup(jmethodID method, unsigned char epoch, char* buf, size_t size, const char* suffix);
+
+    void insert(jmethodID method, const char* name, unsigned char epoch);
+
+    void clear();
+
+    // Removes entries that have not been used during the last max_age epochs
+    void evict(unsigned char epoch, unsigned char max_age);
+
+    u32 size() {
+        return _size;
+    }
+};
+
+#endif // _METHODCACHE_H
@@ -28,6 +28,10 @@ void Mutex::lock() {
     pthread_mutex_lock(&_mutex);
 }
 
+bool Mutex::tryLock() {
+    return pthread_mutex_trylock(&_mutex) == 0;
+}
+
 void Mutex::unlock() {
     pthread_mutex_unlock(&_mutex);
 }
@@ -29,6 +29,7 @@ class Mutex {
     Mutex();
 
     void lock();
+    bool tryLock();
     void unlock();
 };
 
@@ -43,8 +43,11 @@
 #include "stackFrame.h"
 #include "stackWalker.h"
 #include "symbols.h"
+#include "tsc.h"
 #include "vmStructs.h"
+#include "timeUtil.h"
 #include "eventLogger.h"
+#include "threadNameHooks.h"
 
 
 // The instance is not deleted on purpose, since profiler structures
@@ -146,6 +149,10 @@ void Profiler::onThreadEnd(jvmtiEnv* jvmti, JNIEnv* jni, jthread thread) {
     if (_thread_filter.enabled()) {
         _thread_filter.remove(OS::threadId());
     }
+    if (_event_mask & EM_LOCK) {
+        LockTracer::forgetThread(OS::threadId());
+    }
+    _calltrace_buffers.forget(OS::threadId());
     updateThreadName(jvmti, jni, thread);
 }
 
@@ -572,12 +579,9 @@ void Profiler::fillFrameTypes(ASGCT_CallFrame* frames, int num_frames, NMethod*
 
 void Profiler::printSample(void* ucontext, u64 counter) {
     int tid = OS::threadId();
-    u32 lock_index = getLockIndex(tid);
-    if (!_locks[lock_index].tryLock() &&
-        !_locks[lock_index = (lock_index + 1) % CONCURRENCY_LEVEL].tryLock() &&
-        !_locks[lock_index = (lock_index + 2) % CONCURRENCY_LEVEL].tryLock())
-    {
-        // Too many concurrent signals already
+    ThreadTraceBuffer* buffer = _calltrace_buffers.acquire(tid);
+    if (buffer == NULL) {
+        // The signal interrupted another sample of the same thread
         atomicInc(_failures[-ticks_skipped]);
 
         if (_engine == &perf_events) {
@@ -587,8 +591,7 @@ void Profiler::printSample(void* ucontext, u64 counter) {
         return;
     }
 
-    ASGCT_CallFrame* frames = _calltrace_buffer[lock_index]->_asgct_frames;
-    jvmtiFrameInfo* jvmti_frames = _calltrace_buffer[lock_index]->_jvmti_frames;
+    ASGCT_CallFrame* frames = buffer->_trace._asgct_frames;
 
     int num_frames = 0;
     StackContext java_ctx = {0};
@@ -605,13 +608,13 @@ void Profiler::printSample(void* ucontext, u64 counter) {
     num_frames += java_frames;
 
     if (num_frames > 0) {
-        printCallTrace(tid, num_frames, frames);
+        printCallTrace(tid, num_frames, frames, counter);
     }
 
-    _locks[lock_index].unlock();
+    _calltrace_buffers.release(buffer);
 }
 
-void Profiler::printCallTrace(int tid, int num_frames, ASGCT_CallFrame* frames) {
+void Profiler::printCallTrace(int tid, int num_frames, ASGCT_CallFrame* frames, u64 counter) {
     int max_frame = _max_stack_depth;
     if (max_frame > num_frames) {
         max_frame = num_frames;
@@ -621,23 +624,22 @@ void Profiler::printCallTrace(int tid, int num_frames, ASGCT_CallFrame* frames)
     //     // Ignore GC Threads
     //     return;
     // }
-    storeCallTrace(tid, max_frame, frames);
+    storeCallTrace(tid, max_frame, frames, counter);
 }
 
-void Profiler::storeCallTrace(int tid, int num_frames, ASGCT_CallFrame* frames) {
-    _frameCache.add(tid, num_frames, frames);
+void Profiler::storeCallTrace(int tid, int num_frames, ASGCT_CallFrame* frames, u64 counter) {
+    // Frames are stored once per unique stack, the event only carries the call trace ID
+    u32 call_trace_id = _call_trace_storage.put(num_frames, frames, counter);
+    _frameCache.add(tid, call_trace_id);
 }
 
 void Profiler::recordSample(void* ucontext, u64 counter, jint event_type, Event* event) {
     atomicInc(_total_samples);
 
     int tid = OS::threadId();
-    u32 lock_index = getLockIndex(tid);
-    if (!_locks[lock_index].tryLock() &&
-        !_locks[lock_index = (lock_index + 1) % CONCURRENCY_LEVEL].tryLock() &&
-        !_locks[lock_index = (lock_index + 2) % CONCURRENCY_LEVEL].tryLock())
-    {
-        // Too many concurrent signals already
+    ThreadTraceBuffer* buffer = _calltrace_buffers.acquire(tid);
+    if (buffer == NULL) {
+        // The signal interrupted another sample of the same thread
         atomicInc(_failures[-ticks_skipped]);
 
         if (event_type == 0 && _engine == &perf_events) {
@@ -647,8 +649,8 @@ void Profiler::recordSample(void* ucontext, u64 counter, jint event_type, Event*
         return;
     }
 
-    ASGCT_CallFrame* frames = _calltrace_buffer[lock_index]->_asgct_frames;
-    jvmtiFrameInfo* jvmti_frames = _calltrace_buffer[lock_index]->_jvmti_frames;
+    ASGCT_CallFrame* frames = buffer->_trace._asgct_frames;
+    jvmtiFrameInfo* jvmti_frames = buffer->_trace._jvmti_frames;
 
     int num_frames = 0;
     if (_add_event_frame && event_type <= BCI_ALLOC && event_type >= BCI_PARK && event->id()) {
@@ -693,30 +695,24 @@ void Profiler::recordSample(void* ucontext, u64 counter, jint event_type, Event*
     }
 
     u32 call_trace_id = _call_trace_storage.put(num_frames, frames, counter);
-    _jfr.recordEvent(lock_index, tid, call_trace_id, event_type, event, counter);
+    _calltrace_buffers.release(buffer);
 
-    _locks[lock_index].unlock();
+    recordJfrEvent(tid, call_trace_id, event_type, event, counter);
 }
 
-void Profiler::printExternalSample(int tid, int num_frames, ASGCT_CallFrame* frames) {
-    u32 lock_index = getLockIndex(tid);
-    if (!_locks[lock_index].tryLock() &&
-        !_locks[lock_index = (lock_index + 1) % CONCURRENCY_LEVEL].tryLock() &&
-        !_locks[lock_index = (lock_index + 2) % CONCURRENCY_LEVEL].tryLock())
-    {
-        // Too many concurrent signals already
-        atomicInc(_failures[-ticks_skipped]);
-        return;
-    }
-
-    printCallTrace(tid, num_frames, frames);
-
-    _locks[lock_index].unlock();
+void Profiler::printExternalSample(u64 counter, int tid, int num_frames, ASGCT_CallFrame* frames) {
+    printCallTrace(tid, num_frames, frames, counter);
 }
 
-void Profiler::recordExternalSample(u64 counter, Event* event, int tid, int num_frames, ASGCT_CallFrame* frames) {
+// frames must have room for 3 more frames
+void Profiler::recordExternalSample(u64 counter, Event* event, int tid, int num_frames, ASGCT_CallFrame* frames, jint event_type) {
     atomicInc(_total_samples);
 
+    if (_add_event_frame && event_type <= BCI_ALLOC && event_type >= BCI_PARK && event->id()) {
+        memmove(frames + 1, frames, num_frames * sizeof(ASGCT_CallFrame));
+        num_frames += makeFrame(frames, event_type, event->id());
+    }
+
     if (_add_thread_frame) {
         num_frames += makeFrame(frames + num_frames, BCI_THREAD_ID, tid);
     }
@@ -725,6 +721,14 @@ void Profiler::recordExternalSample(u64 counter, Event* event, int tid, int num_
     }
 
     u32 call_trace_id = _call_trace_storage.put(num_frames, frames, counter);
+    recordJfrEvent(tid, call_trace_id, event_type, event, counter);
+}
+
+// Only the short JFR write is serialized; the call trace is already stored by then
+void Profiler::recordJfrEvent(int tid, u32 call_trace_id, jint event_type, Event* event, u64 counter) {
+    if (!_jfr.active()) {
+        return;
+    }
 
     u32 lock_index = getLockIndex(tid);
     if (!_locks[lock_index].tryLock() &&
@@ -736,7 +740,7 @@ void Profiler::recordExternalSample(u64 counter, Event* event, int tid, int num_
         return;
     }
 
-    _jfr.recordEvent(lock_index, tid, call_trace_id, 0, event, counter);
+    _jfr.recordEvent(lock_index, tid, call_trace_id, event_type, event, counter);
 
     _locks[lock_index].unlock();
 }
@@ -753,6 +757,7 @@ void* Profiler::dlopen_hook(const char* filename, int flags) {
     void* result = dlopen(filename, flags);
     if (result != NULL) {
         instance()->updateSymbols(false);
+        ThreadNameHooks::update(instance()->_native_libs);
     }
     return result;
 }
@@ -841,11 +846,11 @@ void Profiler::setupSignalHandlers() {
     }
 }
 
-void Profiler::setThreadInfo(int tid, const char* name, jlong java_thread_id) {
-    MutexLocker ml(_thread_names_lock);
-    _thread_names[tid] = name;
-    _java_thread_names[tid] = name;
-    _thread_ids[tid] = java_thread_id;
+// Java threads keep their Java name; kd-tm is emitted only for a new or changed native name
+void Profiler::setNativeThreadName(int tid, const char* name) {
+    if (_thread_info.setNativeThread(tid, name)) {
+        EventLogger::logThreadName(tid, name);
+    }
 }
 
 void Profiler::updateThreadName(jvmtiEnv* jvmti, JNIEnv* jni, jthread thread) {
@@ -855,15 +860,16 @@ void Profiler::updateThreadName(jvmtiEnv* jvmti, JNIEnv* jni, jthread thread) {
         int native_thread_id = VMThread::nativeThreadId(jni, thread);
         if (native_thread_id >= 0 && jvmti->GetThreadInfo(thread, &thread_info) == 0) {
             jlong java_thread_id = VMThread::javaThreadId(jni, thread);
-            setThreadInfo(native_thread_id, thread_info.name, java_thread_id);
-            EventLogger::log("kd-tm@%d!%s!", native_thread_id, thread_info.name);
-            // printf("Update java thread name [%s] for tid [%d]\n", thread_info.name, native_thread_id);
+            if (_thread_info.setJavaThread(native_thread_id, thread_info.name, java_thread_id)) {
+                EventLogger::logThreadName(native_thread_id, thread_info.name);
+            }
             jvmti->Deallocate((unsigned char*)thread_info.name);
         }
     }
 }
 
-void Profiler::updateJavaThreadNames() {
+// With native_thread_ids, only the names of these threads are fetched
+void Profiler::updateJavaThreadNames(std::set<int>* native_thread_ids) {
     if (_update_thread_names) {
         jvmtiEnv* jvmti = VM::jvmti();
         jint thread_count;
@@ -874,34 +880,74 @@ void Profiler::updateJavaThreadNames() {
 
         JNIEnv* jni = VM::jni();
         for (int i = 0; i < thread_count; i++) {
-            updateThreadName(jvmti, jni, thread_objects[i]);
+            if (native_thread_ids == NULL ||
+                native_thread_ids->count(VMThread::nativeThreadId(jni, thread_objects[i])) > 0) {
+                updateThreadName(jvmti, jni, thread_objects[i]);
+            }
         }
 
         jvmti->Deallocate((unsigned char*)thread_objects);
     }
 }
 
+// Thread.setName() replaces the String, so a thread whose name field still holds the String
+// seen last time has not been renamed, and GetThreadInfo is called only for the others.
+// A GC moving the String only costs one more lookup
+void Profiler::reconcileJavaThreadNames() {
+    if (!_update_thread_names) {
+        return;
+    }
+
+    jvmtiEnv* jvmti = VM::jvmti();
+    JNIEnv* jni = VM::jni();
+    if (_thread_name_field == NULL) {
+        jclass thread_class = jni->FindClass("java/lang/Thread");
+        if (thread_class == NULL || (_thread_name_field = jni->GetFieldID(thread_class, "name", "Ljava/lang/String;")) == NULL) {
+            jni->ExceptionClear();
+            return;
+        }
+    }
+
+    jint thread_count;
+    jthread* thread_objects;
+    if (jvmti->GetAllThreads(&thread_count, &thread_objects) != 0) {
+        return;
+    }
+
+    // Rebuilt every time, so that ended threads drop out
+    std::map<int, uintptr_t> name_oops;
+    for (int i = 0; i < thread_count; i++) {
+        int native_thread_id = VMThread::nativeThreadId(jni, thread_objects[i]);
+        if (native_thread_id >= 0) {
+            uintptr_t name_oop = 0;
+            jobject name = jni->GetObjectField(thread_objects[i], _thread_name_field);
+            if (name != NULL) {
+                name_oop = *(uintptr_t*)name;
+                jni->DeleteLocalRef(name);
+            }
+
+            std::map<int, uintptr_t>::const_iterator it = _java_thread_name_oops.find(native_thread_id);
+            if (it == _java_thread_name_oops.end() || it->second != name_oop || name_oop == 0) {
+                updateThreadName(jvmti, jni, thread_objects[i]);
+            }
+            name_oops[native_thread_id] = name_oop;
+        }
+        // This thread stays attached, so its local references would pile up otherwise
+        jni->DeleteLocalRef(thread_objects[i]);
+    }
+
+    jvmti->Deallocate((unsigned char*)thread_objects);
+    _java_thread_name_oops.swap(name_oops);
+}
+
 void Profiler::updateNativeThreadNames() {
     if (_update_thread_names) {
         ThreadList* thread_list = OS::listThreads();
         char name_buf[64];
 
         for (int tid; (tid = thread_list->next()) != -1; ) {
-            MutexLocker ml(_thread_names_lock);
-            bool ok = OS::threadName(tid, name_buf, sizeof(name_buf));
-            std::map<int, std::string>::iterator java_it = _java_thread_names.lower_bound(tid);
-            if (java_it == _java_thread_names.end() || java_it->first != tid) {
-                if (ok) {
-                    EventLogger::log("kd-tm@%d!%s!", tid, name_buf);
-                    // printf("Update native thread name [%s] for tid [%d]\n", name_buf, tid);
-                }
-            }
-            
-            std::map<int, std::string>::iterator it = _thread_names.lower_bound(tid);
-            if (it == _thread_names.end() || it->first != tid) {
-                if (ok) {
-                    _thread_names.insert(it, std::map<int, std::string>::value_type(tid, name_buf));
-                }
+            if (OS::threadName(tid, name_buf, sizeof(name_buf))) {
+                setNativeThreadName(tid, name_buf);
             }
         }
 
@@ -909,6 +955,30 @@ void Profiler::updateNativeThreadNames() {
     }
 }
 
+void Profiler::updateRenamedThreadNames() {
+    std::vector<PendingThreadName> renamed;
+    if (ThreadNameHooks::drain(renamed)) {
+        updateJavaThreadNames();
+        updateNativeThreadNames();
+        return;
+    }
+
+    // A renamed Java thread is looked up again, since its native name is truncated
+    std::set<int> java_thread_ids;
+    for (size_t i = 0; i < renamed.size(); i++) {
+        int tid = renamed[i]._tid;
+        if (_thread_info.isJavaThread(tid)) {
+            java_thread_ids.insert(tid);
+        } else {
+            setNativeThreadName(tid, renamed[i]._name);
+        }
+    }
+
+    if (!java_thread_ids.empty()) {
+        updateJavaThreadNames(&java_thread_ids);
+    }
+}
+
 bool Profiler::excludeTrace(FrameName* fn, CallTrace* trace) {
     bool checkInclude = fn->hasIncludeList();
     bool checkExclude = fn->hasExcludeList();
@@ -1025,6 +1095,8 @@ Error Profiler::start(Arguments& args, bool reset) {
         lockAll();
         _class_map.clear();
         _thread_filter.clear();
+        _call_trace_storage.setBudget(args._trace_mem);
+        _call_trace_storage.setTree(args._trace_tree);
         _call_trace_storage.clear();
         // Make sure frame structure is consistent throughout the entire recording
         _add_event_frame = args._output != OUTPUT_JFR;
@@ -1033,33 +1105,32 @@ Error Profiler::start(Arguments& args, bool reset) {
         unlockAll();
 
         // Reset thread names and IDs
-        MutexLocker ml(_thread_names_lock);
-        _thread_names.clear();
-        _java_thread_names.clear();
-        _thread_ids.clear();
-    }
-
-    // (Re-)allocate calltrace buffers
-    if (_max_stack_depth != args._jstackdepth) {
-        _max_stack_depth = args._jstackdepth;
-        size_t buffer_size = (_max_stack_depth + MAX_NATIVE_FRAMES + RESERVED_FRAMES) * sizeof(CallTraceBuffer);
-
-        for (int i = 0; i < CONCURRENCY_LEVEL; i++) {
-            free(_calltrace_buffer[i]);
-            _calltrace_buffer[i] = (CallTraceBuffer*)malloc(buffer_size);
-            if (_calltrace_buffer[i] == NULL) {
-                _max_stack_depth = 0;
-                return Error("Not enough memory to allocate stack trace buffers (try smaller jstackdepth)");
-            }
-        }
+        _thread_info.clear();
     }
 
+    // Calltrace buffers of the previous session are kept unless the stack depth has changed
+    _max_stack_depth = args._jstackdepth;
+    _calltrace_buffers.reset(_max_stack_depth + MAX_NATIVE_FRAMES + RESERVED_FRAMES);
+
     _safe_mode = args._safe_mode;
     if (VM::hotspot_version() < 8) {
         _safe_mode |= GC_TRACES | LAST_JAVA_PC;
     }
 
+    // CPU samples and lock events are timestamped with raw TSC ticks
+    if (!TSC::initialized()) {
+        TSC::initialize();
+    }
+    TicksClock::calibrate();
+
     EventLogger::open("/dev/null");
+    EventLogger::setBinary(args._kd_format == KD_FORMAT_BINARY);
+    if (args._kd_shm == NULL || !EventLogger::openShm(args._kd_shm, args._kd_shm_size)) {
+        // Lock records are logged by the thread that has just got the lock, which must not
+        // wait on disk I/O: with lock events records are batched even without kdflush
+        long flush_interval = args._kd_flush > 0 || !(_event_mask & EM_LOCK) ? args._kd_flush : DEFAULT_LOCK_FLUSH_INTERVAL;
+        EventLogger::startWriter(flush_interval, args._kd_buffer);
+    }
     _update_thread_names = args._threads || args._output == OUTPUT_JFR;
     _thread_filter.init(args._filter);
     _update_thread_names_task = new UpdateThreadNamesTask(this);
@@ -1099,7 +1170,7 @@ Error Profiler::start(Arguments& args, bool reset) {
     }
 
     _epoch++;
-    _frameName = new FrameName(args, args._style, _epoch, _thread_names_lock, _thread_names);
+    _frameName = new FrameName(args, args._style, _epoch, _thread_info);
     error = _engine->start(args);
     if (error) {
         goto error1;
@@ -1119,10 +1190,22 @@ Error Profiler::start(Arguments& args, bool reset) {
         }
     }
     if (_event_mask & EM_CPU) {
-        _frameCache.startCollectThreadTask(_frameName, args._interval ? args._interval : DEFAULT_INTERVAL);
+        _frameCache.startCollectThreadTask(_frameName, args._interval ? args._interval : DEFAULT_INTERVAL, args);
     }
 
     switchThreadEvents(JVMTI_ENABLE);
+    if (_update_thread_names) {
+        ThreadNameHooks::install(_native_libs);
+    }
+
+    // JFR refers to call traces by ID until the chunk's stack trace pool is written,
+    // so with JFR output traces are evicted only when a chunk is finished, see flushJfr()
+    if (_call_trace_storage.budget() != 0 && args._output != OUTPUT_JFR) {
+        _evict_call_traces_task = new EvictCallTracesTask(this);
+        _evict_call_traces_thread = std::thread([&]{
+            _evict_call_traces_task->run();
+        });
+    }
 
     _state = RUNNING;
     _start_time = time(NULL);
@@ -1168,6 +1251,7 @@ Error Profiler::stop() {
 
     switchLibraryTrap(false);
     switchThreadEvents(JVMTI_DISABLE);
+    ThreadNameHooks::uninstall();
     updateJavaThreadNames();
     updateNativeThreadNames();
 
@@ -1175,6 +1259,13 @@ Error Profiler::stop() {
     _update_thread_names_thread.join();
     delete _update_thread_names_task;
 
+    if (_evict_call_traces_task != NULL) {
+        _evict_call_traces_task->stop();
+        _evict_call_traces_thread.join();
+        delete _evict_call_traces_task;
+        _evict_call_traces_task = NULL;
+    }
+
     // Make sure no periodic events sent after JFR stops
     stopTimer();
 
@@ -1183,6 +1274,8 @@ Error Profiler::stop() {
     _jfr.stop();
     unlockAll();
 
+    _calltrace_buffers.releaseRetired();
+
     delete _frameName;
     EventLogger::close();
     FdTransferClient::closePeer();
@@ -1226,6 +1319,9 @@ Error Profiler::flushJfr() {
     _jfr.flush();
     unlockAll();
 
+    // The IDs of the finished chunk have all been written out, so traces can be compacted now
+    _call_trace_storage.evict();
+
     return Error::OK;
 }
 
@@ -1258,6 +1354,7 @@ Error Profiler::dump(std::ostream& out, Arguments& args) {
                 lockAll();
                 _jfr.flush();
                 unlockAll();
+                _call_trace_storage.evict();
             }
             break;
         default:
@@ -1290,7 +1387,7 @@ void Profiler::switchThreadEvents(jvmtiEventMode mode) {
  * <frame>;<frame>;...;<topmost frame> <count>
  */
 void Profiler::dumpCollapsed(std::ostream& out, Arguments& args) {
-    FrameName fn(args, args._style, _epoch, _thread_names_lock, _thread_names);
+    FrameName fn(args, args._style, _epoch, _thread_info);
     char buf[32];
 
     std::vector<CallTraceSample*> samples;
@@ -1328,7 +1425,7 @@ void Profiler::dumpFlameGraph(std::ostream& out, Arguments& args, bool tree) {
     }
 
     FlameGraph flamegraph(args._title == NULL ? title : args._title, args._counter, args._minwidth, args._reverse);
-    FrameName fn(args, args._style & ~STYLE_ANNOTATE, _epoch, _thread_names_lock, _thread_names);
+    FrameName fn(args, args._style & ~STYLE_ANNOTATE, _epoch, _thread_info);
 
     std::vector<CallTraceSample*> samples;
     _call_trace_storage.collectSamples(samples);
@@ -1373,7 +1470,7 @@ void Profiler::dumpFlameGraph(std::ostream& out, Arguments& args, bool tree) {
 }
 
 void Profiler::dumpText(std::ostream& out, Arguments& args) {
-    FrameName fn(args, args._style | STYLE_DOTTED, _epoch, _thread_names_lock, _thread_names);
+    FrameName fn(args, args._style | STYLE_DOTTED, _epoch, _thread_info);
     char buf[1024] = {0};
 
     std::vector<CallTraceSample> samples;
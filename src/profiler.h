@@ -19,9 +19,11 @@
 
 #include <iostream>
 #include <map>
+#include <set>
 #include <time.h>
 #include "arch.h"
 #include "arguments.h"
+#include "callTraceBuffer.h"
 #include "callTraceStorage.h"
 #include "codeCache.h"
 #include "dictionary.h"
@@ -32,6 +34,7 @@
 #include "mutex.h"
 #include "spinLock.h"
 #include "threadFilter.h"
+#include "threadInfo.h"
 #include "trap.h"
 #include "vmEntry.h"
 #include "frameEventCache.h"
@@ -47,17 +50,12 @@ const int RESERVED_FRAMES   = 4;
 const int CONCURRENCY_LEVEL = 16;
 
 
-union CallTraceBuffer {
-    ASGCT_CallFrame _asgct_frames[1];
-    jvmtiFrameInfo _jvmti_frames[1];
-};
-
-
 class FrameName;
 class NMethod;
 class StackContext;
 
 class UpdateThreadNamesTask;
+class EvictCallTracesTask;
 
 enum State {
     NEW,
@@ -72,11 +70,7 @@ class Profiler {
     State _state;
     Trap _begin_trap;
     Trap _end_trap;
-    Mutex _thread_names_lock;
-    // TODO: single map?
-    std::map<int, std::string> _thread_names;
-    std::map<int, std::string> _java_thread_names;
-    std::map<int, jlong> _thread_ids;
+    ThreadInfoTable _thread_info;
     Dictionary _class_map;
     Dictionary _symbol_map;
     ThreadFilter _thread_filter;
@@ -97,8 +91,9 @@ class Profiler {
     u64 _total_samples;
     u64 _failures[ASGCT_FAILURE_TYPES];
 
+    // Guard JFR recording buffers only; stacks are walked in per-thread buffers
     SpinLock _locks[CONCURRENCY_LEVEL];
-    CallTraceBuffer* _calltrace_buffer[CONCURRENCY_LEVEL];
+    CallTraceBufferTable _calltrace_buffers;
     int _max_stack_depth;
     int _safe_mode;
     CStack _cstack;
@@ -117,6 +112,11 @@ class Profiler {
     // Update threads names task
     std::thread _update_thread_names_thread;
     UpdateThreadNamesTask* _update_thread_names_task;
+    // Thread.name and the String each Java thread had at the last reconciliation, by native thread ID
+    jfieldID _thread_name_field;
+    std::map<int, uintptr_t> _java_thread_name_oops;
+    std::thread _evict_call_traces_thread;
+    EvictCallTracesTask* _evict_call_traces_task;
 
     // dlopen() hook support
     void** _dlopen_entry;
@@ -134,6 +134,7 @@ class Profiler {
 
     const char* asgctError(int code);
     u32 getLockIndex(int tid);
+    void recordJfrEvent(int tid, u32 call_trace_id, jint event_type, Event* event, u64 counter);
     bool isAddressInCode(uintptr_t addr);
     int getNativeTrace(void* ucontext, ASGCT_CallFrame* frames, int event_type, int tid, StackContext* java_ctx);
     int getJavaTraceAsync(void* ucontext, ASGCT_CallFrame* frames, int max_depth, StackContext* java_ctx);
@@ -141,10 +142,12 @@ class Profiler {
     int getJavaTraceInternal(jvmtiFrameInfo* jvmti_frames, ASGCT_CallFrame* frames, int max_depth);
     int convertFrames(jvmtiFrameInfo* jvmti_frames, ASGCT_CallFrame* frames, int num_frames);
     void fillFrameTypes(ASGCT_CallFrame* frames, int num_frames, NMethod* nmethod);
-    void setThreadInfo(int tid, const char* name, jlong java_thread_id);
+    void setNativeThreadName(int tid, const char* name);
     void updateThreadName(jvmtiEnv* jvmti, JNIEnv* jni, jthread thread);
-    void updateJavaThreadNames();
+    void updateJavaThreadNames(std::set<int>* native_thread_ids = NULL);
     void updateNativeThreadNames();
+    void updateRenamedThreadNames();
+    void reconcileJavaThreadNames();
     bool excludeTrace(FrameName* fn, CallTrace* trace);
     void mangle(const char* name, char* buf, size_t size);
     Engine* selectEngine(const char* event_name);
@@ -175,7 +178,7 @@ class Profiler {
         _thread_filter(),
         _call_trace_storage(),
         _jfr(),
-        _frameCache(),
+        _frameCache(&_call_trace_storage),
         _start_time(0),
         _epoch(0),
         _timer_id(NULL),
@@ -187,11 +190,9 @@ class Profiler {
         _native_libs(),
         _call_stub_begin(NULL),
         _call_stub_end(NULL),
+        _thread_name_field(NULL),
+        _evict_call_traces_task(NULL),
         _dlopen_entry(NULL) {
-
-        for (int i = 0; i < CONCURRENCY_LEVEL; i++) {
-            _calltrace_buffer[i] = NULL;
-        }
     }
 
     static Profiler* instance() {
@@ -217,10 +218,10 @@ class Profiler {
     int convertNativeTrace(int native_frames, const void** callchain, ASGCT_CallFrame* frames);
     void recordSample(void* ucontext, u64 counter, jint event_type, Event* event);
     void printSample(void* ucontext, u64 counter);
-    void recordExternalSample(u64 counter, Event* event, int tid, int num_frames, ASGCT_CallFrame* frames);
-    void printExternalSample(int tid, int num_frames, ASGCT_CallFrame* frames);
-    void printCallTrace(int tid, int num_frames, ASGCT_CallFrame* frames);
-    void storeCallTrace(int tid, int num_frames, ASGCT_CallFrame* frames);
+    void recordExternalSample(u64 counter, Event* event, int tid, int num_frames, ASGCT_CallFrame* frames, jint event_type = 0);
+    void printExternalSample(u64 counter, int tid, int num_frames, ASGCT_CallFrame* frames);
+    void printCallTrace(int tid, int num_frames, ASGCT_CallFrame* frames, u64 counter);
+    void storeCallTrace(int tid, int num_frames, ASGCT_CallFrame* frames, u64 counter);
     void writeLog(LogLevel level, const char* message);
     void writeLog(LogLevel level, const char* message, size_t len);
 
@@ -259,6 +260,7 @@ class Profiler {
 
     friend class Recording;
     friend class UpdateThreadNamesTask;
+    friend class EvictCallTracesTask;
 };
 
 class UpdateThreadNamesTask: public Stoppable {
@@ -267,15 +269,41 @@ class UpdateThreadNamesTask: public Stoppable {
         this->profiler = profiler;
     }
     void run() {
-        // Check if thread is requested to stop
+        // New and ended Java threads come with ThreadStart/ThreadEnd, and native renames are
+        // caught by ThreadNameHooks. Java renames are not, so every JAVA_NAMES_PERIOD runs
+        // the Thread.name fields are checked for a new String; only those threads are looked up
+        for (int run = 1; stopRequested() == false; run++)
+        {
+            profiler->updateRenamedThreadNames();
+            if (run % JAVA_NAMES_PERIOD == 0) {
+                profiler->reconcileJavaThreadNames();
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(1000));
+        }
+    }
+  private:
+    static const int JAVA_NAMES_PERIOD = 5;
+    Profiler* profiler;
+};
+
+// With tracemem=N, keeps CallTraceStorage within its budget; not used with JFR output.
+// Eviction is skipped while a dump holds the state lock and refers to the traces.
+class EvictCallTracesTask: public Stoppable {
+  public:
+    EvictCallTracesTask(Profiler* profiler) {
+        this->profiler = profiler;
+    }
+    void run() {
         while (stopRequested() == false)
         {
-            // std::cout << "Do some work." << std::endl;
-            profiler->updateJavaThreadNames();
-            profiler->updateNativeThreadNames();
-            std::this_thread::sleep_for(std::chrono::milliseconds(5000));
+            if (profiler->_state_lock.tryLock()) {
+                if (profiler->_state == RUNNING) {
+                    profiler->_call_trace_storage.evict();
+                }
+                profiler->_state_lock.unlock();
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(1000));
         }
-        // std::cout << "End task." << std::endl;
     }
   private:
     Profiler* profiler;
@@ -0,0 +1,157 @@
+/*
+ * Copyright 2022 The Kindling Authors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include <string.h>
+#include "threadInfo.h"
+#include "os.h"
+
+
+ThreadInfoTable::ThreadInfoTable() {
+    _pages = (ThreadInfo**)OS::safeAlloc(MAX_THREAD_INFO_PAGES * sizeof(ThreadInfo*));
+    memset(_names, 0, sizeof(_names));
+}
+
+ThreadInfoTable::~ThreadInfoTable() {
+    for (u32 i = 0; i < MAX_THREAD_INFO_PAGES; i++) {
+        if (_pages[i] != NULL) {
+            OS::safeFree(_pages[i], THREAD_INFO_PAGE_CAPACITY * sizeof(ThreadInfo));
+        }
+    }
+    OS::safeFree(_pages, MAX_THREAD_INFO_PAGES * sizeof(ThreadInfo*));
+
+    for (u32 i = 0; i < MAX_THREAD_NAME_PAGES; i++) {
+        if (_names[i] != NULL) {
+            OS::safeFree(_names[i], THREAD_NAME_PAGE_CAPACITY * sizeof(const char*));
+        }
+    }
+}
+
+void ThreadInfoTable::clear() {
+    MutexLocker ml(_lock);
+
+    for (u32 i = 0; i < MAX_THREAD_INFO_PAGES; i++) {
+        if (_pages[i] != NULL) {
+            memset(_pages[i], 0, THREAD_INFO_PAGE_CAPACITY * sizeof(ThreadInfo));
+        }
+    }
+    for (u32 i = 0; i < MAX_THREAD_NAME_PAGES; i++) {
+        if (_names[i] != NULL) {
+            memset(_names[i], 0, THREAD_NAME_PAGE_CAPACITY * sizeof(const char*));
+        }
+    }
+    _name_dict.clear();
+}
+
+ThreadInfo* ThreadInfoTable::entry(int tid, bool create) {
+    if (tid < 0) {
+        return NULL;
+    }
+
+    u32 page_index = (u32)tid / THREAD_INFO_PAGE_CAPACITY;
+    ThreadInfo* page = __atomic_load_n(&_pages[page_index], __ATOMIC_ACQUIRE);
+    if (page == NULL) {
+        if (!create) {
+            return NULL;
+        }
+        // Pages are only allocated under _lock, so there is no race between writers
+        page = (ThreadInfo*)OS::safeAlloc(THREAD_INFO_PAGE_CAPACITY * sizeof(ThreadInfo));
+        if (page == NULL) {
+            return NULL;
+        }
+        __atomic_store_n(&_pages[page_index], page, __ATOMIC_RELEASE);
+    }
+    return &page[(u32)tid % THREAD_INFO_PAGE_CAPACITY];
+}
+
+// Returns 0 if the name cannot be stored
+u32 ThreadInfoTable::internName(const char* name) {
+    const char* interned;
+    u32 id = _name_dict.lookup(name, strlen(name), &interned);
+
+    u32 page_index = id / THREAD_NAME_PAGE_CAPACITY;
+    if (page_index >= MAX_THREAD_NAME_PAGES) {
+        return 0;
+    }
+
+    const char** page = _names[page_index];
+    if (page == NULL) {
+        page = (const char**)OS::safeAlloc(THREAD_NAME_PAGE_CAPACITY * sizeof(const char*));
+        if (page == NULL) {
+            return 0;
+        }
+        __atomic_store_n(&_names[page_index], page, __ATOMIC_RELEASE);
+    }
+
+    // Publish the string before any entry can refer to its ID
+    __atomic_store_n(&page[id % THREAD_NAME_PAGE_CAPACITY], interned, __ATOMIC_RELEASE);
+    return id;
+}
+
+bool ThreadInfoTable::setJavaThread(int tid, const char* name, jlong java_thread_id) {
+    MutexLocker ml(_lock);
+
+    bool changed = false;
+    ThreadInfo* info = entry(tid, true);
+    u32 name_id;
+    if (info != NULL && (name_id = internName(name)) != 0) {
+        changed = info->_state != THREAD_INFO_JAVA || info->_name_id != name_id;
+        info->_java_thread_id = java_thread_id;
+        __atomic_store_n(&info->_name_id, name_id, __ATOMIC_RELEASE);
+        __atomic_store_n(&info->_state, (u32)THREAD_INFO_JAVA, __ATOMIC_RELEASE);
+    }
+
+    return changed;
+}
+
+bool ThreadInfoTable::setNativeThread(int tid, const char* name) {
+    MutexLocker ml(_lock);
+
+    bool changed = false;
+    ThreadInfo* info = entry(tid, true);
+    u32 name_id;
+    if (info != NULL && info->_state != THREAD_INFO_JAVA && (name_id = internName(name)) != 0) {
+        changed = info->_state == THREAD_INFO_EMPTY || info->_name_id != name_id;
+        __atomic_store_n(&info->_name_id, name_id, __ATOMIC_RELEASE);
+        __atomic_store_n(&info->_state, (u32)THREAD_INFO_NATIVE, __ATOMIC_RELEASE);
+    }
+
+    return changed;
+}
+
+bool ThreadInfoTable::isJavaThread(int tid) {
+    ThreadInfo* info = entry(tid, false);
+    return info != NULL && __atomic_load_n(&info->_state, __ATOMIC_ACQUIRE) == THREAD_INFO_JAVA;
+}
+
+const char* ThreadInfoTable::name(int tid) {
+    ThreadInfo* info = entry(tid, false);
+    if (info == NULL || __atomic_load_n(&info->_state, __ATOMIC_ACQUIRE) == THREAD_INFO_EMPTY) {
+        return NULL;
+    }
+
+    u32 name_id = __atomic_load_n(&info->_name_id, __ATOMIC_ACQUIRE);
+    const char** page = __atomic_load_n(&_names[name_id / THREAD_NAME_PAGE_CAPACITY], __ATOMIC_ACQUIRE);
+    return page != NULL ? __atomic_load_n(&page[name_id % THREAD_NAME_PAGE_CAPACITY], __ATOMIC_ACQUIRE) : NULL;
+}
+
+jlong ThreadInfoTable::javaThreadId(int tid) {
+    ThreadInfo* info = entry(tid, false);
+    if (info == NULL || __atomic_load_n(&info->_state, __ATOMIC_ACQUIRE) != THREAD_INFO_JAVA) {
+        return 0;
+    }
+    return info->_java_thread_id;
+}
@@ -0,0 +1,81 @@
+/*
+ * Copyright 2022 The Kindling Authors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#ifndef _THREADINFO_H
+#define _THREADINFO_H
+
+#include <jni.h>
+#include "arch.h"
+#include "dictionary.h"
+#include "mutex.h"
+
+
+// Thread IDs held by one page of the table; a page is 256 KB of lazily committed memory
+const u32 THREAD_INFO_PAGE_CAPACITY = 16384;
+const u32 MAX_THREAD_INFO_PAGES = (1U << 31) / THREAD_INFO_PAGE_CAPACITY;
+
+// Name IDs held by one page of the reverse name table
+const u32 THREAD_NAME_PAGE_CAPACITY = 8192;
+const u32 MAX_THREAD_NAME_PAGES = 64;
+
+enum ThreadInfoState {
+    THREAD_INFO_EMPTY,
+    THREAD_INFO_NATIVE,
+    THREAD_INFO_JAVA
+};
+
+struct ThreadInfo {
+    volatile jlong _java_thread_id;
+    volatile u32 _name_id;
+    volatile u32 _state;
+};
+
+// Names and Java thread IDs of profiled threads, indexed by native thread ID.
+// Lookups are lock-free and never wait for thread start or rename; updates are serialized
+// by a mutex. Names are interned and stay valid until clear(), which must not run
+// concurrently with readers.
+class ThreadInfoTable {
+  private:
+    ThreadInfo** _pages;
+    const char** _names[MAX_THREAD_NAME_PAGES];
+    Dictionary _name_dict;
+    Mutex _lock;
+
+    ThreadInfo* entry(int tid, bool create);
+    u32 internName(const char* name);
+
+  public:
+    ThreadInfoTable();
+    ~ThreadInfoTable();
+
+    void clear();
+
+    // Both return true if the thread is new or its name has changed.
+    // A native name never overrides the name of a Java thread.
+    bool setJavaThread(int tid, const char* name, jlong java_thread_id);
+    bool setNativeThread(int tid, const char* name);
+
+    bool isJavaThread(int tid);
+
+    // Returns NULL for an unknown thread
+    const char* name(int tid);
+
+    // Returns 0 for an unknown or a native thread
+    jlong javaThreadId(int tid);
+};
+
+#endif // _THREADINFO_H
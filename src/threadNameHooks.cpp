@@ -0,0 +1,160 @@
+/*
+ * Copyright 2022 The Kindling Authors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include <pthread.h>
+#include <string.h>
+#include "threadNameHooks.h"
+#include "os.h"
+
+#ifdef __linux__
+#include <sys/prctl.h>
+#endif
+
+
+SpinLock ThreadNameHooks::_lock;
+PendingThreadName ThreadNameHooks::_pending[PENDING_THREAD_NAMES];
+int ThreadNameHooks::_pending_count = 0;
+bool ThreadNameHooks::_rescan = false;
+bool ThreadNameHooks::_enabled = false;
+std::vector<void**> ThreadNameHooks::_patched_prctl;
+std::vector<void**> ThreadNameHooks::_patched_setname;
+
+#ifdef __linux__
+
+// prctl() is variadic, but its arguments are passed in the same registers as these
+static int prctl_hook(int option, unsigned long arg2, unsigned long arg3, unsigned long arg4, unsigned long arg5) {
+    int result = prctl(option, arg2, arg3, arg4, arg5);
+    if (option == PR_SET_NAME && result == 0) {
+        ThreadNameHooks::renamed(OS::threadId(), (const char*)arg2);
+    }
+    return result;
+}
+
+static int pthread_setname_np_hook(pthread_t thread, const char* name) {
+    int result = pthread_setname_np(thread, name);
+    if (result == 0) {
+        ThreadNameHooks::renamed(pthread_equal(thread, pthread_self()) ? OS::threadId() : -1, name);
+    }
+    return result;
+}
+
+void ThreadNameHooks::patchLibraries(CodeCacheArray& libs) {
+    int count = libs.count();
+    for (int i = 0; i < count; i++) {
+        CodeCache* lib = libs[i];
+        if (lib->contains((const void*)prctl_hook)) {
+            // The hooks call the originals through our own GOT
+            continue;
+        }
+
+        // Already patched entries do not point to the originals anymore
+        void** entry = lib->findGlobalOffsetEntry((void*)prctl);
+        if (entry != NULL) {
+            __atomic_store_n(entry, (void*)prctl_hook, __ATOMIC_RELEASE);
+            _patched_prctl.push_back(entry);
+        }
+        entry = lib->findGlobalOffsetEntry((void*)pthread_setname_np);
+        if (entry != NULL) {
+            __atomic_store_n(entry, (void*)pthread_setname_np_hook, __ATOMIC_RELEASE);
+            _patched_setname.push_back(entry);
+        }
+    }
+}
+
+void ThreadNameHooks::install(CodeCacheArray& libs) {
+    _lock.lock();
+    _enabled = true;
+    patchLibraries(libs);
+    _lock.unlock();
+}
+
+void ThreadNameHooks::update(CodeCacheArray& libs) {
+    _lock.lock();
+    if (_enabled) {
+        patchLibraries(libs);
+    }
+    _lock.unlock();
+}
+
+void ThreadNameHooks::uninstall() {
+    _lock.lock();
+    for (size_t i = 0; i < _patched_prctl.size(); i++) {
+        __atomic_store_n(_patched_prctl[i], (void*)prctl, __ATOMIC_RELEASE);
+    }
+    for (size_t i = 0; i < _patched_setname.size(); i++) {
+        __atomic_store_n(_patched_setname[i], (void*)pthread_setname_np, __ATOMIC_RELEASE);
+    }
+    _patched_prctl.clear();
+    _patched_setname.clear();
+    _enabled = false;
+    _pending_count = 0;
+    _rescan = false;
+    _lock.unlock();
+}
+
+#else
+
+void ThreadNameHooks::patchLibraries(CodeCacheArray& libs) {
+}
+
+void ThreadNameHooks::install(CodeCacheArray& libs) {
+}
+
+void ThreadNameHooks::update(CodeCacheArray& libs) {
+}
+
+void ThreadNameHooks::uninstall() {
+}
+
+#endif // __linux__
+
+void ThreadNameHooks::renamed(int tid, const char* name) {
+    _lock.lock();
+    if (!_enabled) {
+        // Raced with uninstall
+    } else if (tid == -1) {
+        _rescan = true;
+    } else {
+        int i = 0;
+        while (i < _pending_count && _pending[i]._tid != tid) {
+            i++;
+        }
+        if (i == PENDING_THREAD_NAMES) {
+            _rescan = true;
+        } else {
+            _pending[i]._tid = tid;
+            strncpy(_pending[i]._name, name, sizeof(_pending[i]._name) - 1);
+            _pending[i]._name[sizeof(_pending[i]._name) - 1] = 0;
+            if (i == _pending_count) {
+                _pending_count++;
+            }
+        }
+    }
+    _lock.unlock();
+}
+
+bool ThreadNameHooks::drain(std::vector<PendingThreadName>& names) {
+    _lock.lock();
+    bool rescan = _rescan;
+    if (!rescan) {
+        names.assign(_pending, _pending + _pending_count);
+    }
+    _pending_count = 0;
+    _rescan = false;
+    _lock.unlock();
+    return rescan;
+}
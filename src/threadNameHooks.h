@@ -0,0 +1,67 @@
+/*
+ * Copyright 2022 The Kindling Authors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#ifndef _THREADNAMEHOOKS_H
+#define _THREADNAMEHOOKS_H
+
+#include <vector>
+#include "codeCache.h"
+#include "spinLock.h"
+
+// Renames queued between two runs of the thread names task
+const int PENDING_THREAD_NAMES = 256;
+
+struct PendingThreadName {
+    int _tid;
+    // Same limit as /proc/<tid>/comm
+    char _name[16];
+};
+
+// Catches renames of native threads as they happen, so that native thread names need not be polled.
+// prctl(PR_SET_NAME) and pthread_setname_np() are intercepted by patching their GOT entries
+// in every loaded library. Entries that are still lazily bound are not found.
+// Java thread renames are not seen here: HotSpot calls pthread_setname_np through a pointer
+// from dlsym rather than the GOT, and Thread.setName from another thread never reaches
+// native code at all. Java names are reconciled periodically by UpdateThreadNamesTask instead.
+class ThreadNameHooks {
+  private:
+    static SpinLock _lock;
+    static PendingThreadName _pending[PENDING_THREAD_NAMES];
+    static int _pending_count;
+    // A rename could not be queued or targeted another thread: names must be rescanned
+    static bool _rescan;
+    static bool _enabled;
+    static std::vector<void**> _patched_prctl;
+    static std::vector<void**> _patched_setname;
+
+    static void patchLibraries(CodeCacheArray& libs);
+
+  public:
+    // Patches the libraries loaded so far
+    static void install(CodeCacheArray& libs);
+    static void uninstall();
+    // Patches libraries loaded since, unless uninstalled
+    static void update(CodeCacheArray& libs);
+
+    // Called from the hooks; tid is -1 if the renamed thread is not known
+    static void renamed(int tid, const char* name);
+
+    // Moves queued renames to names. Returns true if a full rescan is required instead
+    static bool drain(std::vector<PendingThreadName>& names);
+};
+
+#endif // _THREADNAMEHOOKS_H
@@ -0,0 +1,61 @@
+/*
+ * Copyright 2022 The Kindling Authors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "timeUtil.h"
+#include "log.h"
+
+
+ClockAnchor TicksClock::_anchor = {0, 0, 1.0};
+volatile u32 TicksClock::_version = 0;
+SpinLock TicksClock::_lock;
+
+long long TicksClock::calibrate() {
+    if (!_lock.tryLock()) {
+        // Another drain thread is calibrating right now
+        return 0;
+    }
+
+    // Keep the tightest of a few readings to bound the error of the anchor
+    ClockAnchor next;
+    u64 best_window = (u64)-1;
+    for (int i = 0; i < 3; i++) {
+        u64 start = TSC::ticks();
+        u64 nanos = getCurrentTimestamp();
+        u64 end = TSC::ticks();
+        if (end - start < best_window) {
+            best_window = end - start;
+            next.ticks = start + (end - start) / 2;
+            next.nanos = nanos;
+        }
+    }
+    next.nanos_per_tick = 1e9 / TSC::frequency();
+
+    // Consistency check: timestamps converted with the previous anchor must agree with timeUtil.h
+    // Only calibrate() writes the anchor, and it holds the lock
+    const ClockAnchor& prev = _anchor;
+    long long drift = prev.nanos == 0 ? 0 : (long long)(next.nanos - convert(prev, next.ticks));
+    if (drift > MAX_CLOCK_DRIFT || drift < -MAX_CLOCK_DRIFT) {
+        Log::debug("TSC timestamps drifted %lld ns from the wall clock, re-anchored", drift);
+    }
+
+    __atomic_store_n(&_version, _version + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    _anchor = next;
+    __atomic_store_n(&_version, _version + 1, __ATOMIC_RELEASE);
+
+    _lock.unlock();
+    return drift;
+}
@@ -19,11 +19,66 @@
 
 #include <time.h>
 #include "arch.h"
+#include "spinLock.h"
+#include "tsc.h"
 
-u64 getCurrentTimestamp() {
+// Larger difference between the calibrated TSC and the wall clock is reported
+const long long MAX_CLOCK_DRIFT = 1000000;
+
+static inline u64 getCurrentTimestamp() {
     struct timespec ts;
     timespec_get(&ts, TIME_UTC);
     return (u64)ts.tv_sec * 1000000000 + ts.tv_nsec;
 }
 
+struct ClockAnchor {
+    u64 ticks;
+    u64 nanos;
+    double nanos_per_tick;
+};
+
+// Hot paths record raw TSC::ticks(); the drain side converts them to the same
+// wall-clock nanoseconds as getCurrentTimestamp(). calibrate() re-anchors the conversion
+// on every drain cycle, so that a timestamp is never extrapolated further than one cycle.
+class TicksClock {
+  private:
+    // Seqlock: the version is odd while calibrate() rewrites the anchor,
+    // and readers retry until they have copied it under one even version
+    static ClockAnchor _anchor;
+    static volatile u32 _version;
+    static SpinLock _lock;
+
+    static u64 convert(const ClockAnchor& anchor, u64 ticks) {
+        return anchor.nanos + (long long)((long long)(ticks - anchor.ticks) * anchor.nanos_per_tick);
+    }
+
+    // Spins only while a calibration is in progress, so it must not be called from a signal handler
+    static ClockAnchor anchor() {
+        while (true) {
+            u32 version = __atomic_load_n(&_version, __ATOMIC_ACQUIRE);
+            if ((version & 1) == 0) {
+                ClockAnchor copy = *(const ClockAnchor*)&_anchor;
+                __atomic_thread_fence(__ATOMIC_ACQUIRE);
+                if (__atomic_load_n(&_version, __ATOMIC_RELAXED) == version) {
+                    return copy;
+                }
+            }
+            spinPause();
+        }
+    }
+
+  public:
+    // Returns how far the previous anchor has drifted from the wall clock, in ns
+    static long long calibrate();
+
+    static u64 toNanos(u64 ticks) {
+        return convert(anchor(), ticks);
+    }
+
+    // Converts a difference of two tick values to nanoseconds
+    static u64 ticksToNanos(u64 ticks) {
+        return (u64)(ticks * anchor().nanos_per_tick);
+    }
+};
+
 #endif // _TIMEUTIL_H
@@ -24,8 +24,7 @@
 
 // Maximum number of threads sampled in one iteration. This limit serves as a throttle
 // when generating profiling signals. Otherwise applications with too many threads may
-// suffer from a big profiling overhead. Also, keeping this limit low enough helps
-// to avoid contention on a spin lock inside Profiler::recordSample().
+// suffer from a big profiling overhead.
 const int THREADS_PER_TICK = 8;
 
 // Set the hard limit for thread walking interval to 100 microseconds.
@@ -0,0 +1,39 @@
+// Many threads burning CPU in moderately deep stacks, so that profiling signals
+// arrive on many threads at once and stack walks take a while.
+public class BusyThreadsTarget {
+    static volatile long sink;
+
+    public static void main(String[] args) throws Exception {
+        int threads = args.length > 0 ? Integer.parseInt(args[0]) : 200;
+        long millis = args.length > 1 ? Long.parseLong(args[1]) : 5000;
+
+        final long deadline = System.currentTimeMillis() + millis;
+        Thread[] workers = new Thread[threads];
+        for (int i = 0; i < threads; i++) {
+            workers[i] = new Thread(new Runnable() {
+                @Override
+                public void run() {
+                    while (System.currentTimeMillis() < deadline) {
+                        sink += recurse(32);
+                    }
+                }
+            }, "BusyThreadsTarget-" + i);
+            workers[i].start();
+        }
+
+        for (int i = 0; i < threads; i++) {
+            workers[i].join();
+        }
+    }
+
+    static long recurse(int depth) {
+        if (depth == 0) {
+            long x = sink;
+            for (int i = 0; i < 10000; i++) {
+                x = x * 31 + i;
+            }
+            return x;
+        }
+        return recurse(depth - 1) + depth;
+    }
+}
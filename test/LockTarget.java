@@ -0,0 +1,59 @@
+import java.util.concurrent.locks.ReentrantLock;
+
+// Contended monitors and ReentrantLocks with short critical sections:
+// nearly every lock wait is far below the reporting threshold.
+// Prints the number of lock acquisitions per second.
+public class LockTarget {
+    static final Object monitor = new Object();
+    static final ReentrantLock lock = new ReentrantLock();
+    static volatile long sink;
+
+    public static void main(String[] args) throws Exception {
+        int threads = args.length > 0 ? Integer.parseInt(args[0]) : 8;
+        long millis = args.length > 1 ? Long.parseLong(args[1]) : 5000;
+
+        final long deadline = System.currentTimeMillis() + millis;
+        final long[] counts = new long[threads];
+        Thread[] workers = new Thread[threads];
+        for (int i = 0; i < threads; i++) {
+            final int id = i;
+            workers[i] = new Thread(new Runnable() {
+                @Override
+                public void run() {
+                    long count = 0;
+                    while (System.currentTimeMillis() < deadline) {
+                        for (int j = 0; j < 100; j++) {
+                            synchronized (monitor) {
+                                sink += work();
+                            }
+                            lock.lock();
+                            try {
+                                sink += work();
+                            } finally {
+                                lock.unlock();
+                            }
+                            count += 2;
+                        }
+                    }
+                    counts[id] = count;
+                }
+            }, "LockTarget-" + i);
+            workers[i].start();
+        }
+
+        long total = 0;
+        for (int i = 0; i < threads; i++) {
+            workers[i].join();
+            total += counts[i];
+        }
+        System.out.println(total * 1000 / millis);
+    }
+
+    static long work() {
+        long x = sink;
+        for (int i = 0; i < 50; i++) {
+            x = x * 31 + i;
+        }
+        return x;
+    }
+}
@@ -0,0 +1,11 @@
+#!/bin/bash
+
+set -e  # exit on any failure
+set -x  # print all executed lines
+
+(
+  cd $(dirname $0)/..
+
+  make build/calltracehash-test
+  build/calltracehash-test 100
+)
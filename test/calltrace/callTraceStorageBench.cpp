@@ -0,0 +1,246 @@
+/*
+ * Copyright 2022 The Kindling Authors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+
+// Stress test and benchmark of CallTraceStorage (src/callTraceStorage.h).
+// Every thread stores call traces picked from a shared pool of distinct stacks, the way
+// concurrent signal handlers do, and checks that each returned ID resolves to the same frames.
+// Prints put() calls per second for a single shard (the former single hash table),
+// the default number of shards, the default shards under a memory budget that is
+// much smaller than the pool, with a background thread evicting traces all the time,
+// and the frame tree mode (tracetree), where the random pool mostly measures adding new traces.
+// In the bounded mode every sample must still be accounted for after eviction.
+// Finally compares the memory of deep stacks with a common bottom in both storage modes
+// and checks that collected tree traces are rebuilt in full.
+//
+//   build/calltrace-bench [millis per run]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <chrono>
+#include <thread>
+#include <vector>
+
+#include "../../src/callTraceStorage.h"
+
+static const int STACKS = 65536;
+static const int STACK_DEPTH = 24;
+static const int MAX_THREADS = 16;
+static const size_t BUDGET = 32 * 1024 * 1024;
+
+// Deep stacks: one of a few framework bottoms under a short, branchy application part
+static const int DEEP_STACKS = 32768;
+static const int DEEP_BOTTOMS = 16;
+static const int DEEP_BOTTOM_DEPTH = 150;
+static const int DEEP_TOP_DEPTH = 30;
+
+struct BenchStack {
+    ASGCT_CallFrame frames[STACK_DEPTH];
+    int num_frames;
+};
+
+static std::vector<BenchStack> stacks(STACKS);
+// Set by a worker that found a mismatch; main exits only after all threads are joined
+static volatile bool failed = false;
+
+static void initStacks() {
+    u32 seed = 12345;
+    for (int i = 0; i < STACKS; i++) {
+        BenchStack& stack = stacks[i];
+        stack.num_frames = 4 + i % (STACK_DEPTH - 4);
+        for (int j = 0; j < stack.num_frames; j++) {
+            seed ^= seed << 13;
+            seed ^= seed >> 17;
+            seed ^= seed << 5;
+            stack.frames[j].bci = j;
+            stack.frames[j].method_id = (jmethodID)(uintptr_t)(0x10000 + (seed % 4096) * 8);
+        }
+        // Make every stack distinct regardless of the random part
+        stack.frames[0].method_id = (jmethodID)(uintptr_t)(0x1000000 + i * 8);
+    }
+}
+
+static bool sameFrames(CallTrace* trace, int num_frames, ASGCT_CallFrame* frames) {
+    if (trace == NULL || trace->num_frames != num_frames) {
+        return false;
+    }
+    for (int i = 0; i < num_frames; i++) {
+        if (trace->frames[i].bci != frames[i].bci || trace->frames[i].method_id != frames[i].method_id) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static double run(CallTraceStorage& storage, int threads, int millis, bool evict) {
+    volatile bool stop = false;
+    std::vector<long long> ops(threads);
+    std::vector<std::thread> workers;
+
+    for (int t = 0; t < threads; t++) {
+        workers.push_back(std::thread([&storage, &stop, &ops, t, evict] {
+            u32 seed = t * 2654435761u + 1;
+            long long count = 0;
+            CallTraceHolder holder;
+
+            while (!stop) {
+                for (int i = 0; i < 256; i++) {
+                    seed ^= seed << 13;
+                    seed ^= seed >> 17;
+                    seed ^= seed << 5;
+                    BenchStack& stack = stacks[seed % STACKS];
+
+                    u32 id = storage.put(stack.num_frames, stack.frames, 1);
+                    // The trace may still be in flight from a concurrent put of the same stack.
+                    // Eviction may replace a trace by storage_overflow, so IDs are checked without it
+                    if ((count & 63) == 0 && !evict) {
+                        CallTrace* trace;
+                        while ((trace = storage.getCallTrace(id, holder)) == NULL) {
+                            std::this_thread::yield();
+                        }
+                        if (!sameFrames(trace, stack.num_frames, stack.frames)) {
+                            fprintf(stderr, "Call trace %u does not match the stored stack\n", id);
+                            failed = true;
+                            stop = true;
+                            break;
+                        }
+                    }
+                    count++;
+                }
+            }
+            ops[t] = count;
+        }));
+    }
+
+    size_t peak_memory = 0;
+    std::thread evicter([&storage, &stop, &peak_memory, evict] {
+        while (evict && !stop) {
+            storage.evict();
+            size_t memory = storage.memory();
+            if (memory > peak_memory) {
+                peak_memory = memory;
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+    });
+
+    std::this_thread::sleep_for(std::chrono::milliseconds(millis));
+    stop = true;
+    for (int t = 0; t < threads; t++) {
+        workers[t].join();
+    }
+    evicter.join();
+    if (failed) {
+        exit(1);
+    }
+
+    // Chunks are reserved ahead, so allow one spare chunk per shard and generation
+    if (evict && peak_memory > BUDGET + BUDGET / 4) {
+        fprintf(stderr, "Storage took %lld bytes with a budget of %lld\n", (long long)peak_memory, (long long)BUDGET);
+        exit(1);
+    }
+
+    long long total = 0;
+    for (int t = 0; t < threads; t++) {
+        total += ops[t];
+    }
+
+    std::map<u64, CallTraceSample> samples;
+    storage.collectSamples(samples);
+    long long collected = 0;
+    for (std::map<u64, CallTraceSample>::iterator it = samples.begin(); it != samples.end(); ++it) {
+        collected += it->second.counter;
+    }
+    if (collected != total) {
+        fprintf(stderr, "Collected %lld samples out of %lld\n", collected, total);
+        exit(1);
+    }
+
+    return total / (millis * 1000.0);
+}
+
+static size_t storeDeepStacks(CallTraceStorage& storage, bool verify) {
+    const int depth = DEEP_BOTTOM_DEPTH + DEEP_TOP_DEPTH;
+    std::vector<ASGCT_CallFrame> frames((size_t)DEEP_STACKS * depth);
+    std::vector<u32> ids(DEEP_STACKS);
+
+    u32 seed = 54321;
+    for (int i = 0; i < DEEP_STACKS; i++) {
+        ASGCT_CallFrame* stack = &frames[(size_t)i * depth];
+        for (int j = 0; j < depth; j++) {
+            seed ^= seed << 13;
+            seed ^= seed >> 17;
+            seed ^= seed << 5;
+            // Frames are listed top first, so the bottom is at the end
+            int method = j < DEEP_TOP_DEPTH ? j * 4 + seed % 4 : 1000 + (i % DEEP_BOTTOMS) * depth + j;
+            stack[j].bci = j;
+            stack[j].method_id = (jmethodID)(uintptr_t)(0x10000 + method * 8);
+        }
+        ids[i] = storage.put(depth, stack, 1);
+    }
+
+    if (verify) {
+        std::map<u32, CallTrace*> traces;
+        storage.collectTraces(traces);
+        for (int i = 0; i < DEEP_STACKS; i++) {
+            if (!sameFrames(traces[ids[i]], depth, &frames[(size_t)i * depth])) {
+                fprintf(stderr, "Collected call trace %u does not match the stored stack\n", ids[i]);
+                exit(1);
+            }
+        }
+    }
+    return storage.memory();
+}
+
+int main(int argc, char** argv) {
+    int millis = argc > 1 ? atoi(argv[1]) : 200;
+    initStacks();
+
+    char sharded_title[32];
+    snprintf(sharded_title, sizeof(sharded_title), "%d shards", CALL_TRACE_SHARDS);
+    printf("%8s %14s %14s %14s %14s   (million puts/s)\n", "threads", "1 shard", sharded_title, "32 MB budget", "frame tree");
+    for (int threads = 1; threads <= MAX_THREADS; threads *= 2) {
+        CallTraceStorage single(1);
+        CallTraceStorage sharded;
+        CallTraceStorage bounded;
+        bounded.setBudget(BUDGET);
+        bounded.clear();
+        CallTraceStorage tree;
+        tree.setTree(true);
+        tree.clear();
+
+        double single_ops = run(single, threads, millis, false);
+        double sharded_ops = run(sharded, threads, millis, false);
+        double bounded_ops = run(bounded, threads, millis, true);
+        double tree_ops = run(tree, threads, millis, false);
+        printf("%8d %14.2f %14.2f %14.2f %14.2f\n", threads, single_ops, sharded_ops, bounded_ops, tree_ops);
+    }
+
+    CallTraceStorage flat;
+    CallTraceStorage tree;
+    tree.setTree(true);
+    tree.clear();
+    size_t flat_memory = storeDeepStacks(flat, true);
+    size_t tree_memory = storeDeepStacks(tree, true);
+    printf("%d stacks of %d frames: %lld KB flat, %lld KB as a frame tree\n", DEEP_STACKS,
+           DEEP_BOTTOM_DEPTH + DEEP_TOP_DEPTH, (long long)flat_memory / 1024, (long long)tree_memory / 1024);
+    if (tree_memory * 2 > flat_memory) {
+        fprintf(stderr, "The frame tree saves too little\n");
+        exit(1);
+    }
+    return 0;
+}
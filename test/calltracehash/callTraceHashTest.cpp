@@ -0,0 +1,235 @@
+/*
+ * Copyright 2022 The Kindling Authors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+
+
+// Collision quality test and micro-benchmark of the call trace hashes (src/callTraceHash.h).
+// Every implementation available on this CPU must
+//   - give distinct hashes to stacks that differ the way real stacks do: a neighbouring
+//     method ID or bci in one frame, two frames swapped, one frame more or less;
+//   - spread random stacks evenly over the low bits (hash table slots) and the high bits (shards);
+//   - flip about half of the output bits when a single input bit flips.
+// Then prints the time to hash one stack of 20 to 2048 frames with each of them.
+//
+//   build/calltracehash-test [millis per run]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <chrono>
+#include <set>
+#include <vector>
+
+#include "../../src/callTraceHash.h"
+
+struct HashImpl {
+    const char* name;
+    CallTraceHash::Func hash;
+};
+
+static void addImpl(std::vector<HashImpl>& impls, const char* name, CallTraceHash::Func hash) {
+    HashImpl impl = {name, hash};
+    impls.push_back(impl);
+}
+
+static const int DEPTHS[] = {20, 64, 128, 256, 512, 1024, 2048};
+static const int METHODS = 4096;
+
+static u32 seed = 12345;
+
+static u32 nextRandom() {
+    seed ^= seed << 13;
+    seed ^= seed >> 17;
+    seed ^= seed << 5;
+    return seed;
+}
+
+// jmethodIDs are pointers into a few arrays of 8-byte slots; bcis are small
+static void randomStack(std::vector<ASGCT_CallFrame>& frames, int depth) {
+    frames.resize(depth);
+    memset(&frames[0], 0, depth * sizeof(ASGCT_CallFrame));
+    for (int i = 0; i < depth; i++) {
+        frames[i].bci = nextRandom() % 200;
+        frames[i].method_id = (jmethodID)(0x7f3a5c000000ULL + (nextRandom() % METHODS) * 8);
+    }
+}
+
+static void fail(const HashImpl& impl, const char* what, int depth) {
+    fprintf(stderr, "%s: %s at depth %d\n", impl.name, what, depth);
+    exit(1);
+}
+
+static void checkNearDuplicates(const HashImpl& impl, int depth) {
+    std::vector<ASGCT_CallFrame> base;
+    randomStack(base, depth + 1);
+    std::set<u64> hashes;
+    hashes.insert(impl.hash(depth, &base[0]));
+    size_t variants = 1;
+
+    for (int i = 0; i < depth; i++) {
+        for (int delta = -2; delta <= 2; delta++) {
+            if (delta == 0) {
+                continue;
+            }
+            std::vector<ASGCT_CallFrame> frames(base);
+            frames[i].method_id = (jmethodID)((char*)frames[i].method_id + delta * 8);
+            hashes.insert(impl.hash(depth, &frames[0]));
+
+            frames = base;
+            frames[i].bci += delta * 3;
+            hashes.insert(impl.hash(depth, &frames[0]));
+            variants += 2;
+        }
+
+        if (i + 1 < depth && (base[i].method_id != base[i + 1].method_id || base[i].bci != base[i + 1].bci)) {
+            std::vector<ASGCT_CallFrame> frames(base);
+            std::swap(frames[i], frames[i + 1]);
+            hashes.insert(impl.hash(depth, &frames[0]));
+            variants++;
+        }
+    }
+
+    // The same stack with one frame less and one frame more
+    hashes.insert(impl.hash(depth - 1, &base[0]));
+    hashes.insert(impl.hash(depth + 1, &base[0]));
+    variants += 2;
+
+    if (hashes.size() != variants) {
+        fail(impl, "near duplicate stacks collide", depth);
+    }
+}
+
+static void checkDistribution(const HashImpl& impl, int depth) {
+    const int stacks = 65536;
+    const int buckets = 1024;
+    std::vector<int> low(buckets);
+    std::vector<int> high(buckets);
+    std::set<u64> hashes;
+
+    std::vector<ASGCT_CallFrame> frames;
+    for (int i = 0; i < stacks; i++) {
+        randomStack(frames, depth);
+        u64 h = impl.hash(depth, &frames[0]);
+        hashes.insert(h);
+        low[h & (buckets - 1)]++;
+        high[h >> 54]++;
+    }
+
+    if (hashes.size() != (size_t)stacks) {
+        fail(impl, "random stacks collide", depth);
+    }
+
+    // Chi-square with 1023 degrees of freedom stays below 1200 with probability > 99.9%
+    double expected = (double)stacks / buckets;
+    double chi_low = 0, chi_high = 0;
+    for (int i = 0; i < buckets; i++) {
+        chi_low += (low[i] - expected) * (low[i] - expected) / expected;
+        chi_high += (high[i] - expected) * (high[i] - expected) / expected;
+    }
+    if (chi_low > 1200 || chi_high > 1200) {
+        fail(impl, "uneven spread over slots or shards", depth);
+    }
+}
+
+static void checkAvalanche(const HashImpl& impl, int depth) {
+    std::vector<ASGCT_CallFrame> frames;
+    long long flipped = 0;
+    int trials = 0;
+
+    for (int t = 0; t < 2000; t++) {
+        randomStack(frames, depth);
+        u64 h = impl.hash(depth, &frames[0]);
+
+        int frame = nextRandom() % depth;
+        if (nextRandom() % 2 == 0) {
+            // Method IDs are 8-byte aligned pointers below 2^47
+            frames[frame].method_id = (jmethodID)((u64)frames[frame].method_id ^ 8ULL << (nextRandom() % 44));
+        } else {
+            frames[frame].bci ^= 1 << (nextRandom() % 16);
+        }
+        flipped += __builtin_popcountll(h ^ impl.hash(depth, &frames[0]));
+        trials++;
+    }
+
+    double average = (double)flipped / trials;
+    if (average < 30 || average > 34) {
+        fail(impl, "poor avalanche", depth);
+    }
+}
+
+static double nanosPerHash(const HashImpl& impl, int depth, int millis) {
+    const int copies = 64;
+    std::vector<ASGCT_CallFrame> frames;
+    std::vector<ASGCT_CallFrame> pool;
+    for (int i = 0; i < copies; i++) {
+        randomStack(frames, depth);
+        pool.insert(pool.end(), frames.begin(), frames.end());
+    }
+
+    volatile u64 sink = 0;
+    long long count = 0;
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    std::chrono::steady_clock::time_point deadline = start + std::chrono::milliseconds(millis);
+    std::chrono::steady_clock::time_point now;
+    do {
+        for (int i = 0; i < 256; i++) {
+            sink += impl.hash(depth, &pool[(count++ % copies) * depth]);
+        }
+    } while ((now = std::chrono::steady_clock::now()) < deadline);
+
+    return std::chrono::duration<double, std::nano>(now - start).count() / count;
+}
+
+int main(int argc, char** argv) {
+    int millis = argc > 1 ? atoi(argv[1]) : 100;
+
+    std::vector<HashImpl> impls;
+#ifdef __SIZEOF_INT128__
+    addImpl(impls, "wide", CallTraceHash::wide);
+#endif
+#ifdef __i386__
+    if (CallTraceHash::hasCrc32c()) {
+        addImpl(impls, "crc32c", CallTraceHash::crc32c);
+    }
+#endif
+    addImpl(impls, "murmur", CallTraceHash::murmur);
+
+    for (size_t i = 0; i < impls.size(); i++) {
+        for (size_t d = 0; d < sizeof(DEPTHS) / sizeof(DEPTHS[0]); d++) {
+            checkNearDuplicates(impls[i], DEPTHS[d]);
+            checkAvalanche(impls[i], DEPTHS[d]);
+            if (DEPTHS[d] <= 256) {
+                checkDistribution(impls[i], DEPTHS[d]);
+            }
+        }
+    }
+
+    printf("%6s", "depth");
+    for (size_t i = 0; i < impls.size(); i++) {
+        printf(" %14s", impls[i].name);
+    }
+    printf("   (ns per stack, * = used by CallTraceStorage)\n");
+
+    for (size_t d = 0; d < sizeof(DEPTHS) / sizeof(DEPTHS[0]); d++) {
+        printf("%6d", DEPTHS[d]);
+        for (size_t i = 0; i < impls.size(); i++) {
+            printf(" %13.1f%c", nanosPerHash(impls[i], DEPTHS[d], millis), impls[i].hash == CallTraceHash::best() ? '*' : ' ');
+        }
+        printf("\n");
+    }
+    return 0;
+}
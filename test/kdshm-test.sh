@@ -0,0 +1,17 @@
+#!/bin/bash
+
+set -e  # exit on any failure
+set -x  # print all executed lines
+
+UNAME_S=$(uname -s)
+if [ "$UNAME_S" != "Linux" ]; then
+  # This test is Linux-specific; do nothing on other platforms
+  exit 0
+fi
+
+(
+  cd $(dirname $0)/..
+
+  make build/kdshm-test
+  build/kdshm-test
+)
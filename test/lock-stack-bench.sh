@@ -0,0 +1,33 @@
+#!/bin/bash
+
+# Compares the cost of lock events with lock wait stacks symbolized eagerly
+# (on every wait, as before lockstack=lazy became the default), lazily and not at all.
+# Prints lock acquisitions per second of LockTarget; higher means cheaper lock events.
+#
+#   test/lock-stack-bench.sh [threads] [millis]
+
+set -e  # exit on any failure
+
+if [ -z "${JAVA_HOME}" ]; then
+  echo "JAVA_HOME is not set"
+  exit 1
+fi
+
+THREADS=${1:-8}
+MILLIS=${2:-5000}
+
+(
+  cd $(dirname $0)
+
+  if [ "LockTarget.class" -ot "LockTarget.java" ]; then
+     ${JAVA_HOME}/bin/javac LockTarget.java
+  fi
+
+  AGENT=-agentpath:../build/libasyncProfiler.so=start,event=cpu,lock=0
+
+  printf "%-16s %s\n" "mode" "acquisitions/s"
+  printf "%-16s %s\n" "no profiler" "$(${JAVA_HOME}/bin/java LockTarget $THREADS $MILLIS)"
+  for MODE in eager lazy none; do
+    printf "%-16s %s\n" "lockstack=$MODE" "$(${JAVA_HOME}/bin/java $AGENT,lockstack=$MODE LockTarget $THREADS $MILLIS)"
+  done
+)
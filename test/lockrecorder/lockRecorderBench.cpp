@@ -0,0 +1,191 @@
+/*
+ * Copyright 2022 The Kindling Authors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+// Stress test and benchmark of the LockRecorder state (src/lockTable.h).
+// Every thread repeatedly registers itself as a waiter of a random lock and wakes up again,
+// the same sequence of calls MonitorContendedEnter / MonitorContendedEntered make.
+// A background thread expires lock holders all the time to stress removal from the tables.
+// Prints wait+wake pairs per second for the former design (one mutex around std::map of maps),
+// a single LockShard and the default number of shards. Rows with more threads than CPUs
+// show the oversubscribed case, where a lock holder may be preempted inside its critical section.
+//
+//   build/lockrecorder-bench [millis per run]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <chrono>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "../../src/lockTable.h"
+
+static const int LOCKS = 4096;
+static const int MAX_THREADS = 16;
+
+struct BenchWaiter {
+    BenchWaiter* _next_waiter;
+    int _native_thread_id;
+    int _wait_thread_id;
+    long long _wait_timestamp;
+};
+
+// The layout LockRecorder used before sharding
+class MapRecorder {
+  private:
+    std::mutex _mutex;
+    std::map<uintptr_t, int> _locked;
+    std::map<uintptr_t, std::map<int, BenchWaiter*>*> _waiting;
+
+  public:
+    bool addWaiter(uintptr_t address, BenchWaiter* waiter) {
+        std::lock_guard<std::mutex> guard(_mutex);
+        auto locked = _locked.find(address);
+        waiter->_wait_thread_id = locked == _locked.end() ? -1 : locked->second;
+        auto it = _waiting.find(address);
+        if (it == _waiting.end()) {
+            it = _waiting.emplace(address, new std::map<int, BenchWaiter*>()).first;
+        }
+        return it->second->emplace(waiter->_native_thread_id, waiter).second;
+    }
+
+    BenchWaiter* wake(uintptr_t address, int thread_id) {
+        std::lock_guard<std::mutex> guard(_mutex);
+        auto it = _waiting.find(address);
+        if (it == _waiting.end()) {
+            return NULL;
+        }
+        auto waiter = it->second->find(thread_id);
+        if (waiter == it->second->end()) {
+            return NULL;
+        }
+        BenchWaiter* result = waiter->second;
+        it->second->erase(waiter);
+        if (it->second->empty()) {
+            delete it->second;
+            _waiting.erase(it);
+        }
+        _locked[address] = thread_id;
+        return result;
+    }
+
+    void expireHolders() {
+        std::lock_guard<std::mutex> guard(_mutex);
+        for (auto it = _locked.begin(); it != _locked.end(); ) {
+            it = _waiting.find(it->first) == _waiting.end() ? _locked.erase(it) : ++it;
+        }
+    }
+};
+
+class ShardedRecorder {
+  private:
+    LockShards<BenchWaiter> _shards;
+
+  public:
+    ShardedRecorder(int shards) : _shards(shards) {
+    }
+
+    bool addWaiter(uintptr_t address, BenchWaiter* waiter) {
+        return _shards.addWaiter(address, waiter, true);
+    }
+
+    BenchWaiter* wake(uintptr_t address, int thread_id) {
+        return _shards.wake(address, thread_id);
+    }
+
+    void expireHolders() {
+        _shards.expireHolders([](u64) { return true; });
+    }
+};
+
+template <class Recorder>
+static double run(Recorder& recorder, int threads, int millis) {
+    volatile bool stop = false;
+    std::vector<long long> ops(threads);
+    std::vector<std::thread> workers;
+
+    for (int t = 0; t < threads; t++) {
+        workers.push_back(std::thread([&recorder, &stop, &ops, t] {
+            BenchWaiter waiter;
+            waiter._native_thread_id = t + 1;
+            u32 seed = t * 2654435761u + 1;
+            long long count = 0;
+
+            while (!stop) {
+                for (int i = 0; i < 256; i++) {
+                    seed ^= seed << 13;
+                    seed ^= seed >> 17;
+                    seed ^= seed << 5;
+                    uintptr_t address = 0x10000000 + (uintptr_t)(seed % LOCKS) * 16;
+
+                    waiter._wait_timestamp = count;
+                    if (!recorder.addWaiter(address, &waiter)) {
+                        fprintf(stderr, "Thread %d is already waiting for %lx\n", t + 1, (unsigned long)address);
+                        exit(1);
+                    }
+                    if (recorder.wake(address, t + 1) != &waiter) {
+                        fprintf(stderr, "Thread %d did not wake up on %lx\n", t + 1, (unsigned long)address);
+                        exit(1);
+                    }
+                    count++;
+                }
+            }
+            ops[t] = count;
+        }));
+    }
+
+    std::thread expirer([&recorder, &stop] {
+        while (!stop) {
+            recorder.expireHolders();
+            std::this_thread::sleep_for(std::chrono::microseconds(200));
+        }
+    });
+
+    std::this_thread::sleep_for(std::chrono::milliseconds(millis));
+    stop = true;
+    for (int t = 0; t < threads; t++) {
+        workers[t].join();
+    }
+    expirer.join();
+
+    long long total = 0;
+    for (int t = 0; t < threads; t++) {
+        total += ops[t];
+    }
+    return total / (millis * 1000.0);
+}
+
+int main(int argc, char** argv) {
+    int millis = argc > 1 ? atoi(argv[1]) : 200;
+
+    char sharded_title[32];
+    snprintf(sharded_title, sizeof(sharded_title), "%d shards", LOCK_SHARDS);
+    printf("%u CPUs\n", std::thread::hardware_concurrency());
+    printf("%8s %14s %14s %14s   (million wait+wake pairs/s)\n", "threads", "map+mutex", "1 shard", sharded_title);
+    for (int threads = 1; threads <= MAX_THREADS; threads *= 2) {
+        MapRecorder map_recorder;
+        ShardedRecorder single(1);
+        ShardedRecorder sharded(LOCK_SHARDS);
+
+        double map_ops = run(map_recorder, threads, millis);
+        double single_ops = run(single, threads, millis);
+        double sharded_ops = run(sharded, threads, millis);
+        printf("%8d %14.2f %14.2f %14.2f\n", threads, map_ops, single_ops, sharded_ops);
+    }
+    return 0;
+}
@@ -0,0 +1,42 @@
+#!/bin/bash
+
+# Profiles BusyThreadsTarget, many threads burning CPU at once, with a short CPU sampling
+# interval and prints the share of samples skipped because no call trace buffer was free
+# (ticks_skipped, "skipped" in the summary). Pass the library of another build, e.g. one from
+# before the per-thread call trace buffers, to print its rate next to the current one.
+#
+#   test/ticks-skipped-bench.sh [threads] [millis] [other libasyncProfiler.so]
+
+set -e  # exit on any failure
+
+if [ -z "${JAVA_HOME}" ]; then
+  echo "JAVA_HOME is not set"
+  exit 1
+fi
+
+THREADS=${1:-200}
+MILLIS=${2:-5000}
+OTHER_LIB=${3:+$(realpath $3)}
+
+(
+  cd $(dirname $0)
+
+  if [ "BusyThreadsTarget.class" -ot "BusyThreadsTarget.java" ]; then
+     ${JAVA_HOME}/bin/javac BusyThreadsTarget.java
+  fi
+
+  FILENAME=/tmp/ticks-skipped.txt
+
+  function skipped_rate() {
+    ${JAVA_HOME}/bin/java -agentpath:$1=start,event=cpu,interval=1ms,flat=1,file=$FILENAME BusyThreadsTarget $THREADS $MILLIS
+    local total=$(sed -n 's/^Total samples *: \([0-9]*\).*/\1/p' $FILENAME)
+    local skipped=$(sed -n 's/^skipped *: \(.*\)/\1/p' $FILENAME)
+    echo "${total:-0} samples, ${skipped:-0 (0.00%)} skipped"
+  }
+
+  printf "%-40s %s\n" "library" "ticks_skipped"
+  printf "%-40s %s\n" "build/libasyncProfiler.so" "$(skipped_rate $(realpath ../build/libasyncProfiler.so))"
+  if [ -n "$OTHER_LIB" ]; then
+    printf "%-40s %s\n" "$3" "$(skipped_rate $OTHER_LIB)"
+  fi
+)